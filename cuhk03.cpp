@@ -2,8 +2,11 @@
 #include <chrono>
 #include <fstream>
 #include <iostream>
-#include <random>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 #include <dlib/cmd_line_parser.h>
@@ -12,11 +15,25 @@
 #include <dlib/dnn.h>
 #include <dlib/rand.h>
 
+#include "cascade_scorer.h"
+#include "checkpoint.h"
+#include "cmc.h"
+#include "data_parallel_trainer.h"
 #include "dataset.h"
 #include "difference.h"
+#include "embedding.h"
+#include "feature_cache.h"
+#include "gallery_scorer.h"
 #include "input.h"
+#include "layer_timing.h"
 #include "multiclass_less.h"
+#include "patch_summary.h"
+#include "prefetch.h"
 #include "reinterpret.h"
+#include "replica_pool.h"
+#include "score_matrix.h"
+#include "sync_batch_norm.h"
+#include "trace.h"
 
 // ---------------------------------------------------------------------------
 
@@ -33,118 +50,291 @@ using connp = dlib::add_layer<dlib::con_<num_filters,nr,nc,stride_y,stride_x,0,0
 template <long N, template <typename> class BN, long shape, long stride, typename SUBNET>
 using block = dlib::relu<BN<connp<N, shape, shape, stride, stride, SUBNET>>>;
 
-template <template <typename> class BN_CON, template <typename> class BN_FC>
-using mod_idla = loss_multiclass_log_lr<dlib::fc<2,
-                                        dlib::relu<BN_FC<dlib::fc<500,reinterpret<2,
-                                        dlib::max_pool<2,2,2,2,block<25,BN_CON,3,1,
-                                        block<25,BN_CON,5,5, // patch summary
-                                        dlib::relu<cross_neighborhood_differences<5,5,
-                                        dlib::max_pool<2,2,2,2,block<25,BN_CON,3,1,block<25,BN_CON,3,1,
-                                        dlib::max_pool<2,2,2,2,block<20,BN_CON,3,1,block<20,BN_CON,3,1,
-                                        input_rgb_image_pair
-                                        >>>>>>>>>>>>>>>>>;
+// Layers that only depend on a single image
+template <template <typename> class BN_CON, typename SUBNET>
+using idla_tower = dlib::max_pool<2,2,2,2,block<25,BN_CON,3,1,block<25,BN_CON,3,1,
+                   dlib::max_pool<2,2,2,2,block<20,BN_CON,3,1,block<20,BN_CON,3,1,
+                   SUBNET
+                   >>>>>>;
 
-using net_type = mod_idla<dlib::bn_con, dlib::bn_fc>;    // Training Net
-using anet_type = mod_idla<dlib::affine, dlib::affine>;  // Testing Net
+template <typename SUBNET>
+using differences = cross_neighborhood_differences_relu<5,5,SUBNET>;
+
+// Networks written before the differencing layer and its ReLU were fused
+// have them as separate layers (see convert_legacy_net()).
+template <typename SUBNET>
+using legacy_differences = dlib::relu<cross_neighborhood_differences<5,5,SUBNET>>;
+
+// Layers that operate on image pairs
+template <
+    template <typename> class BN_CON,
+    template <typename> class BN_FC,
+    template <typename> class DIFFERENCES,
+    typename SUBNET
+    >
+using idla_head = dlib::fc<2,
+                  dlib::relu<BN_FC<dlib::fc<500,reinterpret<2,
+                  dlib::max_pool<2,2,2,2,block<25,BN_CON,3,1,
+                  block<25,BN_CON,5,5, // patch summary
+                  DIFFERENCES<
+                  SUBNET
+                  >>>>>>>>>;
+
+template <
+    template <typename> class BN_CON,
+    template <typename> class BN_FC,
+    template <typename> class DIFFERENCES = differences
+    >
+using mod_idla = loss_multiclass_log_lr<idla_head<BN_CON, BN_FC, DIFFERENCES, idla_tower<BN_CON, input_rgb_image_pair>>>;
+
+// With IDLA_LAYER_TIMING defined, every layer records its forward and
+// backward times (see layer_timing.h). The batch normalization layers are
+// dlib's unless the minibatch is split across replicas (see
+// sync_batch_norm.h).
+using net_type = timed_net<mod_idla<sync_bn_con, sync_bn_fc>>;      // Training Net
+using anet_type = timed_net<mod_idla<dlib::affine, dlib::affine>>;  // Testing Net
+using legacy_net_type = timed_net<mod_idla<sync_bn_con, sync_bn_fc, legacy_differences>>;
+
+// Inference-only head that runs on cached tower outputs. The differencing
+// layer and the patch summary convolution are fused, so all other layers line
+// up with the first head_type::num_computational_layers layers of the testing
+// net. The fused layer runs in broadcast mode, i.e. the head takes one probe
+// feature map followed by the gallery feature maps it is scored against.
+template <typename SUBNET>
+using idla_fused_head = dlib::fc<2,
+                        dlib::relu<dlib::affine<dlib::fc<500,reinterpret<2,
+                        dlib::max_pool<2,2,2,2,block<25,dlib::affine,3,1,
+                        dlib::relu<dlib::affine<cross_neighborhood_patch_summary<25,5,5, // patch summary
+                        SUBNET
+                        >>>>>>>>>>;
+
+using head_type = timed_net<dlib::softmax<idla_fused_head<input_feature_maps>>>;
 
 // ---------------------------------------------------------------------------
 
 typedef input_rgb_image_pair::input_type input_type;
 
+typedef input_rgb_image_pair::input_type input_type;
+
+/*!
+    ensures:
+        - copies the parameters of legacy, a network written before the
+          differencing layer and its ReLU were fused, into net. Then net
+          computes the same outputs as legacy.
+*/
+void convert_legacy_net(net_type& net, const legacy_net_type& legacy)
+{
+    // dlib sets up a layer on its first forward pass, which would otherwise
+    // overwrite the copied parameters. The pair only needs the image size
+    // of the dataset.
+    const dlib::matrix<dlib::rgb_pixel> img(160, 60);
+    const rgb_image_view view(img);
+    const input_type sample(&view, &view);
+    dlib::resizable_tensor x;
+    net.to_tensor(&sample, &sample+1, x);
+    net.forward(x);
+
+    // Layer 13 of net is the fused differencing layer, which has no
+    // parameters. The layers above it match those of legacy, and its tower
+    // follows one layer later in legacy.
+    const size_t differences_idx = 13;
+    copy_layer_details<1, differences_idx>::copy(net, legacy);
+    dlib::layer<differences_idx+1>(net) = dlib::layer<differences_idx+2>(legacy);
+}
+
+/*!
+    ensures:
+        - deserializes item from filename. If that fails, reads filename
+          into legacy_item instead and calls convert(legacy_item).
+
+    throws:
+        - dlib::serialization_error of the first attempt, if filename can
+          be read into neither.
+*/
+template <typename T, typename LEGACY_T, typename F>
+void deserialize_or_convert(const std::string& filename, T& item, LEGACY_T& legacy_item, F convert)
+{
+    try {
+        dlib::deserialize(filename) >> item;
+    }
+    catch (dlib::serialization_error& e) {
+        try {
+            dlib::deserialize(filename) >> legacy_item;
+        }
+        catch (dlib::serialization_error&) {
+            throw e;
+        }
+        std::cout << "Converting '" << filename << "', which was written by an earlier version." << std::endl;
+        convert(legacy_item);
+    }
+}
+
 struct minibatch {
     std::vector<input_type> data;
     std::vector<unsigned long> labels;
+    normalized_image_cache normalized;  // filled in by prefetch workers
 };
 
+/*
+    Draws minibatches of positive and negative image pairs from the training
+    identities. Half of the pairs are positive: an image of the first view and
+    one of the second view of the same identity. The other half are negative:
+    an image of the first view of each of those identities and one of the
+    second view of a different identity. All identities of a minibatch are
+    distinct.
+
+    The identities that can take either role are determined once, so
+    minibatches are drawn in O(size) without retries. Generators with
+    different seeds give independent streams, e.g. for parallel producers.
+*/
 class minibatch_generator {
 public:
     minibatch_generator(
         const std::vector<person_set>& pset_,
-        const std::vector<int>& tidx
-    ) : pset(pset_)
+        const std::vector<int>& tidx,
+        time_t seed = 0
+    ) : rng(seed), pset(pset_), negative_pos(pset_.size(), -1)
     {
+        std::vector<bool> is_test(pset_.size(), false);
+        for (int i : tidx)
+            is_test[i] = true;
+
         for (unsigned long i = 0; i < pset_.size(); ++i) {
-            if (std::find(tidx.begin(), tidx.end(), i) == tidx.end())
-                tridx.push_back(i);
+            if (is_test[i] || pset_[i].view(1).empty())
+                continue;
+
+            negative_pos[i] = negatives.size();
+            negatives.push_back(i);
+            if (!pset_[i].view(0).empty())
+                anchors.push_back(i);
         }
     }
 
     minibatch operator()(unsigned long size)
     {
-        DLIB_CASSERT(size % 2 == 0, "");
+        minibatch batch;
+        (*this)(size, batch);
+        return batch;
+    }
 
-        // Create random sampling object
-        dlib::random_subset_selector<int> samples;
-        bool empty_view = true;
-        while (empty_view) {
-            unsigned int seed = rng.get_random_32bit_number();
-            samples = dlib::randomly_subsample(tridx, size, seed);
-
-            empty_view = false;
-            for (unsigned int i = 0; i < size/2; ++i) {
-                unsigned int v0_size = pset[samples[i]].view(0).size();
-                unsigned int pv1_size = pset[samples[i]].view(1).size();
-                unsigned int nv1_size = pset[samples[i+size/2]].view(1).size();
-                if (v0_size == 0 || pv1_size == 0 || nv1_size == 0) {
-                    empty_view = true;
-                    break;
-                }
-            }
+    /*
+        Fills batch with size pairs, reusing the memory of its buffers.
+    */
+    void operator()(unsigned long size, minibatch& batch)
+    {
+        const unsigned long half = size/2;
+        DLIB_CASSERT(size % 2 == 0, "");
+        DLIB_CASSERT(half <= anchors.size() && size <= negatives.size(),
+                     "Not enough training identities for the minibatch size.");
+
+        // Partial Fisher-Yates shuffles keep anchors and negatives
+        // permutations of the eligible identities, with the drawn ones at the
+        // front. The anchors are moved to the front of the negatives, so that
+        // the negative identities are drawn from the rest.
+        for (unsigned long i = 0; i < half; ++i) {
+            std::swap(anchors[i], anchors[i + random_index(anchors.size()-i)]);
+            swap_negatives(i, negative_pos[anchors[i]]);
         }
+        for (unsigned long i = half; i < size; ++i)
+            swap_negatives(i, i + random_index(negatives.size()-i));
 
-        // Build minibatch
-        std::vector<std::pair<input_type, unsigned long>> tmp;
-        for (unsigned long i = 0; i < size/2; ++i) {
-            const std::vector<dlib::matrix<dlib::rgb_pixel>>& view0 = pset[samples[i]].view(0);
-            const std::vector<dlib::matrix<dlib::rgb_pixel>>& pview1 = pset[samples[i]].view(1);
+        batch.data.resize(size);
+        batch.labels.resize(size);
+        for (unsigned long i = 0; i < half; ++i) {
+            const person_set::view_type view0 = pset[anchors[i]].view(0);
+            const person_set::view_type pview1 = pset[anchors[i]].view(1);
+            const person_set::view_type nview1 = pset[negatives[half+i]].view(1);
 
             // Construct positive pair
-            unsigned int pidx0 = rng.get_random_32bit_number() % view0.size();
-            unsigned int pidx1 = rng.get_random_32bit_number() % pview1.size();
-            const dlib::matrix<dlib::rgb_pixel>& pimg0 = view0[pidx0];
-            const dlib::matrix<dlib::rgb_pixel>& pimg1 = pview1[pidx1];
-            input_type ppair = {&pimg0, &pimg1};
-            tmp.emplace_back(ppair, 1);
+            const person_set::image_type& pimg0 = view0[random_index(view0.size())];
+            const person_set::image_type& pimg1 = pview1[random_index(pview1.size())];
+            batch.data[2*i] = {&pimg0, &pimg1};
+            batch.labels[2*i] = 1;
 
             // Construct negative pair
-            const std::vector<dlib::matrix<dlib::rgb_pixel>>& nview1 = pset[samples[i+size/2]].view(1);
-            unsigned int nidx0 = rng.get_random_32bit_number() % view0.size();
-            unsigned int nidx1 = rng.get_random_32bit_number() % nview1.size();
-
-            const dlib::matrix<dlib::rgb_pixel>& nimg0 = view0[nidx0];
-            const dlib::matrix<dlib::rgb_pixel>& nimg1 = nview1[nidx1];
-            input_type npair = {&nimg0, &nimg1};
-            tmp.emplace_back(npair, 0);
+            const person_set::image_type& nimg0 = view0[random_index(view0.size())];
+            const person_set::image_type& nimg1 = nview1[random_index(nview1.size())];
+            batch.data[2*i+1] = {&nimg0, &nimg1};
+            batch.labels[2*i+1] = 0;
         }
-        auto engine = std::default_random_engine{};
-        std::shuffle(std::begin(tmp), std::end(tmp), engine);
 
-        minibatch batch;
-        batch.data.reserve(size);
-        batch.labels.reserve(size);
-        for (auto i : tmp) {
-            batch.data.push_back(i.first);
-            batch.labels.push_back(i.second);
+        // Shuffle the pairs
+        for (unsigned long i = size; i > 1; --i) {
+            const unsigned long j = random_index(i);
+            std::swap(batch.data[i-1], batch.data[j]);
+            std::swap(batch.labels[i-1], batch.labels[j]);
         }
-        return batch;
     }
 private:
+    unsigned long random_index(unsigned long n)
+    {
+        return rng.get_random_32bit_number() % n;
+    }
+
+    void swap_negatives(long i, long j)
+    {
+        std::swap(negatives[i], negatives[j]);
+        negative_pos[negatives[i]] = i;
+        negative_pos[negatives[j]] = j;
+    }
+
     dlib::rand rng;
     const std::vector<person_set>& pset; 
-    std::vector<int> tridx;                //  training index
+    std::vector<int> anchors;       // training identities with images in both views
+    std::vector<int> negatives;     // training identities with images in the second view
+    std::vector<long> negative_pos; // position of each identity in negatives, or -1
 };
 
 // ---------------------------------------------------------------------------
 
+void print_cache_statistics(const lazy_image_cache& cache)
+{
+    const lazy_image_cache::statistics stats = cache.get_statistics();
+    std::cout << "Image cache: " << stats.num_cached << " images (" << (stats.cached_bytes >> 20)
+              << " of " << (stats.capacity_bytes >> 20) << " MB), hit rate " << stats.hit_rate()
+              << ", " << stats.evictions << " evictions." << std::endl;
+}
+
+// ---------------------------------------------------------------------------
+
 int main(int argc, char* argv[]) try
 {
     dlib::command_line_parser parser;
     parser.add_option("i", "Directory holding the CUHK03 dataset", 1);
     parser.add_option("detected", "Indicates the 'detected' dataset should be used. 'labeled' is used by default.");
+    parser.add_option("threads", "Number of threads used by the CPU differencing layer. Defaults to the number of hardware threads.", 1);
+    parser.add_option("dataset-cache", "Binary cache of the resized dataset, memory-mapped on later runs. Created if missing or out of date.", 1);
+    parser.add_option("lazy", "Decode images on first use into an LRU cache of the given size in MB instead of loading the whole dataset up front.", 1);
+    parser.add_option("cache-images", "Normalize every image once after loading instead of on every use (needs about 1.6GB more memory).");
+    parser.add_option("prefetch-workers", "Number of threads preparing minibatches ahead of training. Defaults to 1.", 1);
+    parser.add_option("prefetch-depth", "Number of minibatches each prefetch thread keeps ready. Defaults to 2.", 1);
+#ifndef DLIB_USE_CUDA
+    parser.add_option("replicas", "Split each minibatch across this many network replicas trained in their own threads. Defaults to 1.", 1);
+#endif
+    parser.add_option("load", "Test the network saved in the given .dnn file instead of training one.", 1);
+    parser.add_option("protocol", "Index of the test protocol, 0 to 19. Chosen at random by default.", 1);
+    parser.add_option("scores", "Write the scores of all probe and gallery images of the test protocol to the given file, for use with cuhk03_metrics.", 1);
+    parser.add_option("eval-workers", "Number of threads, each with its own copy of the network, used for testing. Defaults to the number of hardware threads (1 with CUDA).", 1);
+    parser.add_option("cascade", "Rank the gallery by pooled tower features and only score the given number of most similar gallery images per probe with the full network. Also writes the recall of this first stage.", 1);
+    parser.add_option("cmc-trials", "Estimate the cumulative match curve from this many random choices of gallery images per probe instead of computing it exactly.", 1);
+    parser.add_option("trace", "Write a timeline of the training and testing stages to the given file, in Chrome trace event format.", 1);
     parser.add_option("h", "Display a help message.");
 
     // Parse command line arguments
     parser.parse(argc, argv);
+    parser.check_option_arg_range("threads", 1, 1024);
+    parser.check_option_arg_range("lazy", 1, 1 << 20);
+    parser.check_option_arg_range("prefetch-workers", 1, 64);
+    parser.check_option_arg_range("prefetch-depth", 1, 64);
+    parser.check_option_arg_range("protocol", 0, 19);
+    parser.check_option_arg_range("eval-workers", 1, 1024);
+    parser.check_option_arg_range("cascade", 1, 1000000);
+    parser.check_option_arg_range("cmc-trials", 1, 1000000);
+#ifndef DLIB_USE_CUDA
+    parser.check_option_arg_range("replicas", 1, 64);
+#endif
+    parser.check_incompatible_options("lazy", "dataset-cache");
+    parser.check_incompatible_options("lazy", "cache-images");
     if (parser.option("h")) {
         std::cout << "Usage: run_cuhk03 [--detected] -i cuhk03_dir\n";
         parser.print_options();
@@ -157,6 +347,30 @@ int main(int argc, char* argv[]) try
         return 0;
     }
 
+    // The trace is written after training and again after testing.
+    std::string trace_file;
+    if (parser.option("trace")) {
+        trace_file = parser.option("trace").argument();
+        start_tracing();
+        set_trace_thread_name("main");
+    }
+
+    unsigned long num_replicas = 1;
+#ifndef DLIB_USE_CUDA
+    if (parser.option("replicas")) {
+        num_replicas = dlib::sa = parser.option("replicas").argument();
+    }
+
+    // Replicas run their differencing layers concurrently, so by default they
+    // share the hardware threads between them.
+    if (parser.option("threads")) {
+        set_differencing_num_threads(dlib::sa = parser.option("threads").argument());
+    }
+    else if (num_replicas > 1) {
+        set_differencing_num_threads(std::max<unsigned long>(1, std::thread::hardware_concurrency()/num_replicas));
+    }
+#endif
+
     // Load in dataset and time it
     std::string cuhk03_dir = parser.option("i").argument();
 #if defined _WIN32
@@ -182,33 +396,57 @@ int main(int argc, char* argv[]) try
 
     std::chrono::time_point<std::chrono::system_clock> start, end;
     start = std::chrono::system_clock::now();
-    load_cuhk03_dataset(cuhk03_dir+"cuhk-03.mat", pset, test_protocols, dset_type);
+    std::shared_ptr<const lazy_image_cache> lazy_cache;
+    {
+        trace_scope scope("load dataset");
+        if (parser.option("lazy")) {
+            const size_t cache_bytes = static_cast<size_t>(dlib::sa = parser.option("lazy").argument()) << 20;
+            lazy_cache = load_cuhk03_dataset_lazy(cuhk03_dir+"cuhk-03.mat", pset, test_protocols, cache_bytes, dset_type);
+        }
+        else {
+            std::string dataset_cache = parser.option("dataset-cache") ? parser.option("dataset-cache").argument() : "";
+            load_cuhk03_dataset(cuhk03_dir+"cuhk-03.mat", pset, test_protocols, dset_type, 160, 60, dataset_cache);
+        }
+    }
     end = std::chrono::system_clock::now();
 
     std::chrono::duration<double> elapsed_seconds = end-start;
     std::cout << elapsed_seconds.count() << " seconds to load dataset." << std::endl;
 
-    // Start training code
+    // Optionally normalize all images up front, so that building input tensors
+    // reduces to copies.
+    std::shared_ptr<normalized_image_cache> image_cache;
+    if (parser.option("cache-images")) {
+        trace_scope scope("cache images");
+        image_cache = std::make_shared<normalized_image_cache>();
+        for (const person_set& person : pset) {
+            for (unsigned int v = 0; v < person.get_num_views(); ++v) {
+                for (const person_set::image_type& img : person.view(v)) {
+                    image_cache->add(img);
+                }
+            }
+        }
+        std::cout << "Cached " << image_cache->size() << " normalized images." << std::endl;
+    }
+
+    // Start training code. Without a cache of the whole dataset, the input
+    // layer reads the images of each minibatch from a cache that is refilled
+    // with the normalized images prepared by the prefetch workers.
+    std::shared_ptr<normalized_image_cache> batch_cache;
+    if (!image_cache)
+        batch_cache = std::make_shared<normalized_image_cache>();
+
     net_type net;
-    dlib::dnn_trainer<net_type> trainer(net);
-    trainer.be_verbose();
+    dlib::input_layer(net).set_image_cache(image_cache ? image_cache : batch_cache);
 
     // Set learning rate schedule
     unsigned long max_iterations = 210000;
-    unsigned long current_iteration = trainer.get_train_one_step_calls();
-
-    dlib::matrix<double,0,1> inverse_learning_rate_schedule;
-    inverse_learning_rate_schedule.set_size(max_iterations-current_iteration);
-
     double learning_rate = 0.01;
-    trainer.set_learning_rate(learning_rate);
-
     double gamma = 0.0001;
     double power = 0.75;
-    for (unsigned long i = current_iteration; i < max_iterations; ++i) {
-        inverse_learning_rate_schedule(i-current_iteration) = learning_rate*std::pow(1.0+gamma*i, -power);
-    }
-    trainer.set_learning_rate_schedule(inverse_learning_rate_schedule);
+    auto scheduled_learning_rate = [=](unsigned long i) {
+        return learning_rate*std::pow(1.0+gamma*i, -power);
+    };
 
     // Save training progress
     std::string save_name;
@@ -217,106 +455,384 @@ int main(int argc, char* argv[]) try
         oss << "cuhk03_" << ((dset_type == LABELED) ? "labeled" : "detected") << "_modidla";
         save_name = oss.str();
     }
-    trainer.set_synchronization_file(save_name+".dat", std::chrono::seconds(60));
 
     // Prepare data
     long batch_size = 128;
     dlib::rand rng(0);
     unsigned int test_index = rng.get_random_32bit_number() % 20;
-    minibatch_generator batchgen(pset, test_protocols[test_index]);
-
-    // Train neural network
-    std::cout << std::endl << net << std::endl;
-    while (trainer.get_train_one_step_calls() < max_iterations) {
-        minibatch batch = batchgen(batch_size);
-        trainer.train_one_step(batch.data.begin(), batch.data.end(), batch.labels.begin());
+    if (parser.option("protocol")) {
+        test_index = dlib::sa = parser.option("protocol").argument();
+    }
+    if (test_index >= test_protocols.size()) {
+        throw std::runtime_error("The dataset has no test protocol " + std::to_string(test_index) + ".");
+    }
+    std::cout << "Using test protocol " << test_index << "." << std::endl;
+
+    // Checkpoints are snapshotted in memory and written to disk by a
+    // background thread, so that training only pauses for the snapshot.
+    checkpoint_writer checkpoints;
+
+    if (parser.option("load")) {
+        // Only test a network trained earlier.
+        const std::string net_file = parser.option("load").argument();
+        std::cout << "Loading network from '" << net_file << "'." << std::endl;
+        legacy_net_type legacy;
+        deserialize_or_convert(net_file, net, legacy, [&](const legacy_net_type& l) {
+            convert_legacy_net(net, l);
+        });
     }
-    trainer.get_net();
+    else {
+        const std::chrono::seconds checkpoint_interval(60);
+
+        // Minibatches are sampled and their images normalized in the
+        // background. Worker w uses seed w, so the sequence of minibatches
+        // only depends on the number of workers.
+        const size_t prefetch_workers = parser.option("prefetch-workers") ?
+            static_cast<size_t>(dlib::sa = parser.option("prefetch-workers").argument()) : 1;
+        const size_t prefetch_depth = parser.option("prefetch-depth") ?
+            static_cast<size_t>(dlib::sa = parser.option("prefetch-depth").argument()) : 2;
+        const bool normalize_batches = static_cast<bool>(batch_cache);
+        prefetcher<minibatch> batches(prefetch_workers, prefetch_depth, [&](size_t w) {
+            auto batchgen = std::make_shared<minibatch_generator>(pset, test_protocols[test_index], w);
+            auto named = std::make_shared<bool>(false);
+            return [batchgen, batch_size, normalize_batches, named, w]() {
+                if (!*named) {
+                    set_trace_thread_name("prefetch "+std::to_string(w));
+                    *named = true;
+                }
+
+                minibatch batch;
+                {
+                    trace_scope scope("sample minibatch");
+                    (*batchgen)(batch_size, batch);
+                }
+                if (normalize_batches) {
+                    trace_scope scope("normalize minibatch");
+                    for (const input_type& pair : batch.data) {
+                        batch.normalized.add(*pair.first);
+                        batch.normalized.add(*pair.second);
+                    }
+                }
+                return batch;
+            };
+        });
+
+        // The input layer is only used by train_one_step() in this thread to
+        // build the input tensors, so its cache can be refilled here.
+        auto next_batch = [&]() {
+            trace_scope scope("wait for minibatch");
+            minibatch batch = batches.get();
+            if (batch_cache)
+                *batch_cache = std::move(batch.normalized);
+            return batch;
+        };
+
+        // Train neural network
+        std::cout << std::endl << net << std::endl;
+        if (num_replicas == 1) {
+            dlib::dnn_trainer<net_type> trainer(net);
+            trainer.be_verbose();
+
+            // Earlier versions let dnn_trainer write the state itself, which
+            // alternates between <name>.dat and <name>.dat_, and had separate
+            // differencing and ReLU layers. Only the network of such a state
+            // can be converted, since dnn_trainer does not let its solvers or
+            // step count be set.
+            const std::string sync_file = save_name+".dat";
+            const std::string resume_file = latest_checkpoint(sync_file);
+            if (!resume_file.empty()) {
+                legacy_net_type legacy;
+                dlib::dnn_trainer<legacy_net_type> legacy_trainer(legacy);
+                deserialize_or_convert(resume_file, trainer, legacy_trainer, [&](dlib::dnn_trainer<legacy_net_type>& t) {
+                    convert_legacy_net(net, t.get_net());
+                    std::cout << "Restarting the solvers and the learning rate schedule, which were at step "
+                              << t.get_train_one_step_calls() << "." << std::endl;
+                });
+                std::cout << "Resuming from step " << trainer.get_train_one_step_calls() << "." << std::endl;
+            }
+
+            unsigned long current_iteration = trainer.get_train_one_step_calls();
+            dlib::matrix<double,0,1> inverse_learning_rate_schedule;
+            inverse_learning_rate_schedule.set_size(max_iterations-current_iteration);
+            trainer.set_learning_rate(learning_rate);
+            for (unsigned long i = current_iteration; i < max_iterations; ++i) {
+                inverse_learning_rate_schedule(i-current_iteration) = scheduled_learning_rate(i);
+            }
+            trainer.set_learning_rate_schedule(inverse_learning_rate_schedule);
+
+            std::chrono::time_point<std::chrono::steady_clock> last_sync = std::chrono::steady_clock::now();
+            while (trainer.get_train_one_step_calls() < max_iterations) {
+                minibatch batch = next_batch();
+
+                // dnn_trainer only builds the input tensor in this thread and
+                // runs the step in its own thread, which is only traced through
+                // timed layers (see layer_timing.h).
+                {
+                    trace_scope scope("train_one_step");
+                    trainer.train_one_step(batch.data.begin(), batch.data.end(), batch.labels.begin());
+                }
 
-    // Save the network to disk
-    net.clean();
-    std::cout << "Saving network..." << std::endl;
-    dlib::serialize(save_name+".dnn") << net;
+                if (std::chrono::steady_clock::now() - last_sync > checkpoint_interval) {
+                    checkpoints.save(sync_file, trainer);
+                    last_sync = std::chrono::steady_clock::now();
+                }
+            }
+            trainer.get_net();
+        }
+        else {
+            // Each step is split across the replicas, which compute the gradients
+            // of their shards in parallel. See data_parallel_trainer.h.
+            data_parallel_trainer<net_type> trainer(net, num_replicas);
+            trainer.be_verbose();
+
+            const std::string sync_file = save_name+"_replicas.dat";
+            if (dlib::file_exists(sync_file)) {
+                dlib::deserialize(sync_file) >> trainer;
+                std::cout << "Resuming from step " << trainer.get_train_one_step_calls() << "." << std::endl;
+            }
+
+            std::chrono::time_point<std::chrono::steady_clock> last_sync = std::chrono::steady_clock::now();
+            std::cout << "Training with " << num_replicas << " replicas." << std::endl;
+            while (trainer.get_train_one_step_calls() < max_iterations) {
+                minibatch batch = next_batch();
+                trainer.set_learning_rate(scheduled_learning_rate(trainer.get_train_one_step_calls()));
+                trainer.train_one_step(batch.data.begin(), batch.data.end(), batch.labels.begin());
 
-    // Test the network on the CUHK03 testing data.
-    dlib::softmax<anet_type::subnet_type> tnet;
+                if (std::chrono::steady_clock::now() - last_sync > checkpoint_interval) {
+                    checkpoints.save(sync_file, trainer);
+                    last_sync = std::chrono::steady_clock::now();
+                }
+            }
+        }
+        if (lazy_cache)
+            print_cache_statistics(*lazy_cache);
+        if (!trace_file.empty())
+            write_trace(trace_file);
+#ifdef IDLA_LAYER_TIMING
+        std::cout << "Layer timings of training:" << std::endl;
+        print_layer_timings(std::cout);
+        reset_layer_timings();
+#endif
+
+        // Save the network to disk while it is being tested
+        net.clean();
+        std::cout << "Saving network..." << std::endl;
+        checkpoints.save(save_name+".dnn", net);
+    }
+
+    // Test the network on the CUHK03 testing data. The top layer is timed
+    // like that of the head, which gets its layer details from tnet.
+    timed<dlib::softmax<anet_type::subnet_type>> tnet;
     tnet.subnet() = net.subnet();
     std::cout << "Testing network on CUHK03 testing dataset." << std::endl;
 
+    // Split the testing net into the tower, which is run once per image, and
+    // the head, which is run once per image pair on the cached tower outputs.
+    // The head has one layer less than the corresponding part of the testing
+    // net because of the fused patch summary layer.
+    auto& tower = dlib::layer<head_type::num_computational_layers+1>(tnet);
+    typedef std::remove_reference<decltype(tower)>::type tower_type;
+
+    // Networks cannot be run from several threads at once, so every worker
+    // gets its own copy of the tower and the head.
+#ifdef DLIB_USE_CUDA
+    size_t eval_workers = 1;
+#else
+    size_t eval_workers = std::max(1u, std::thread::hardware_concurrency());
+#endif
+    if (parser.option("eval-workers")) {
+        eval_workers = dlib::sa = parser.option("eval-workers").argument();
+    }
+#ifndef DLIB_USE_CUDA
+    // Like the replicas during training, the workers share the hardware
+    // threads of their differencing layers.
+    if (!parser.option("threads")) {
+        set_differencing_num_threads(std::max<unsigned long>(1, std::thread::hardware_concurrency()/eval_workers));
+    }
+#endif
+
     // Use the specified test indices for evaluation
     const std::vector<int>& test_protocol = test_protocols[test_index];
-    std::vector<int> ranked_counter(test_protocol.size(), 0);
+    std::vector<double> ranked_counter(test_protocol.size(), 0);
     int num_probes = 0;
 
-    const int num_trials = 100;
-    dlib::console_progress_indicator pbar(test_protocol.size());
-    for (unsigned int i = 0; i < test_protocol.size(); ++i) {
-        // Specify the current probe ID
-        int pid = test_protocol[i];
+    std::vector<const person_set::image_type*> test_imgs;
+    for (int id : test_protocol) {
+        for (unsigned int v = 0; v < pset[id].get_num_views(); ++v) {
+            for (const person_set::image_type& img : pset[id].view(v)) {
+                test_imgs.push_back(&img);
+            }
+        }
+    }
+    feature_cache fcache;
+    {
+        replica_pool<tower_type> towers(tower, eval_workers);
+        fcache.add(towers, test_imgs);
+    }
 
-        pbar.print_status(i);
-        const std::vector<dlib::matrix<dlib::rgb_pixel>>& probe_imgs = pset[pid].view(0);
-        for (const dlib::matrix<dlib::rgb_pixel>& probe_img : probe_imgs) {
-            ++num_probes;
+    head_type hnet;
+    load_head(hnet, tnet, fcache.get(test_imgs.front()));
 
-            std::vector<std::vector<std::pair<float,int>>> trials(num_trials);
-            for (int t = 0; t < num_trials; ++t) {
-                trials[t].reserve(test_protocol.size());
-            }
+    // The gallery images of all identities, with the range of each identity.
+    std::vector<const feature_map*> gallery_feats;
+    std::vector<size_t> gallery_offsets;
+    for (int gid : test_protocol) {
+        gallery_offsets.push_back(gallery_feats.size());
+        for (const person_set::image_type& gallery_img : pset[gid].view(1)) {
+            gallery_feats.push_back(&fcache.get(&gallery_img));
+        }
+    }
+    gallery_offsets.push_back(gallery_feats.size());
+
+    // The scores of all probe images, whose rows are filled in by the ID
+    // they belong to, starting at probe_offsets[i] for the i-th ID.
+    score_matrix test_scores;
+    std::vector<size_t> probe_offsets;
+    for (int id : test_protocol) {
+        probe_offsets.push_back(test_scores.probe_ids.size());
+        test_scores.probe_ids.insert(test_scores.probe_ids.end(), pset[id].view(0).size(), id);
+        test_scores.gallery_ids.insert(test_scores.gallery_ids.end(), pset[id].view(1).size(), id);
+    }
+    test_scores.scores.resize(test_scores.num_probes()*test_scores.num_gallery());
+
+    // In cascade mode, the head only scores the gallery images closest to
+    // each probe in the space of pooled tower features.
+    const unsigned long cascade_k = parser.option("cascade") ?
+        static_cast<unsigned long>(dlib::sa = parser.option("cascade").argument()) : 0;
+    embedding_index gallery_index;
+    if (cascade_k > 0) {
+        for (const feature_map* gallery_feat : gallery_feats) {
+            gallery_index.add(pooled_embedding(*gallery_feat));
+        }
+    }
 
-            for (unsigned int j = 0; j < test_protocol.size(); ++j) {
-                int gid = test_protocol[j];
-                const std::vector<dlib::matrix<dlib::rgb_pixel>>& gallery_imgs = pset[gid].view(1);
+    replica_pool<head_type> heads(hnet, eval_workers);
+    std::vector<std::unique_ptr<gallery_scorer<head_type>>> scorers;
+    std::vector<std::unique_ptr<cascade_scorer<head_type>>> cascades;
+    for (size_t w = 0; w < heads.size(); ++w) {
+        if (cascade_k > 0) {
+            cascades.emplace_back(new cascade_scorer<head_type>(heads[w], gallery_index, cascade_k));
+        } else {
+            scorers.emplace_back(new gallery_scorer<head_type>(heads[w]));
+        }
+    }
 
-                std::vector<input_type> img_pairs;
-                img_pairs.reserve(gallery_imgs.size());
-                for (const dlib::matrix<dlib::rgb_pixel>& gallery_img : gallery_imgs) {
-                    img_pairs.emplace_back(&probe_img, &gallery_img);
-                }
+    // Single-shot ranks are computed exactly over all choices of gallery
+    // images unless sampling was asked for.
+    const int num_trials = parser.option("cmc-trials") ?
+        static_cast<int>(dlib::sa = parser.option("cmc-trials").argument()) : 0;
 
-                // Randomly choose one pairwise score to represent the current
-                // gallery ID
-                dlib::matrix<float> output = dlib::mat(tnet(img_pairs.begin(), img_pairs.end()));
+    // Probe IDs are scored in parallel. Each ID counts its ranks separately
+    // and, when sampling, draws its trials from its own generator, so the
+    // result does not depend on the number of workers or the order the IDs
+    // are processed in.
+    std::vector<std::vector<double>> id_ranked_counters(test_protocol.size());
+    std::vector<int> id_num_probes(test_protocol.size(), 0);
 
-                for (auto& trial : trials) {
-                    int tmp = rng.get_random_32bit_number() % output.nr();
-                    trial.emplace_back(output(tmp, 1), gid);
-                }
-            }
+    dlib::console_progress_indicator pbar(test_protocol.size());
+    std::mutex pbar_mutex;
+    unsigned long num_done = 0;
 
-            for (auto& trial : trials) {
-                // Sort score and ID pairs and scan for the matching ID
-                std::sort(trial.begin(), trial.end(),
-                          [](const std::pair<double,int>& i, const std::pair<double,int>& j) -> bool
-                          {
-                              return i.first > j.first;
-                          });
-
-                // Find the first occurrence of the same ID person
-                for (unsigned int j = 0; j < trial.size(); ++j) {
-                    if (pid == trial[j].second) {
-                        ++ranked_counter[j];
-                        break;
-                    }
-                }
+    heads.parallel_for(0, test_protocol.size(), [&](size_t w, long i) {
+        // Specify the current probe ID
+        int pid = test_protocol[i];
+        const person_set::view_type probe_imgs = pset[pid].view(0);
+        std::vector<double>& id_ranked_counter = id_ranked_counters[i];
+        id_ranked_counter.assign(test_protocol.size(), 0);
+        dlib::rand trial_rng(i);
+
+        // Score the probe images of this ID against the whole gallery at once
+        std::vector<const feature_map*> probe_feats;
+        for (const person_set::image_type& probe_img : probe_imgs) {
+            probe_feats.push_back(&fcache.get(&probe_img));
+        }
+        std::vector<float> scores;
+        if (cascade_k > 0) {
+            cascades[w]->score(probe_feats, gallery_feats, scores);
+        } else {
+            scorers[w]->score(probe_feats, gallery_feats, scores);
+        }
+        std::copy(scores.begin(), scores.end(), test_scores.scores.begin() + probe_offsets[i]*gallery_feats.size());
+
+        for (unsigned int p = 0; p < probe_feats.size(); ++p) {
+            trace_scope probe_scope("rank probe");
+            ++id_num_probes[i];
+            const float* probe_scores = &scores[p*gallery_feats.size()];
+            if (num_trials > 0) {
+                add_sampled_ranks(probe_scores, gallery_offsets, i, num_trials, trial_rng, id_ranked_counter);
+            } else {
+                add_expected_ranks(probe_scores, gallery_offsets, i, id_ranked_counter);
             }
         }
+
+        std::lock_guard<std::mutex> lock(pbar_mutex);
+        pbar.print_status(++num_done);
+    });
+
+    for (unsigned int i = 0; i < test_protocol.size(); ++i) {
+        num_probes += id_num_probes[i];
+        for (unsigned int j = 0; j < ranked_counter.size(); ++j) {
+            ranked_counter[j] += id_ranked_counters[i][j];
+        }
     }
 
     // Calculate the cumulative match curve for this dataset.
     dlib::matrix<double> cmc;
     cmc.set_size(1, ranked_counter.size());
-    int accumulated_count = 0;
+    double accumulated_count = 0;
 
     std::ofstream cmc_file;
     cmc_file.open("cmc_"+save_name+".csv");
     for (unsigned int i = 0; i < ranked_counter.size(); ++i) {
         accumulated_count += ranked_counter[i];
-        cmc(i) = static_cast<double>(accumulated_count)/(num_probes*num_trials);
+        cmc(i) = accumulated_count/num_probes;
         cmc_file << cmc(i) << ((i < (ranked_counter.size()-1)) ? "," : "\n");
     }
+    if (lazy_cache)
+        print_cache_statistics(*lazy_cache);
+#ifdef IDLA_LAYER_TIMING
+    std::cout << "Layer timings of testing:" << std::endl;
+    print_layer_timings(std::cout);
+#endif
     std::cout << "\nCumulative match curve saved to `cmc_cuhk03_modidla.csv`." << std::endl;
 
+    // The recall of the first stage of the cascade for every number of
+    // reranked gallery images, i.e. the fraction of probes that have an image
+    // of the same person among the K gallery images closest to them.
+    if (cascade_k > 0) {
+        score_matrix prefilter_scores;
+        prefilter_scores.probe_ids = test_scores.probe_ids;
+        prefilter_scores.gallery_ids = test_scores.gallery_ids;
+        std::vector<float> sims;
+        for (int pid : test_protocol) {
+            for (const person_set::image_type& probe_img : pset[pid].view(0)) {
+                gallery_index.similarities(pooled_embedding(fcache.get(&probe_img)), sims);
+                prefilter_scores.scores.insert(prefilter_scores.scores.end(), sims.begin(), sims.end());
+            }
+        }
+        const std::vector<double> recall = top_k_accuracy(prefilter_scores);
+
+        std::ofstream recall_file("recall_"+save_name+".csv");
+        for (unsigned int i = 0; i < recall.size(); ++i) {
+            recall_file << recall[i] << ((i < (recall.size()-1)) ? "," : "\n");
+        }
+        std::cout << "Recall of the first stage:";
+        for (unsigned long k : {1ul, 5ul, 10ul, 20ul, 50ul, cascade_k}) {
+            if (k <= recall.size()) {
+                std::cout << "  @" << k << " " << recall[k-1];
+            }
+        }
+        std::cout << "\nRecall for every K saved to `recall_" << save_name << ".csv`." << std::endl;
+    }
+
+    if (parser.option("scores")) {
+        save_score_matrix(parser.option("scores").argument(), test_scores);
+        std::cout << "Score matrix saved to `" << parser.option("scores").argument() << "`." << std::endl;
+    }
+
+    checkpoints.wait();
+    if (!trace_file.empty())
+        write_trace(trace_file);
     return 0;
 }
 catch (std::exception& e)
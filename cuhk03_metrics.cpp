@@ -0,0 +1,75 @@
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dlib/cmd_line_parser.h>
+
+#include "score_matrix.h"
+
+// ---------------------------------------------------------------------------
+
+// Writes values to filename as a single comma separated line, like the CMC
+// written by run_cuhk03.
+void write_csv(const std::string& filename, const std::vector<double>& values)
+{
+    std::ofstream fout(filename);
+    for (size_t i = 0; i < values.size(); ++i) {
+        fout << values[i] << ((i+1 < values.size()) ? "," : "\n");
+    }
+    if (!fout) {
+        throw std::runtime_error("Unable to write " + filename + ".");
+    }
+}
+
+void print_ranks(const std::string& name, const std::vector<double>& curve)
+{
+    std::cout << name << ":";
+    for (size_t k : {1, 5, 10, 20}) {
+        if (k <= curve.size()) {
+            std::cout << "  @" << k << " " << curve[k-1];
+        }
+    }
+    std::cout << std::endl;
+}
+
+// ---------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("cmc", "Write the single-shot cumulative match curve to the given CSV file.", 1);
+    parser.add_option("top-k", "Write the top-k accuracy over all gallery images for every k to the given CSV file.", 1);
+    parser.add_option("h", "Display a help message.");
+
+    // Parse command line arguments
+    parser.parse(argc, argv);
+    if (parser.option("h") || parser.number_of_arguments() != 1) {
+        std::cout << "Usage: cuhk03_metrics [--cmc file] [--top-k file] scores_file\n";
+        std::cout << "Computes metrics from a score matrix written by run_cuhk03 --scores.\n";
+        parser.print_options();
+        return 0;
+    }
+
+    const score_matrix m = load_score_matrix(parser[0]);
+    std::cout << m.num_probes() << " probe images, " << m.num_gallery() << " gallery images." << std::endl;
+
+    const std::vector<double> cmc = single_shot_cmc(m);
+    const std::vector<double> top_k = top_k_accuracy(m);
+    std::cout << "mAP: " << mean_average_precision(m) << std::endl;
+    print_ranks("Single-shot CMC", cmc);
+    print_ranks("Top-k accuracy", top_k);
+
+    if (parser.option("cmc")) {
+        write_csv(parser.option("cmc").argument(), cmc);
+    }
+    if (parser.option("top-k")) {
+        write_csv(parser.option("top-k").argument(), top_k);
+    }
+    return 0;
+}
+catch (std::exception& e)
+{
+    std::cout << e.what() << std::endl;
+}
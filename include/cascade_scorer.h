@@ -0,0 +1,111 @@
+#ifndef IDLA__CASCADE_SCORER_H_
+#define IDLA__CASCADE_SCORER_H_
+
+#include <vector>
+
+#include <dlib/assert.h>
+
+#include "embedding.h"
+#include "gallery_scorer.h"
+#include "input.h"
+#include "trace.h"
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Scores probes against a gallery in two stages. The whole gallery is first
+    ranked by the cosine similarity of pooled tower features (see
+    pooled_embedding()), and only the k most similar gallery images are then
+    scored by the inference head. The cost of the head per probe is
+    therefore bounded by k rather than by the size of the gallery.
+
+    Gallery images that are not reranked get their similarity minus 2 as
+    score, which keeps their order but puts them below every head score.
+*/
+template <typename head_type>
+class cascade_scorer : dlib::noncopyable {
+public:
+    /*!
+        requires:
+            - head and gallery_index outlive this object.
+            - k > 0
+
+        ensures:
+            - #get_k() == k
+    */
+    cascade_scorer(head_type& head, const embedding_index& gallery_index, unsigned long k);
+
+    unsigned long get_k() const { return k; }
+
+    /*!
+        requires:
+            - all feature maps have the same size.
+            - gallery[g] is the feature map whose pooled embedding is
+              embedding g of gallery_index.
+
+        ensures:
+            - #scores.size() == probes.size()*gallery.size()
+            - #scores[p*gallery.size()+g] is the score the head assigns to
+              probes[p] and gallery[g] if gallery[g] is among the k gallery
+              images most similar to probes[p], and their similarity minus 2
+              otherwise.
+    */
+    void score(
+        const std::vector<const feature_map*>& probes,
+        const std::vector<const feature_map*>& gallery,
+        std::vector<float>& scores
+    );
+private:
+    const embedding_index& gallery_index;
+    unsigned long k;
+    gallery_scorer<head_type> scorer;
+};
+
+// =========================================================================== //
+//                               IMPLEMENTATION                                //
+// =========================================================================== //
+
+template <typename head_type>
+cascade_scorer<head_type>::cascade_scorer(
+    head_type& head,
+    const embedding_index& gallery_index_,
+    unsigned long k_
+) : gallery_index(gallery_index_), k(k_), scorer(head)
+{
+    DLIB_CASSERT(k > 0, "");
+}
+
+template <typename head_type>
+void cascade_scorer<head_type>::score(
+    const std::vector<const feature_map*>& probes,
+    const std::vector<const feature_map*>& gallery,
+    std::vector<float>& scores
+)
+{
+    DLIB_CASSERT(gallery.size() == gallery_index.size(), "");
+    scores.resize(probes.size()*gallery.size());
+
+    std::vector<float> sims;
+    std::vector<size_t> candidates;
+    std::vector<const feature_map*> candidate_feats;
+    std::vector<float> candidate_scores;
+    for (size_t p = 0; p < probes.size(); ++p) {
+        float* row = &scores[p*gallery.size()];
+        {
+            trace_scope scope("prefilter gallery");
+            const std::vector<float> query = pooled_embedding(*probes[p]);
+            candidates = gallery_index.nearest(query, k, sims);
+            for (size_t g = 0; g < gallery.size(); ++g)
+                row[g] = sims[g] - 2;
+        }
+
+        candidate_feats.clear();
+        for (size_t g : candidates)
+            candidate_feats.push_back(gallery[g]);
+        scorer.score({probes[p]}, candidate_feats, candidate_scores);
+        for (size_t i = 0; i < candidates.size(); ++i)
+            row[candidates[i]] = candidate_scores[i];
+    }
+}
+
+#endif // IDLA__CASCADE_SCORER_H_
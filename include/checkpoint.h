@@ -0,0 +1,125 @@
+#ifndef IDLA__CHECKPOINT_H_
+#define IDLA__CHECKPOINT_H_
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dlib/noncopyable.h>
+#include <dlib/serialize.h>
+#include <dlib/vectorstream.h>
+
+#include "trace.h"
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Writes serialized objects, e.g. trainer states and networks, to disk from
+    a background thread.
+
+    save() serializes an object into an in-memory buffer in the calling
+    thread, which is much faster than writing it to disk, and hands the
+    buffer to the writer thread. There are two buffers: while one is being
+    written, the next snapshot is serialized into the other. save() only
+    waits if the previous snapshot has not been written yet.
+
+    Files are replaced atomically: the data is written to <filename>.tmp,
+    which is then renamed to filename. A crash during a write therefore
+    leaves the previous checkpoint intact.
+*/
+class checkpoint_writer : dlib::noncopyable {
+public:
+    /*!
+        ensures:
+            - starts the writer thread.
+    */
+    checkpoint_writer();
+
+    /*!
+        ensures:
+            - writes any pending snapshot and stops the writer thread. Errors
+              are discarded; call wait() first to see them.
+    */
+    ~checkpoint_writer();
+
+    /*!
+        requires:
+            - item can be serialized with serialize(item, out).
+
+        ensures:
+            - takes a snapshot of item and schedules it to be written to
+              filename. item may be modified as soon as save() returns.
+
+        throws:
+            - std::runtime_error if a previous write failed.
+    */
+    template <typename T>
+    void save(const std::string& filename, const T& item);
+
+    /*!
+        ensures:
+            - returns once all scheduled snapshots are on disk.
+
+        throws:
+            - std::runtime_error if a write failed.
+    */
+    void wait();
+private:
+    struct snapshot {
+        std::string filename;
+        std::vector<char> data;
+    };
+
+    void schedule(snapshot& next);
+    void wait_until_idle(std::unique_lock<std::mutex>& lock);
+    void run();
+
+    // back is only used by the thread calling save(). front is owned by the
+    // writer thread while busy is set.
+    snapshot back;
+    snapshot front;
+    bool busy = false;
+    bool stopping = false;
+    std::string error;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread thread;
+};
+
+// ---------------------------------------------------------------------------
+
+/*!
+    ensures:
+        - returns the more recently modified of filename and filename+"_", or
+          filename if both were modified at the same time. dlib's dnn_trainer
+          alternates between these two names when it saves its state through
+          a synchronization file, so either may hold the latest one.
+        - returns an empty string if neither file exists.
+*/
+std::string latest_checkpoint(const std::string& filename);
+
+// =========================================================================== //
+//                               IMPLEMENTATION                                //
+// =========================================================================== //
+
+template <typename T>
+void checkpoint_writer::save(const std::string& filename, const T& item)
+{
+    trace_scope scope("checkpoint snapshot");
+
+    // The buffer keeps its capacity, so later snapshots do not reallocate.
+    back.filename = filename;
+    back.data.clear();
+    {
+        dlib::vectorstream out(back.data);
+        using dlib::serialize;
+        serialize(item, out);
+    }
+    schedule(back);
+}
+
+#endif // IDLA__CHECKPOINT_H_
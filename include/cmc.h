@@ -0,0 +1,60 @@
+#ifndef IDLA__CMC_H_
+#define IDLA__CMC_H_
+
+#include <vector>
+
+#include <dlib/rand.h>
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Rank statistics for the cumulative match curve (CMC) of single-shot
+    re-identification, where every gallery identity is represented by one of
+    its images, chosen uniformly at random.
+
+    Both functions take the scores of one probe image against all gallery
+    images, with the images of gallery identity j at
+    scores[offsets[j], offsets[j+1]). They add the distribution of the rank
+    of the true match (0 is the best rank) to rank_counts, so every call adds
+    a total of 1 and the CMC at rank r is the sum of rank_counts[0..r]
+    divided by the number of calls.
+*/
+
+/*!
+    requires:
+        - offsets.size() >= 2 and is increasing.
+        - match < offsets.size()-1
+        - rank_counts.size() == offsets.size()-1
+
+    ensures:
+        - adds the exact probability of every rank, taken over all choices of
+          gallery images, to rank_counts. Gallery images that score exactly
+          as high as the chosen image of the match are counted as ranked
+          ahead of it half of the time.
+*/
+void add_expected_ranks(
+    const float* scores,
+    const std::vector<size_t>& offsets,
+    size_t match,
+    std::vector<double>& rank_counts
+);
+
+/*!
+    requires:
+        - same as add_expected_ranks()
+        - num_trials > 0
+
+    ensures:
+        - estimates the rank probabilities from num_trials random choices of
+          gallery images drawn from rng, and adds them to rank_counts.
+*/
+void add_sampled_ranks(
+    const float* scores,
+    const std::vector<size_t>& offsets,
+    size_t match,
+    int num_trials,
+    dlib::rand& rng,
+    std::vector<double>& rank_counts
+);
+
+#endif // IDLA__CMC_H_
@@ -0,0 +1,356 @@
+#ifndef IDLA__DATA_PARALLEL_TRAINER_H_
+#define IDLA__DATA_PARALLEL_TRAINER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dlib/dnn.h>
+#include <dlib/threads.h>
+
+#include "sync_batch_norm.h"
+#include "trace.h"
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Trains a network on the CPU by splitting each minibatch across replicas of
+    the network that run in their own threads.
+
+    Every replica computes the parameter gradients of its shard of the
+    minibatch. The gradients are then summed in shared memory, weighted by
+    shard size, so that they equal the gradients of the whole minibatch. The
+    solver updates the parameters of the first replica, which is the network
+    passed to the constructor, and the new parameters are copied to the other
+    replicas. Training is therefore equivalent to training on a single
+    replica, up to floating point rounding.
+
+    Batch normalization layers must be sync_bn_ layers (see
+    sync_batch_norm.h) for this to hold, which normalize with the statistics
+    of the whole minibatch and update the running statistics of every
+    replica with them. dlib's bn_ layers would normalize each shard on its
+    own.
+*/
+template <typename net_type, typename solver_type = dlib::sgd>
+class data_parallel_trainer : dlib::noncopyable {
+public:
+    typedef typename net_type::training_label_type label_type;
+    typedef typename net_type::input_type input_type;
+
+    /*!
+        requires:
+            - num_replicas > 0
+
+        ensures:
+            - #get_net() == net, which must outlive this object.
+            - #get_num_replicas() == num_replicas
+            - every layer gets its own copy of solver.
+    */
+    data_parallel_trainer(
+        net_type& net,
+        unsigned long num_replicas,
+        const solver_type& solver = solver_type()
+    );
+
+    net_type& get_net() { return net; }
+    unsigned long get_num_replicas() const { return num_replicas; }
+
+    void set_learning_rate(double lr) { DLIB_CASSERT(lr > 0, ""); learning_rate = lr; }
+    double get_learning_rate() const { return learning_rate; }
+
+    unsigned long long get_train_one_step_calls() const { return train_one_step_calls; }
+
+    /*!
+        ensures:
+            - returns an exponential moving average of the training loss.
+    */
+    double get_average_loss() const { return average_loss; }
+
+    /*!
+        ensures:
+            - train_one_step() prints the progress about once a minute.
+    */
+    void be_verbose() { verbose = true; }
+
+    /*!
+        requires:
+            - std::distance(dbegin, dend) > 0
+            - lbegin points to one label per input.
+
+        ensures:
+            - performs one solver step on the minibatch [dbegin, dend).
+            - returns the loss of the minibatch.
+    */
+    template <typename data_iterator, typename label_iterator>
+    double train_one_step(data_iterator dbegin, data_iterator dend, label_iterator lbegin);
+
+    /*!
+        Saves and restores the network, solver states, learning rate and step
+        count. The replicas are recreated from the network on the next step.
+    */
+    template <typename N, typename S>
+    friend void serialize(const data_parallel_trainer<N,S>& item, std::ostream& out);
+    template <typename N, typename S>
+    friend void deserialize(data_parallel_trainer<N,S>& item, std::istream& in);
+private:
+    typedef std::vector<dlib::tensor*> tensor_list;
+
+    static tensor_list parameter_gradients(net_type& replica);
+    static tensor_list parameters(net_type& replica);
+
+    void sum_gradients(const std::vector<double>& weights);
+    void copy_parameters();
+
+    net_type& net;
+    unsigned long num_replicas;
+    std::vector<std::unique_ptr<net_type>> replicas;   // all but the first
+    std::vector<solver_type> solvers;
+    std::vector<dlib::resizable_tensor> inputs;
+    std::vector<double> losses;
+    std::shared_ptr<batch_norm_sync> bn_sync;
+    dlib::thread_pool pool;
+
+    double learning_rate = 0.01;
+    unsigned long long train_one_step_calls = 0;
+    double average_loss = 0;
+    bool verbose = false;
+    std::chrono::time_point<std::chrono::steady_clock> last_report;
+};
+
+// =========================================================================== //
+//                               IMPLEMENTATION                                //
+// =========================================================================== //
+
+template <typename net_type, typename solver_type>
+data_parallel_trainer<net_type,solver_type>::data_parallel_trainer(
+    net_type& net_,
+    unsigned long num_replicas_,
+    const solver_type& solver
+) : net(net_),
+    num_replicas(num_replicas_),
+    solvers(net_type::num_computational_layers, solver),
+    inputs(num_replicas_),
+    losses(num_replicas_),
+    bn_sync(std::make_shared<batch_norm_sync>()),
+    pool(num_replicas_),
+    last_report(std::chrono::steady_clock::now())
+{
+    DLIB_CASSERT(num_replicas > 0, "");
+}
+
+template <typename net_type, typename solver_type>
+template <typename data_iterator, typename label_iterator>
+double data_parallel_trainer<net_type,solver_type>::train_one_step(
+    data_iterator dbegin,
+    data_iterator dend,
+    label_iterator lbegin
+)
+{
+    const long num = std::distance(dbegin, dend);
+    DLIB_CASSERT(num > 0, "");
+
+    // Shard i covers [num*i/num_shards, num*(i+1)/num_shards). Trailing
+    // replicas are left idle if there are fewer samples than replicas.
+    const unsigned long num_shards = std::min<unsigned long>(num_replicas, num);
+    auto shard_begin = [&](unsigned long i) { return static_cast<long>(num*i/num_shards); };
+    auto compute_gradients = [&](unsigned long i) {
+        net_type& replica = (i == 0) ? net : *replicas[i-1];
+        try {
+            {
+                trace_scope scope("to_tensor");
+                replica.to_tensor(dbegin+shard_begin(i), dbegin+shard_begin(i+1), inputs[i]);
+            }
+            trace_scope scope("forward/backward");
+            losses[i] = replica.compute_parameter_gradients(inputs[i], lbegin+shard_begin(i));
+        }
+        catch (...) {
+            // The other replicas may be waiting for this one in a batch
+            // normalization layer.
+            bn_sync->abort();
+            throw;
+        }
+    };
+
+    // The replicas are copied from the network after a forward pass over a
+    // single sample has set it up. Otherwise, each replica would initialize
+    // its own parameters. The input layer may turn the sample into several,
+    // e.g. image pairs into two, so batch normalization is told that this is
+    // a setup pass, which leaves its running statistics unchanged.
+    if (replicas.size()+1 != num_replicas) {
+        set_batch_norm_sync(net, bn_sync, 0);
+        net.to_tensor(dbegin, dbegin+1, inputs[0]);
+        bn_sync->set_setup_pass(true);
+        try {
+            net.forward(inputs[0]);
+        }
+        catch (...) {
+            bn_sync->set_setup_pass(false);
+            throw;
+        }
+        bn_sync->set_setup_pass(false);
+        replicas.clear();
+        for (unsigned long i = 1; i < num_replicas; ++i) {
+            replicas.emplace_back(new net_type(net));
+            set_batch_norm_sync(*replicas.back(), bn_sync, i);
+        }
+    }
+
+    // The loss averages over the samples of a shard, so weighting shards by
+    // their size gives the average over the minibatch.
+    std::vector<double> weights(num_shards);
+    for (unsigned long i = 0; i < num_shards; ++i)
+        weights[i] = static_cast<double>(shard_begin(i+1)-shard_begin(i))/num;
+
+    bn_sync->begin_step(weights);
+    try {
+        for (unsigned long i = 1; i < num_shards; ++i)
+            pool.add_task_by_value([&compute_gradients, i]() { compute_gradients(i); });
+        try {
+            compute_gradients(0);
+        }
+        catch (...) {
+            // The other replicas fail as well once the first one aborted, and
+            // the original error is the one worth reporting.
+            try { pool.wait_for_all_tasks(); } catch (...) { }
+            throw;
+        }
+        pool.wait_for_all_tasks();
+    }
+    catch (...) {
+        bn_sync->end_step();
+        throw;
+    }
+    bn_sync->end_step();
+
+    double loss = 0;
+    for (unsigned long i = 0; i < num_shards; ++i)
+        loss += weights[i]*losses[i];
+
+    sum_gradients(weights);
+    {
+        trace_scope scope("solver update");
+        net.update_parameters(dlib::make_sstack(solvers), learning_rate);
+    }
+    copy_parameters();
+
+    average_loss = (train_one_step_calls == 0) ? loss : 0.99*average_loss + 0.01*loss;
+    ++train_one_step_calls;
+
+    if (verbose && std::chrono::steady_clock::now() - last_report > std::chrono::seconds(60)) {
+        last_report = std::chrono::steady_clock::now();
+        std::cout << "step#: " << train_one_step_calls
+                  << "  learning rate: " << learning_rate
+                  << "  average loss: " << average_loss << std::endl;
+    }
+    return loss;
+}
+
+// ---------------------------------------------------------------------------
+
+template <typename net_type, typename solver_type>
+typename data_parallel_trainer<net_type,solver_type>::tensor_list
+data_parallel_trainer<net_type,solver_type>::parameter_gradients(net_type& replica)
+{
+    tensor_list tensors;
+    dlib::visit_layer_parameter_gradients(replica, [&](size_t, dlib::tensor& t) {
+        if (t.size() != 0)
+            tensors.push_back(&t);
+    });
+    return tensors;
+}
+
+template <typename net_type, typename solver_type>
+typename data_parallel_trainer<net_type,solver_type>::tensor_list
+data_parallel_trainer<net_type,solver_type>::parameters(net_type& replica)
+{
+    tensor_list tensors;
+    dlib::visit_layer_parameters(replica, [&](size_t, dlib::tensor& t) {
+        if (t.size() != 0)
+            tensors.push_back(&t);
+    });
+    return tensors;
+}
+
+template <typename net_type, typename solver_type>
+void data_parallel_trainer<net_type,solver_type>::sum_gradients(const std::vector<double>& weights)
+{
+    trace_scope scope("sum gradients");
+    std::vector<tensor_list> grads;
+    grads.push_back(parameter_gradients(net));
+    for (unsigned long i = 1; i < weights.size(); ++i)
+        grads.push_back(parameter_gradients(*replicas[i-1]));
+
+    // Each tensor is summed in blocks, every block in the same replica
+    // order, so the result does not depend on scheduling.
+    const long block_size = 1 << 16;
+    std::vector<std::pair<size_t,long>> blocks;
+    for (size_t t = 0; t < grads[0].size(); ++t) {
+        for (long j = 0; j < static_cast<long>(grads[0][t]->size()); j += block_size)
+            blocks.emplace_back(t, j);
+    }
+
+    dlib::parallel_for(pool, 0, blocks.size(), [&](long b) {
+        const size_t t = blocks[b].first;
+        const long begin = blocks[b].second;
+        const long end = std::min<long>(begin+block_size, grads[0][t]->size());
+
+        float* sum = grads[0][t]->host();
+        for (long j = begin; j < end; ++j)
+            sum[j] *= weights[0];
+        for (size_t i = 1; i < grads.size(); ++i) {
+            const float* g = grads[i][t]->host();
+            const float w = weights[i];
+            for (long j = begin; j < end; ++j)
+                sum[j] += w*g[j];
+        }
+    });
+}
+
+template <typename net_type, typename solver_type>
+void data_parallel_trainer<net_type,solver_type>::copy_parameters()
+{
+    trace_scope scope("copy parameters");
+    const tensor_list params = parameters(net);
+    for (auto& replica : replicas) {
+        const tensor_list dest = parameters(*replica);
+        DLIB_CASSERT(dest.size() == params.size(), "");
+        for (size_t t = 0; t < params.size(); ++t)
+            dlib::memcpy(*dest[t], *params[t]);
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+template <typename N, typename S>
+void serialize(const data_parallel_trainer<N,S>& item, std::ostream& out)
+{
+    dlib::serialize("data_parallel_trainer", out);
+    dlib::serialize(item.train_one_step_calls, out);
+    dlib::serialize(item.learning_rate, out);
+    dlib::serialize(item.average_loss, out);
+    dlib::serialize(item.solvers, out);
+    dlib::serialize(item.net, out);
+}
+
+template <typename N, typename S>
+void deserialize(data_parallel_trainer<N,S>& item, std::istream& in)
+{
+    std::string version;
+    dlib::deserialize(version, in);
+    if (version != "data_parallel_trainer") {
+        throw dlib::serialization_error("Unexpected version found while deserializing data_parallel_trainer.");
+    }
+
+    dlib::deserialize(item.train_one_step_calls, in);
+    dlib::deserialize(item.learning_rate, in);
+    dlib::deserialize(item.average_loss, in);
+    dlib::deserialize(item.solvers, in);
+    dlib::deserialize(item.net, in);
+    item.replicas.clear();
+}
+
+#endif // IDLA__DATA_PARALLEL_TRAINER_H_
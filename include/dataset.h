@@ -1,20 +1,212 @@
 #ifndef IDLA__DATASET_H_
 #define IDLA__DATASET_H_
 
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <dlib/noncopyable.h>
 #include <dlib/image_transforms.h>
 
+#include "image_view.h"
+
+namespace H5
+{
+    class H5File;
+}
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Interface of the storage of the images of a dataset, addressed by index.
+*/
+class image_store {
+public:
+    typedef rgb_image_view image_type;
+
+    virtual ~image_store() = default;
+
+    virtual size_t size() const = 0;
+
+    /*!
+        requires:
+            - i < size()
+
+        ensures:
+            - returns the view of the i-th image. Its address is stable for
+              the lifetime of the store.
+    */
+    virtual const image_type& image(size_t i) const = 0;
+};
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Stores the pixels of a fixed number of equally sized rgb images in a single
+    64-byte aligned block, along with a view of each image. The block is either
+    owned by the arena or borrowed from backing storage, e.g. a memory-mapped
+    file, that the arena keeps alive.
+*/
+class image_arena : public image_store, dlib::noncopyable {
+public:
+    static const size_t alignment = 64;
+
+    /*!
+        ensures:
+            - allocates zero-initialized storage for num_images images of nr by
+              nc pixels.
+    */
+    image_arena(long nr, long nc, size_t num_images);
+
+    /*!
+        requires:
+            - pixels points to num_images*nr*nc pixels that stay valid as long
+              as backing is alive.
+
+        ensures:
+            - the arena views pixels without copying them.
+    */
+    image_arena(std::shared_ptr<const void> backing, const dlib::rgb_pixel* pixels,
+                long nr, long nc, size_t num_images);
+
+    long nr() const { return num_rows; }
+    long nc() const { return num_cols; }
+    size_t size() const override { return views.size(); }
+
+    /*!
+        ensures:
+            - returns a pointer to the pixels of all images, stored one image
+              after the other.
+    */
+    const dlib::rgb_pixel* data() const { return pixels; }
+
+    /*!
+        requires:
+            - i < size()
+            - the arena owns its storage.
+
+        ensures:
+            - returns a pointer to the nr()*nc() pixels of the i-th image.
+              Distinct images may be written concurrently.
+    */
+    dlib::rgb_pixel* image_data(size_t i);
+
+    const image_type& image(size_t i) const override { return views[i]; }
+private:
+    std::shared_ptr<const void> storage;
+    const dlib::rgb_pixel* pixels;
+    bool owned;
+    long num_rows;
+    long num_cols;
+    std::vector<image_type> views;
+};
+
 // ---------------------------------------------------------------------------
 
 /*!
-    Container of images of a single person across multiple cameras/views.
+    Image store that keeps only the HDF5 object references of the images of a
+    CUHK03 style file resident. Images are read, decoded and resized on first
+    access into a cache, which evicts the least recently used images once
+    their pixels take up more than the given capacity. Pixels that are still
+    referenced by a caller stay valid after eviction. All member functions are
+    thread safe.
+*/
+class lazy_image_cache : public image_store, public image_source, dlib::noncopyable {
+public:
+    struct statistics {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t num_cached = 0;       // number of images currently cached
+        size_t cached_bytes = 0;     // memory taken by their pixels
+        size_t capacity_bytes = 0;
+
+        double hit_rate() const { return (hits+misses) ? static_cast<double>(hits)/(hits+misses) : 0.0; }
+    };
+
+    /*!
+        ensures:
+            - the cache holds image_refs.size() images of nr by nc pixels, the
+              i-th of which is read from the object reference image_refs[i] of
+              file.
+    */
+    lazy_image_cache(
+        std::shared_ptr<H5::H5File> file,
+        std::vector<uint64_t> image_refs,
+        long nr,
+        long nc,
+        size_t capacity_bytes
+    );
+
+    long nr() const { return num_rows; }
+    long nc() const { return num_cols; }
+    size_t size() const override { return views.size(); }
+    const image_type& image(size_t i) const override { return views[i]; }
+
+    std::shared_ptr<const dlib::rgb_pixel> load(size_t index) const override;
+
+    statistics get_statistics() const;
+private:
+    struct entry {
+        std::shared_ptr<const dlib::rgb_pixel> pixels;
+        std::list<size_t>::iterator position;
+    };
+
+    std::shared_ptr<H5::H5File> file;
+    std::vector<uint64_t> refs;
+    long num_rows;
+    long num_cols;
+    std::vector<image_type> views;
+
+    mutable std::mutex file_mutex;   // HDF5 is not thread safe
+    mutable std::mutex cache_mutex;
+    mutable std::list<size_t> lru;   // most recently used first
+    mutable std::unordered_map<size_t, entry> entries;
+    mutable statistics stats;
+};
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Images of a single person across multiple cameras/views. The images live
+    in an image store shared by all persons of a dataset, and each view is a
+    contiguous range of it.
 */
 class person_set : dlib::noncopyable {
 public:
-    person_set(std::vector<std::vector<dlib::matrix<dlib::rgb_pixel>>>& images);
+    typedef rgb_image_view image_type;
+
+    /*!
+        Non-owning range of the images of one view.
+    */
+    class view_type {
+    public:
+        view_type(const image_type* first_, const image_type* last_) : first(first_), last(last_) { }
+
+        const image_type* begin() const { return first; }
+        const image_type* end() const { return last; }
+        size_t size() const { return last - first; }
+        bool empty() const { return first == last; }
+        const image_type& operator[](size_t i) const { return first[i]; }
+    private:
+        const image_type* first;
+        const image_type* last;
+    };
+
+    /*!
+        requires:
+            - view_offsets is non-decreasing and view_offsets.back() <= store->size()
+
+        ensures:
+            - view v of this person consists of the images
+              [view_offsets[v], view_offsets[v+1]) of store.
+    */
+    person_set(std::shared_ptr<const image_store> store, std::vector<size_t> view_offsets);
     person_set(person_set&& other);
 
     /*!
@@ -30,10 +222,10 @@ public:
         ensures:
             - returns the images from the input view index.
     */
-    std::vector<dlib::matrix<dlib::rgb_pixel>>& view(unsigned int view_index);
-    const std::vector<dlib::matrix<dlib::rgb_pixel>>& view(unsigned int view_index) const;
+    view_type view(unsigned int view_index) const;
 private:
-    std::vector<std::vector<dlib::matrix<dlib::rgb_pixel>>> images;
+    std::shared_ptr<const image_store> store;
+    std::vector<size_t> view_offsets;
 };
 
 // ---------------------------------------------------------------------------
@@ -54,9 +246,15 @@ enum cuhk03_dataset_type {
           Each image is scaled to a resolution of nr by nc pixels.
         - test_protocols will have 20 entries, each with 100 indices that should
           be used for as test data.
+        - if cache_file is not empty and names a cache written by an earlier
+          call with the same cuhk03_file (unmodified since), type, nr and nc,
+          the dataset is read from the memory-mapped cache instead of being
+          decoded from cuhk03_file. Otherwise, the dataset is decoded from
+          cuhk03_file and written to cache_file.
 
     throws:
-        - std::runtime_error, if given file is not the expected CUHK03 mat file.
+        - std::runtime_error, if given file is not the expected CUHK03 mat file
+          or the cache could not be written.
 */
 void load_cuhk03_dataset(
     const std::string& cuhk03_file,
@@ -64,6 +262,80 @@ void load_cuhk03_dataset(
     std::vector<std::vector<int>>& test_protocols,
     cuhk03_dataset_type type=LABELED,
     long nr=160,
+    long nc=60,
+    const std::string& cache_file=""
+);
+
+/*!
+    Writes the dataset cache read by load_cuhk03_dataset().
+
+    requires:
+        - counts holds the number of images of every view of every person,
+          num_views per person, which split arena into persons and views in
+          order.
+        - all test protocols have the same size.
+
+    ensures:
+        - writes the images of arena and test_protocols to cache_file, along
+          with the size and modification time of source_file, type and the
+          image size. The file is replaced atomically.
+
+    throws:
+        - std::runtime_error, if the cache could not be written.
+*/
+void write_dataset_cache(
+    const std::string& cache_file,
+    const std::string& source_file,
+    const image_arena& arena,
+    const std::vector<uint32_t>& counts,
+    uint32_t num_views,
+    const std::vector<std::vector<int>>& test_protocols,
+    cuhk03_dataset_type type
+);
+
+/*!
+    ensures:
+        - if cache_file was written by write_dataset_cache() with the same
+          source_file (unmodified since), type, nr and nc, and is complete,
+          appends its persons to images and its test protocols to
+          test_protocols and returns true. The persons view the memory-mapped
+          file directly.
+        - returns false and leaves images and test_protocols unchanged
+          otherwise.
+*/
+bool read_dataset_cache(
+    const std::string& cache_file,
+    const std::string& source_file,
+    std::vector<person_set>& images,
+    std::vector<std::vector<int>>& test_protocols,
+    cuhk03_dataset_type type,
+    long nr,
+    long nc
+);
+
+/*!
+    Prepares lazy loading of the CUHK03 dataset from the given file.
+
+    requires:
+        - dlib::file_exists(cuhk03_file)
+        - nr > 0 && nc > 0
+
+    ensures:
+        - same as load_cuhk03_dataset(), except that the images of the persons
+          are read on first use into a lazy_image_cache that holds at most
+          about cache_bytes bytes of pixels.
+        - returns the cache, e.g. to query its statistics.
+
+    throws:
+        - std::runtime_error, if given file is not the expected CUHK03 mat file.
+*/
+std::shared_ptr<const lazy_image_cache> load_cuhk03_dataset_lazy(
+    const std::string& cuhk03_file,
+    std::vector<person_set>& images,
+    std::vector<std::vector<int>>& test_protocols,
+    size_t cache_bytes,
+    cuhk03_dataset_type type=LABELED,
+    long nr=160,
     long nc=60
 );
 
@@ -29,9 +29,21 @@ public:
     template <typename SUBNET>
     void setup(const SUBNET& sub)
     {
-        DLIB_CASSERT(sub.get_output().num_samples() % 2 == 0, "");
+        DLIB_CASSERT(broadcast || sub.get_output().num_samples() % 2 == 0, "");
     }
 
+    /*!
+        ensures:
+            - if enable is true, this layer runs in broadcast mode: its input
+              holds one probe followed by N gallery samples, and its output
+              holds the 2N samples it would otherwise produce for the input
+              probe, gallery 1, probe, gallery 2, ..., i.e. one image pair per
+              gallery sample. The probe is never duplicated in memory.
+            - the mode is not serialized.
+    */
+    void set_broadcast(bool enable) { broadcast = enable; }
+    bool is_broadcast() const { return broadcast; }
+
     /*!
         Performs the cross-input neighborhood differencing operation to each 
         sample pair.
@@ -43,7 +55,8 @@ public:
         // times more rows and _nc times more columns. This is due to the
         // neighborhood output produced at every pixel.
         const dlib::tensor& input_tensor = sub.get_output();
-        data_output.set_size(input_tensor.num_samples(), input_tensor.k(),
+        DLIB_CASSERT(!broadcast || input_tensor.num_samples() >= 2, "");
+        data_output.set_size(num_paired_samples(input_tensor), input_tensor.k(),
                              _nr*input_tensor.nr(), _nc*input_tensor.nc());
 #ifdef DLIB_USE_CUDA
         launch_differencing_kernel(input_tensor.device(),
@@ -53,9 +66,10 @@ public:
                                    input_tensor.nc(),
                                    _nr,
                                    _nc,
-                                   data_output.size());
+                                   data_output.size(),
+                                   broadcast);
 #else
-        perform_cross_neighborhood_differencing(input_tensor, data_output, dlib::vector<long,2>(_nc, _nr));
+        perform_cross_neighborhood_differencing(input_tensor, data_output, dlib::vector<long,2>(_nc, _nr), broadcast);
 #endif
     }
 
@@ -69,18 +83,31 @@ public:
         dlib::tensor& // params_grad
     )
     {
-#ifdef DLIB_USE_CUDA
+        // In broadcast mode, the gradient is first computed for every image
+        // pair and then summed over the copies of the probe.
         const dlib::tensor& input_tensor = sub.get_output();
+        if (broadcast)
+            pair_grad.set_size(num_paired_samples(input_tensor), input_tensor.k(),
+                               input_tensor.nr(), input_tensor.nc());
+        dlib::tensor& grad = broadcast ? pair_grad : sub.get_gradient_input();
+#ifdef DLIB_USE_CUDA
         launch_differencing_gradient_kernel(gradient_input.device(),
-                                            sub.get_gradient_input().device(),
+                                            grad.device(),
                                             input_tensor.k(),
                                             input_tensor.nr(),
                                             input_tensor.nc(),
                                             _nr,
                                             _nc,
-                                            input_tensor.size());
+                                            grad.size());
+        if (broadcast)
+            launch_broadcast_gradient_reduce_kernel(pair_grad.device(),
+                                                    sub.get_gradient_input().device(),
+                                                    input_tensor.k()*input_tensor.nr()*input_tensor.nc(),
+                                                    pair_grad.num_samples()/2);
 #else
-        backpropagate_differencing_gradient(gradient_input, sub.get_gradient_input());
+        backpropagate_differencing_gradient(gradient_input, grad);
+        if (broadcast)
+            reduce_broadcast_gradient(pair_grad, sub.get_gradient_input());
 #endif
     }
 
@@ -129,10 +156,181 @@ public:
             << "/>\n";
     }
 private:
+    long num_paired_samples(const dlib::tensor& input_tensor) const
+    {
+        return broadcast ? 2*(input_tensor.num_samples()-1) : input_tensor.num_samples();
+    }
+
     dlib::resizable_tensor params;
+    dlib::resizable_tensor pair_grad;
+    bool broadcast = false;
 };
 
 template <long nr, long nc, typename SUBNET>
 using cross_neighborhood_differences = dlib::add_layer<cross_neighborhood_differences_<nr, nc>, SUBNET>;
 
+// ---------------------------------------------------------------------------
+
+/*!
+    This object represents a cross-input neighborhood differences layer
+    followed by a ReLU. It is equivalent to
+    dlib::relu<cross_neighborhood_differences<_nr,_nc,SUBNET>>, but computes
+    both in a single pass over the (_nr*_nc times larger) output.
+*/
+template <long _nr=5, long _nc=5>
+class cross_neighborhood_differences_relu_ {
+public:
+    const static unsigned int sample_expansion_factor = 1;
+
+    static_assert(_nr > 0, "The number of rows in the neighborhood region must be > 0");
+    static_assert(_nc > 0, "The number of columns in the neighborhood region must be > 0");
+    static_assert(_nr % 2 != 0, "The number of rows in the neighborhood region must be an odd number");
+    static_assert(_nc % 2 != 0, "The number of columns in the neighborhood region must be an odd number");
+
+    cross_neighborhood_differences_relu_() { }
+
+    template <typename SUBNET>
+    void setup(const SUBNET& sub)
+    {
+        DLIB_CASSERT(broadcast || sub.get_output().num_samples() % 2 == 0, "");
+    }
+
+    /*!
+        ensures:
+            - if enable is true, this layer runs in broadcast mode: its input
+              holds one probe followed by N gallery samples, and its output
+              holds the 2N samples it would otherwise produce for the input
+              probe, gallery 1, probe, gallery 2, ..., i.e. one image pair per
+              gallery sample. The probe is never duplicated in memory.
+            - the mode is not serialized.
+    */
+    void set_broadcast(bool enable) { broadcast = enable; }
+    bool is_broadcast() const { return broadcast; }
+
+    /*!
+        Performs the cross-input neighborhood differencing operation to each 
+        sample pair and rectifies the result.
+    */
+    template <typename SUBNET>
+    void forward(const SUBNET& sub, dlib::resizable_tensor& data_output)
+    {
+        const dlib::tensor& input_tensor = sub.get_output();
+        DLIB_CASSERT(!broadcast || input_tensor.num_samples() >= 2, "");
+        data_output.set_size(num_paired_samples(input_tensor), input_tensor.k(),
+                             _nr*input_tensor.nr(), _nc*input_tensor.nc());
+#ifdef DLIB_USE_CUDA
+        launch_differencing_relu_kernel(input_tensor.device(),
+                                        data_output.device_write_only(),
+                                        input_tensor.k(),
+                                        input_tensor.nr(),
+                                        input_tensor.nc(),
+                                        _nr,
+                                        _nc,
+                                        data_output.size(),
+                                        broadcast);
+#else
+        perform_cross_neighborhood_differencing_relu(input_tensor, data_output, dlib::vector<long,2>(_nc, _nr), broadcast);
+#endif
+    }
+
+    /*!
+        Performs the backpropagation step of this layer. The differences are
+        recomputed from the layer input, so only outputs that were positive
+        propagate gradient.
+    */
+    template <typename SUBNET>
+    void backward(
+        const dlib::tensor& gradient_input,
+        SUBNET& sub,
+        dlib::tensor& // params_grad
+    )
+    {
+        // In broadcast mode, the gradient is first computed for every image
+        // pair and then summed over the copies of the probe.
+        const dlib::tensor& input_tensor = sub.get_output();
+        if (broadcast)
+            pair_grad.set_size(num_paired_samples(input_tensor), input_tensor.k(),
+                               input_tensor.nr(), input_tensor.nc());
+        dlib::tensor& grad = broadcast ? pair_grad : sub.get_gradient_input();
+#ifdef DLIB_USE_CUDA
+        launch_differencing_relu_gradient_kernel(input_tensor.device(),
+                                                 gradient_input.device(),
+                                                 grad.device(),
+                                                 input_tensor.k(),
+                                                 input_tensor.nr(),
+                                                 input_tensor.nc(),
+                                                 _nr,
+                                                 _nc,
+                                                 grad.size(),
+                                                 broadcast);
+        if (broadcast)
+            launch_broadcast_gradient_reduce_kernel(pair_grad.device(),
+                                                    sub.get_gradient_input().device(),
+                                                    input_tensor.k()*input_tensor.nr()*input_tensor.nc(),
+                                                    pair_grad.num_samples()/2);
+#else
+        backpropagate_differencing_relu_gradient(input_tensor, gradient_input, grad, broadcast);
+        if (broadcast)
+            reduce_broadcast_gradient(pair_grad, sub.get_gradient_input());
+#endif
+    }
+
+    const dlib::tensor& get_layer_params() const { return params; }
+    dlib::tensor& get_layer_params() { return params; }
+
+    friend void serialize(const cross_neighborhood_differences_relu_& item, std::ostream& out)
+    {
+        dlib::serialize("cross_neighborhood_differences_relu", out);
+        dlib::serialize(_nr, out);
+        dlib::serialize(_nc, out);
+    }
+
+    friend void deserialize(cross_neighborhood_differences_relu_& item, std::istream& in)
+    {
+        std::string version;
+        dlib::deserialize(version, in);
+        long nr;
+        long nc;
+        if (version == "cross_neighborhood_differences_relu") {
+            dlib::deserialize(nr, in);
+            dlib::deserialize(nc, in);
+        }
+        else {
+            throw dlib::serialization_error("Unexpected version '"+version+"' found while deserializing cross_neighborhood_differences_relu_.");
+        }
+
+        if (_nr != nr) throw dlib::serialization_error("Wrong nr found while deserializing cross_neighborhood_differences_relu_");
+        if (_nc != nc) throw dlib::serialization_error("Wrong nc found while deserializing cross_neighborhood_differences_relu_");
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const cross_neighborhood_differences_relu_& item)
+    {
+        out << "cross_neighborhood_differences_relu\t ("
+            << "nr="<<_nr
+            << ", nc="<<_nc
+            << ")";
+        return out;
+    }
+
+    friend void to_xml(const cross_neighborhood_differences_relu_& item, std::ostream& out)
+    {
+        out << "<cross_neighborhood_differences_relu"
+            << " nr='"<<_nr<<"'"
+            << " nc='"<<_nc<<"'"
+            << "/>\n";
+    }
+private:
+    long num_paired_samples(const dlib::tensor& input_tensor) const
+    {
+        return broadcast ? 2*(input_tensor.num_samples()-1) : input_tensor.num_samples();
+    }
+
+    dlib::resizable_tensor params;
+    dlib::resizable_tensor pair_grad;
+    bool broadcast = false;
+};
+
+template <long nr, long nc, typename SUBNET>
+using cross_neighborhood_differences_relu = dlib::add_layer<cross_neighborhood_differences_relu_<nr, nc>, SUBNET>;
+
 #endif // IDLA__DIFFERENCE_H_
@@ -4,6 +4,45 @@
 #include <dlib/dnn.h>
 #include <dlib/geometry.h>
 
+/*!
+    Instruction sets that the CPU differencing kernels can be dispatched to.
+    Levels are ordered so that a higher level implies support for the lower
+    ones.
+*/
+enum class cpu_simd_level {
+    SCALAR, SSE, AVX
+};
+
+/*!
+    Returns the instruction set currently used by the CPU differencing kernels.
+    By default, this is the highest level supported by the running CPU.
+*/
+cpu_simd_level get_differencing_simd_level();
+
+/*!
+    Sets the instruction set used by the CPU differencing kernels. Requests for
+    a level that the running CPU does not support are lowered to the highest
+    supported level.
+*/
+void set_differencing_simd_level(cpu_simd_level level);
+
+/*!
+    Returns the number of threads used by the CPU differencing kernels. By
+    default, this is the number of hardware threads.
+*/
+unsigned long get_differencing_num_threads();
+
+/*!
+    Sets the number of threads used by the CPU differencing kernels. Work is
+    split over (sample, channel) slices, so the results are identical for any
+    number of threads. This should not be called while a differencing kernel
+    is running.
+
+    requires:
+        - num_threads > 0
+*/
+void set_differencing_num_threads(unsigned long num_threads);
+
 /*!
     Perform cross neighborhood differencing on the given input tensor.
 
@@ -13,11 +52,17 @@
                           cross neighborhood difference to `input_tensor`.
     @param neighborhood_size  vector with the number of columns (x) and rows (y)
                               in a neighborhood
+    @param broadcast  if true, `input_tensor` holds a probe followed by N
+                      gallery samples and `output_tensor` has 2N samples,
+                      i.e. the output for the pairs (probe, gallery 1),
+                      (gallery 1, probe), (probe, gallery 2), ... Otherwise,
+                      the pairs are adjacent samples of `input_tensor`.
 */
 void perform_cross_neighborhood_differencing(
     const dlib::tensor& input_tensor,
     dlib::resizable_tensor& output_tensor,
-    const dlib::vector<long,2>& neighborhood_size
+    const dlib::vector<long,2>& neighborhood_size,
+    bool broadcast = false
 );
 
 /*!
@@ -30,4 +75,89 @@ void perform_cross_neighborhood_differencing(
 */
 void backpropagate_differencing_gradient(const dlib::tensor& gradient_input, dlib::tensor& gradient_output);
 
+/*!
+    Reduces the gradient of a broadcast differencing pass, which has the
+    2N samples of the duplicated batch probe, gallery 1, probe, gallery 2, ...,
+    to the gradient of its N+1 input samples. The probe receives the sum of
+    the gradients of all of its copies.
+
+    @param pair_gradient  tensor holding the gradient of the 2N paired samples,
+                          as computed by backpropagate_differencing_gradient()
+                          or backpropagate_differencing_relu_gradient().
+    @param gradient_output  tensor with N+1 samples that will store the
+                            gradient of the probe followed by the N gallery
+                            samples.
+*/
+void reduce_broadcast_gradient(const dlib::tensor& pair_gradient, dlib::tensor& gradient_output);
+
+/*!
+    Perform cross neighborhood differencing followed by a ReLU on the given
+    input tensor, i.e. negative differences are written as 0.
+
+    @param input_tensor  tensor that cross neighborhood differencing will be 
+                         performed on.
+    @param output_tensor  tensor that will store the rectified output of 
+                          applying the cross neighborhood difference to 
+                          `input_tensor`.
+    @param neighborhood_size  vector with the number of columns (x) and rows (y)
+                              in a neighborhood
+    @param broadcast  see perform_cross_neighborhood_differencing().
+*/
+void perform_cross_neighborhood_differencing_relu(
+    const dlib::tensor& input_tensor,
+    dlib::resizable_tensor& output_tensor,
+    const dlib::vector<long,2>& neighborhood_size,
+    bool broadcast = false
+);
+
+/*!
+    Backpropagates the gradient of cross neighborhood differencing followed by
+    a ReLU. Only outputs with a positive difference propagate gradient.
+
+    @param input_tensor  tensor that the forward pass was performed on.
+    @param gradient_input  tensor holding the gradient of the successive
+                           operation.
+    @param gradient_output  tensor that will store the output of backpropagating
+                            `gradient_input`
+    @param broadcast  if true, the forward pass was run in broadcast mode and
+                      `gradient_output` receives the gradient of the 2N
+                      paired samples, which still has to be reduced with
+                      reduce_broadcast_gradient().
+*/
+void backpropagate_differencing_relu_gradient(
+    const dlib::tensor& input_tensor,
+    const dlib::tensor& gradient_input,
+    dlib::tensor& gradient_output,
+    bool broadcast = false
+);
+
+/*!
+    Perform cross neighborhood differencing followed by a ReLU and a
+    convolution whose filters have the size of, and stride over, one
+    neighborhood. The rectified differences are computed on the fly, so the
+    expanded differencing output is never stored.
+
+    @param input_tensor  tensor that cross neighborhood differencing will be 
+                         performed on.
+    @param params  tensor holding `num_filters` filters of size
+                   input_tensor.k() x neighborhood rows x neighborhood columns
+                   followed by `num_filters` biases (the layout of dlib::con_).
+    @param output_tensor  tensor with input_tensor.num_samples() samples (2N
+                          in broadcast mode), `num_filters` channels and the
+                          rows and columns of `input_tensor` that will store
+                          the convolution output.
+    @param num_filters  number of convolution filters.
+    @param neighborhood_size  vector with the number of columns (x) and rows (y)
+                              in a neighborhood
+    @param broadcast  see perform_cross_neighborhood_differencing().
+*/
+void perform_cross_neighborhood_patch_summary(
+    const dlib::tensor& input_tensor,
+    const dlib::tensor& params,
+    dlib::resizable_tensor& output_tensor,
+    long num_filters,
+    const dlib::vector<long,2>& neighborhood_size,
+    bool broadcast = false
+);
+
 #endif // IDLA__DIFFERENCE_IMPL_CPU_H_
@@ -14,7 +14,12 @@
     @param in_nc  number of columns in input tensor.
     @param nbhd_nr  number of rows in a neighborhood.
     @param nbhd_nc  number of columns in a neighborhood.
-    @param n  number of input tensor elements.
+    @param n  number of output tensor elements.
+    @param broadcast  if true, `input_tensor` holds a probe followed by N
+                      gallery samples and the output holds the 2N samples of
+                      the pairs (probe, gallery 1), (gallery 1, probe),
+                      (probe, gallery 2), ... Otherwise, the pairs are
+                      adjacent samples of `input_tensor`.
 */
 void launch_differencing_kernel(
     const float* input_tensor,
@@ -24,7 +29,8 @@ void launch_differencing_kernel(
     long in_nc,
     long nbhd_nr,
     long nbhd_nc,
-    long n
+    long n,
+    bool broadcast = false
 );
 
 /*!
@@ -52,4 +58,120 @@ void launch_differencing_gradient_kernel(
     long n
 );
 
+/*!
+    Kernel that performs cross neighborhood differencing followed by a ReLU.
+
+    @param input_tensor  pointer to an input tensor that cross neighborhood 
+                         differencing will be performed on.
+    @param data_output  pointer to a tensor that will store the rectified
+                        output of applying the cross neighborhood difference
+                        to `input_tensor`.
+    @param in_nk  number of channels in input tensor.
+    @param in_nr  number of rows in input tensor.
+    @param in_nc  number of columns in input tensor.
+    @param nbhd_nr  number of rows in a neighborhood.
+    @param nbhd_nc  number of columns in a neighborhood.
+    @param n  number of output tensor elements.
+    @param broadcast  see launch_differencing_kernel().
+*/
+void launch_differencing_relu_kernel(
+    const float* input_tensor,
+    float* data_output,
+    long in_nk,
+    long in_nr,
+    long in_nc,
+    long nbhd_nr,
+    long nbhd_nc,
+    long n,
+    bool broadcast = false
+);
+
+/*!
+    Kernel that backpropagates the gradient of cross neighborhood differencing
+    followed by a ReLU.
+
+    @param input_tensor  pointer to the tensor the forward pass was performed
+                         on.
+    @param gradient_input  pointer to an input tensor holding the gradient of 
+                           the successive operation.
+    @param gradient_output  pointer to a tensor that will store the output of 
+                            backpropagating `gradient_input`
+    @param in_nk  number of channels in input tensor.
+    @param in_nr  number of rows in input tensor.
+    @param in_nc  number of columns in input tensor.
+    @param nbhd_nr  number of rows in a neighborhood.
+    @param nbhd_nc  number of columns in a neighborhood.
+    @param n  number of gradient output elements.
+    @param broadcast  if true, the forward pass was run in broadcast mode and
+                      `gradient_output` receives the gradient of the 2N
+                      paired samples, which still has to be reduced with
+                      launch_broadcast_gradient_reduce_kernel().
+*/
+void launch_differencing_relu_gradient_kernel(
+    const float* input_tensor,
+    const float* gradient_input,
+    float* gradient_output,
+    long in_nk,
+    long in_nr,
+    long in_nc,
+    long nbhd_nr,
+    long nbhd_nc,
+    long n,
+    bool broadcast = false
+);
+
+/*!
+    Kernel that reduces the gradient of a broadcast differencing pass, which
+    has the 2N samples of the duplicated batch probe, gallery 1, probe,
+    gallery 2, ..., to the gradient of its N+1 input samples. The probe
+    receives the sum of the gradients of all of its copies.
+
+    @param pair_gradient  pointer to the gradient of the 2N paired samples.
+    @param gradient_output  pointer to a tensor with N+1 samples that will
+                            store the gradient of the probe followed by the
+                            N gallery samples.
+    @param sample_size  number of elements in one sample.
+    @param num_pairs  number of gallery samples N.
+*/
+void launch_broadcast_gradient_reduce_kernel(
+    const float* pair_gradient,
+    float* gradient_output,
+    long sample_size,
+    long num_pairs
+);
+
+/*!
+    Kernel that performs cross neighborhood differencing followed by a ReLU
+    and a convolution whose filters have the size of, and stride over, one
+    neighborhood. The rectified differences are never stored.
+
+    @param input_tensor  pointer to an input tensor that cross neighborhood 
+                         differencing will be performed on.
+    @param params  pointer to `num_filters` filters of size
+                   in_nk x nbhd_nr x nbhd_nc followed by `num_filters` biases.
+    @param data_output  pointer to a tensor that will store the convolution
+                        output.
+    @param num_filters  number of convolution filters.
+    @param in_nk  number of channels in input tensor.
+    @param in_nr  number of rows in input tensor.
+    @param in_nc  number of columns in input tensor.
+    @param nbhd_nr  number of rows in a neighborhood.
+    @param nbhd_nc  number of columns in a neighborhood.
+    @param n  number of output tensor elements.
+    @param broadcast  see launch_differencing_kernel().
+*/
+void launch_patch_summary_kernel(
+    const float* input_tensor,
+    const float* params,
+    float* data_output,
+    long num_filters,
+    long in_nk,
+    long in_nr,
+    long in_nc,
+    long nbhd_nr,
+    long nbhd_nc,
+    long n,
+    bool broadcast = false
+);
+
 #endif // IDLA__DIFFERENCE_IMPL_GPU_H_
@@ -0,0 +1,68 @@
+#ifndef IDLA__EMBEDDING_H_
+#define IDLA__EMBEDDING_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "input.h"
+
+// ---------------------------------------------------------------------------
+
+/*!
+    ensures:
+        - returns the average of fmap over its spatial positions, one value
+          per channel, scaled to unit length. All zero maps give a zero
+          vector.
+*/
+std::vector<float> pooled_embedding(const feature_map& fmap);
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Holds unit length embeddings, e.g. of gallery images, and finds the ones
+    closest to a query. Closeness is the cosine similarity, i.e. the dot
+    product, which ranks unit vectors the same way as the L2 distance does.
+
+    The embeddings are stored contiguously and compared with SSE, so ranking
+    a few thousand of them takes microseconds.
+*/
+class embedding_index {
+public:
+    /*!
+        requires:
+            - size() == 0 or embedding.size() == dimension()
+
+        ensures:
+            - appends embedding, which gets the index size()-1.
+    */
+    void add(const std::vector<float>& embedding);
+
+    size_t size() const { return dim > 0 ? data.size()/dim : 0; }
+    size_t dimension() const { return dim; }
+
+    /*!
+        requires:
+            - query.size() == dimension()
+
+        ensures:
+            - #sims.size() == size()
+            - #sims[i] is the dot product of query and embedding i.
+    */
+    void similarities(const std::vector<float>& query, std::vector<float>& sims) const;
+
+    /*!
+        requires:
+            - query.size() == dimension()
+
+        ensures:
+            - returns the indices of the min(k, size()) embeddings most
+              similar to query, the most similar first.
+            - #sims is set as by similarities(query, sims).
+    */
+    std::vector<size_t> nearest(const std::vector<float>& query, size_t k, std::vector<float>& sims) const;
+private:
+    size_t dim = 0;
+    std::vector<float> data;
+};
+
+#endif // IDLA__EMBEDDING_H_
@@ -0,0 +1,229 @@
+#ifndef IDLA__FEATURE_CACHE_H_
+#define IDLA__FEATURE_CACHE_H_
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include <dlib/dnn.h>
+
+#include "input.h"
+#include "replica_pool.h"
+#include "trace.h"
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Copies the layer details of computational layers [begin, end) from one
+    network to another. Both networks must have identical layer types over
+    that range, and dest must have been run forward at least once. dlib sets
+    up a layer on its first forward pass, which would otherwise overwrite the
+    copied parameters.
+*/
+template <size_t begin, size_t end>
+struct copy_layer_details {
+    template <typename dest_net_type, typename src_net_type>
+    static void copy(dest_net_type& dest, const src_net_type& src)
+    {
+        dlib::layer<begin>(dest).layer_details() = dlib::layer<begin>(src).layer_details();
+        copy_layer_details<begin+1, end>::copy(dest, src);
+    }
+};
+
+template <size_t end>
+struct copy_layer_details<end, end> {
+    template <typename dest_net_type, typename src_net_type>
+    static void copy(dest_net_type&, const src_net_type&) { }
+};
+
+/*!
+    Loads the parameters of a testing net into an inference head that runs on
+    cached tower features (see input_feature_maps). The last computational
+    layer of the head is a cross_neighborhood_patch_summary_ that stands for
+    the differencing layer and the patch summary convolution of tnet, and all
+    layers above it match those of tnet.
+
+    requires:
+        - sample is a feature map computed by the tower of tnet. It is only
+          used to set up hnet.
+
+    ensures:
+        - given the tower features of a probe followed by those of N gallery
+          images, hnet computes the same N scores as tnet computes for the
+          N (probe, gallery image) pairs.
+*/
+template <typename head_type, typename testing_net_type>
+void load_head(head_type& hnet, const testing_net_type& tnet, const feature_map& sample)
+{
+    const size_t summary_idx = head_type::num_computational_layers-1;
+    dlib::layer<summary_idx>(hnet).layer_details().set_broadcast(true);
+
+    // Run the head once so that dlib sets up its layers. Otherwise, the first
+    // forward pass would re-initialize the parameters copied below.
+    std::vector<input_feature_maps::input_type> feats = {&sample, &sample};
+    hnet(feats.begin(), feats.end());
+
+    copy_layer_details<0, summary_idx>::copy(hnet, tnet);
+    dlib::layer<summary_idx>(hnet).layer_details().set_filters(
+        dlib::layer<summary_idx>(tnet).layer_details().get_layer_params());
+}
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Caches the output of the network tower for individual images so that the
+    tower only needs to be run once per unique image during evaluation.
+*/
+class feature_cache {
+public:
+    typedef input_rgb_image_pair::image_type image_type;
+
+    /*!
+        requires:
+            - the towers are networks (or subnetworks) whose input layer is
+              input_rgb_image_pair and whose layers operate on each sample
+              independently.
+            - batch_size > 0
+
+        ensures:
+            - runs the towers over every image in images that is not already
+              cached and stores the resulting feature maps. The batches are
+              run in parallel on the replicas of the tower.
+    */
+    template <typename tower_type>
+    void add(
+        replica_pool<tower_type>& towers,
+        const std::vector<const image_type*>& images,
+        unsigned long batch_size=64
+    );
+
+    /*!
+        ensures:
+            - returns true if the feature map of img has been cached.
+    */
+    bool contains(const image_type* img) const { return features.count(img) != 0; }
+
+    /*!
+        requires:
+            - contains(img) == true
+
+        ensures:
+            - returns the cached feature map of img.
+    */
+    const feature_map& get(const image_type* img) const
+    {
+        auto it = features.find(img);
+        DLIB_CASSERT(it != features.end(), "Image has not been cached.");
+        return it->second;
+    }
+
+    unsigned long size() const { return features.size(); }
+    void clear() { features.clear(); }
+private:
+    /*!
+        ensures:
+            - returns the images that are not cached yet, without duplicates,
+              and adds an empty feature map for each of them to dests.
+    */
+    std::vector<const image_type*> insert_pending(
+        const std::vector<const image_type*>& images,
+        std::vector<feature_map*>& dests
+    );
+
+    /*!
+        ensures:
+            - runs the tower over pending[begin, end) and stores the feature
+              maps in the corresponding dests.
+    */
+    template <typename tower_type>
+    static void run_batch(
+        tower_type& tower,
+        const std::vector<const image_type*>& pending,
+        const std::vector<feature_map*>& dests,
+        unsigned long begin,
+        unsigned long end,
+        dlib::resizable_tensor& x
+    );
+
+    std::unordered_map<const image_type*, feature_map> features;
+};
+
+// =========================================================================== //
+//                               IMPLEMENTATION                                //
+// =========================================================================== //
+
+template <typename tower_type>
+void feature_cache::add(
+    replica_pool<tower_type>& towers,
+    const std::vector<const image_type*>& images,
+    unsigned long batch_size
+)
+{
+    DLIB_CASSERT(batch_size > 0, "");
+
+    // All entries are inserted up front, so that the batches only write to
+    // feature maps that already exist.
+    std::vector<feature_map*> dests;
+    const std::vector<const image_type*> pending = insert_pending(images, dests);
+
+    const long num_batches = (pending.size() + 2*batch_size - 1)/(2*batch_size);
+    towers.parallel_for(0, num_batches, [&](size_t w, long b) {
+        dlib::resizable_tensor x;
+        const unsigned long i = b*2*batch_size;
+        run_batch(towers[w], pending, dests, i, std::min<unsigned long>(pending.size(), i+2*batch_size), x);
+    });
+}
+
+inline std::vector<const feature_cache::image_type*> feature_cache::insert_pending(
+    const std::vector<const image_type*>& images,
+    std::vector<feature_map*>& dests
+)
+{
+    std::vector<const image_type*> pending;
+    for (const image_type* img : images) {
+        if (!contains(img)) {
+            pending.push_back(img);
+            dests.push_back(&features[img]);
+        }
+    }
+    return pending;
+}
+
+template <typename tower_type>
+void feature_cache::run_batch(
+    tower_type& tower,
+    const std::vector<const image_type*>& pending,
+    const std::vector<feature_map*>& dests,
+    unsigned long begin,
+    unsigned long end,
+    dlib::resizable_tensor& x
+)
+{
+    // The input layer consumes image pairs, so images are packed two at a
+    // time. An odd image out is paired with itself and the duplicate output
+    // is ignored.
+    std::vector<input_rgb_image_pair::input_type> pairs;
+    for (unsigned long j = begin; j < end; j += 2) {
+        const image_type* second = (j+1 < end) ? pending[j+1] : pending[j];
+        pairs.emplace_back(pending[j], second);
+    }
+
+    {
+        trace_scope scope("tower to_tensor");
+        tower.to_tensor(pairs.begin(), pairs.end(), x);
+    }
+    trace_scope scope("tower forward");
+    const dlib::tensor& out = tower.forward(x);
+
+    const long sample_size = out.k()*out.nr()*out.nc();
+    const float* out_ptr = out.host();
+    for (unsigned long j = begin; j < end; ++j) {
+        feature_map& fmap = *dests[j];
+        fmap.k = out.k();
+        fmap.nr = out.nr();
+        fmap.nc = out.nc();
+        fmap.values.assign(out_ptr + (j-begin)*sample_size, out_ptr + (j-begin+1)*sample_size);
+    }
+}
+
+#endif // IDLA__FEATURE_CACHE_H_
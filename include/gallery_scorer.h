@@ -0,0 +1,148 @@
+#ifndef IDLA__GALLERY_SCORER_H_
+#define IDLA__GALLERY_SCORER_H_
+
+#include <algorithm>
+#include <vector>
+
+#include <dlib/dnn.h>
+#include <dlib/threads.h>
+
+#include "input.h"
+#include "trace.h"
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Scores probes against a gallery with an inference head whose differencing
+    layer runs in broadcast mode (see load_head() in cuhk03.cpp).
+
+    Rather than running the head once per gallery identity, which only holds
+    a handful of images, the gallery images of all identities are packed into
+    batches of up to batch_size images, each preceded by its probe. While the
+    head scores one batch, the input tensor of the next one is assembled in a
+    background thread.
+*/
+template <typename head_type>
+class gallery_scorer : dlib::noncopyable {
+public:
+    /*!
+        requires:
+            - head outlives this object.
+            - batch_size > 0
+
+        ensures:
+            - #get_batch_size() == batch_size
+    */
+    gallery_scorer(head_type& head, unsigned long batch_size = 256);
+
+    unsigned long get_batch_size() const { return batch_size; }
+
+    /*!
+        requires:
+            - all feature maps have the same size.
+
+        ensures:
+            - #scores.size() == probes.size()*gallery.size()
+            - #scores[p*gallery.size()+g] is the probability the head assigns
+              to probes[p] and gallery[g] showing the same person.
+    */
+    void score(
+        const std::vector<const feature_map*>& probes,
+        const std::vector<const feature_map*>& gallery,
+        std::vector<float>& scores
+    );
+private:
+    struct batch {
+        size_t probe;
+        size_t gallery_begin;
+        size_t gallery_end;
+    };
+
+    void prepare(
+        const batch& b,
+        const std::vector<const feature_map*>& probes,
+        const std::vector<const feature_map*>& gallery,
+        dlib::resizable_tensor& x
+    ) const;
+
+    head_type& head;
+    unsigned long batch_size;
+    input_feature_maps input;       // used by the background thread
+    dlib::resizable_tensor inputs[2];
+    dlib::thread_pool pool;
+};
+
+// =========================================================================== //
+//                               IMPLEMENTATION                                //
+// =========================================================================== //
+
+template <typename head_type>
+gallery_scorer<head_type>::gallery_scorer(head_type& head_, unsigned long batch_size_)
+    : head(head_), batch_size(batch_size_), pool(1)
+{
+    DLIB_CASSERT(batch_size > 0, "");
+}
+
+template <typename head_type>
+void gallery_scorer<head_type>::score(
+    const std::vector<const feature_map*>& probes,
+    const std::vector<const feature_map*>& gallery,
+    std::vector<float>& scores
+)
+{
+    scores.resize(probes.size()*gallery.size());
+
+    std::vector<batch> batches;
+    for (size_t p = 0; p < probes.size(); ++p) {
+        for (size_t g = 0; g < gallery.size(); g += batch_size)
+            batches.push_back({p, g, std::min<size_t>(g+batch_size, gallery.size())});
+    }
+    if (batches.empty())
+        return;
+
+    prepare(batches[0], probes, gallery, inputs[0]);
+    for (size_t i = 0; i < batches.size(); ++i) {
+        if (i+1 < batches.size()) {
+            pool.add_task_by_value([&, i]() {
+                prepare(batches[i+1], probes, gallery, inputs[(i+1)%2]);
+            });
+        }
+
+        try {
+            trace_scope scope("score gallery batch");
+            const batch& b = batches[i];
+            const dlib::tensor& out = head.forward(inputs[i%2]);
+            DLIB_CASSERT(out.num_samples() == static_cast<long>(b.gallery_end-b.gallery_begin) &&
+                         out.k()*out.nr()*out.nc() == 2, "");
+
+            // The second output is the probability of a match.
+            const float* out_ptr = out.host();
+            float* dest = &scores[b.probe*gallery.size() + b.gallery_begin];
+            for (long j = 0; j < out.num_samples(); ++j)
+                dest[j] = out_ptr[2*j+1];
+        }
+        catch (...) {
+            pool.wait_for_all_tasks();
+            throw;
+        }
+        pool.wait_for_all_tasks();
+    }
+}
+
+template <typename head_type>
+void gallery_scorer<head_type>::prepare(
+    const batch& b,
+    const std::vector<const feature_map*>& probes,
+    const std::vector<const feature_map*>& gallery,
+    dlib::resizable_tensor& x
+) const
+{
+    trace_scope scope("prepare gallery batch");
+    std::vector<const feature_map*> maps;
+    maps.reserve(1 + b.gallery_end - b.gallery_begin);
+    maps.push_back(probes[b.probe]);
+    maps.insert(maps.end(), gallery.begin()+b.gallery_begin, gallery.begin()+b.gallery_end);
+    input.to_tensor(maps.begin(), maps.end(), x);
+}
+
+#endif // IDLA__GALLERY_SCORER_H_
@@ -0,0 +1,92 @@
+#ifndef IDLA__IMAGE_VIEW_H_
+#define IDLA__IMAGE_VIEW_H_
+
+#include <memory>
+
+#include <dlib/matrix.h>
+#include <dlib/pixel.h>
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Interface of storage that only produces the pixels of an image on demand,
+    e.g. by decoding it from disk.
+*/
+class image_source {
+public:
+    virtual ~image_source() = default;
+
+    /*!
+        ensures:
+            - returns the pixels of the image with the given index, stored row
+              by row. They stay valid as long as the returned pointer (or a
+              copy of it) is alive.
+    */
+    virtual std::shared_ptr<const dlib::rgb_pixel> load(size_t index) const = 0;
+};
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Non-owning, read-only view of an rgb image whose pixels are stored row by
+    row elsewhere, e.g. in an image_arena or a dlib::matrix. The viewed pixels
+    must outlive the view.
+
+    A view may instead refer to an image of an image_source, in which case it
+    is not resident and its pixels must be obtained through pixels().
+*/
+class rgb_image_view {
+public:
+    rgb_image_view() = default;
+
+    rgb_image_view(const dlib::rgb_pixel* data_, long nr_, long nc_)
+        : ptr(data_), num_rows(nr_), num_cols(nc_) { }
+
+    explicit rgb_image_view(const dlib::matrix<dlib::rgb_pixel>& img)
+        : ptr(img.size() ? &img(0,0) : nullptr), num_rows(img.nr()), num_cols(img.nc()) { }
+
+    rgb_image_view(const image_source* source_, size_t index_, long nr_, long nc_)
+        : source(source_), index(index_), num_rows(nr_), num_cols(nc_) { }
+
+    long nr() const { return num_rows; }
+    long nc() const { return num_cols; }
+    long size() const { return num_rows*num_cols; }
+
+    /*!
+        ensures:
+            - returns true if the pixels of this image are in memory, i.e.
+              data(), begin(), end() and operator() may be used.
+    */
+    bool is_resident() const { return source == nullptr; }
+
+    /*!
+        ensures:
+            - returns the pixels of this image, loading them from the source if
+              the image is not resident. The pixels stay valid at least as long
+              as the returned pointer is alive.
+    */
+    std::shared_ptr<const dlib::rgb_pixel> pixels() const
+    {
+        if (source)
+            return source->load(index);
+        return std::shared_ptr<const dlib::rgb_pixel>(std::shared_ptr<const dlib::rgb_pixel>(), ptr);
+    }
+
+    const dlib::rgb_pixel* data() const { DLIB_ASSERT(is_resident(), ""); return ptr; }
+    const dlib::rgb_pixel* begin() const { DLIB_ASSERT(is_resident(), ""); return ptr; }
+    const dlib::rgb_pixel* end() const { DLIB_ASSERT(is_resident(), ""); return ptr + size(); }
+
+    const dlib::rgb_pixel& operator()(long r, long c) const
+    {
+        DLIB_ASSERT(is_resident() && 0 <= r && r < num_rows && 0 <= c && c < num_cols, "");
+        return ptr[r*num_cols + c];
+    }
+private:
+    const dlib::rgb_pixel* ptr = nullptr;
+    const image_source* source = nullptr;
+    size_t index = 0;
+    long num_rows = 0;
+    long num_cols = 0;
+};
+
+#endif // IDLA__IMAGE_VIEW_H_
@@ -1,18 +1,78 @@
 #ifndef IDLA__INPUT_H_
 #define IDLA__INPUT_H_
 
+#include <cstring>
+#include <memory>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <dlib/statistics.h>
 #include <dlib/dnn.h>
+#include <dlib/threads.h>
+
+#include "image_view.h"
+
+/*!
+    ensures:
+        - writes the red, green and blue channels of img to dest, one plane
+          after the other, normalized by the mean and standard deviation of
+          all of img's pixel values.
+        - dest must have room for 3*img.size() floats.
+*/
+void normalize_image(const rgb_image_view& img, float* dest);
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Stores the output of normalize_image() for a fixed set of images, so that
+    they only need to be normalized once instead of on every use. All images
+    must have the same size. Images are identified by their address, so they
+    must not move while they are in the cache.
+*/
+class normalized_image_cache {
+public:
+    typedef rgb_image_view image_type;
+
+    /*!
+        requires:
+            - img has the same size as all other images in the cache.
+
+        ensures:
+            - normalizes img and stores the result, unless it is already
+              cached.
+    */
+    void add(const image_type& img);
+
+    /*!
+        ensures:
+            - returns the normalized planar data of img, i.e. 3*img.size()
+              floats, or nullptr if img has not been cached.
+    */
+    const float* get(const image_type* img) const
+    {
+        auto it = offsets.find(img);
+        return (it == offsets.end()) ? nullptr : &values[it->second];
+    }
+
+    unsigned long size() const { return offsets.size(); }
+    void clear() { offsets.clear(); values.clear(); nr = nc = 0; }
+private:
+    long nr = 0;
+    long nc = 0;
+    std::vector<float> values;
+    std::unordered_map<const image_type*, size_t> offsets;
+};
+
+// ---------------------------------------------------------------------------
 
 /*!
     This object represents an input layer that accepts image pairs. The expected
-    input types are a pair of pointers to an rgb image.
+    input types are a pair of pointers to views of rgb images.
 */
 class input_rgb_image_pair {
 public:
-    typedef dlib::matrix<dlib::rgb_pixel> image_type;
+    typedef rgb_image_view image_type;
     typedef std::pair<const image_type*,const image_type*> input_type;
 
     /*!
@@ -24,13 +84,65 @@ public:
         input_iterator iend,
         dlib::resizable_tensor& data
     ) const;
+
+    /*!
+        ensures:
+            - to_tensor() copies the normalized data of images found in cache
+              instead of normalizing them again. Other images are normalized
+              as usual. A null cache disables this.
+            - the cache is shared by copies of this layer and is not
+              serialized.
+    */
+    void set_image_cache(std::shared_ptr<const normalized_image_cache> cache_) { cache = cache_; }
+    const std::shared_ptr<const normalized_image_cache>& get_image_cache() const { return cache; }
 private:
+    std::shared_ptr<const normalized_image_cache> cache;
+
     friend void serialize(const input_rgb_image_pair& item, std::ostream& out);
     friend void deserialize(input_rgb_image_pair& item, std::istream& in);
     friend std::ostream& operator<<(std::ostream& out, const input_rgb_image_pair& item);
     friend void to_xml(const input_rgb_image_pair& item, std::ostream& out);
 };
 
+// ---------------------------------------------------------------------------
+
+/*!
+    Holds the output of the network tower (the layers below the cross-input
+    neighborhood differences layer) for a single image.
+*/
+struct feature_map {
+    long k = 0;
+    long nr = 0;
+    long nc = 0;
+    std::vector<float> values;
+};
+
+/*!
+    This object represents an input layer that accepts individual precomputed
+    feature maps. It feeds networks whose differencing layer runs in broadcast
+    mode, where the first feature map is the probe and each of the remaining
+    ones is a gallery sample it is paired with.
+*/
+class input_feature_maps {
+public:
+    typedef const feature_map* input_type;
+
+    /*!
+        This function stacks the feature maps into a data tensor.
+    */
+    template <typename input_iterator>
+    void to_tensor(
+        input_iterator ibegin,
+        input_iterator iend,
+        dlib::resizable_tensor& data
+    ) const;
+private:
+    friend void serialize(const input_feature_maps& item, std::ostream& out);
+    friend void deserialize(input_feature_maps& item, std::istream& in);
+    friend std::ostream& operator<<(std::ostream& out, const input_feature_maps& item);
+    friend void to_xml(const input_feature_maps& item, std::ostream& out);
+};
+
 
 
 
@@ -52,49 +164,61 @@ void input_rgb_image_pair::to_tensor(
     const long nc = (*ibegin->first).nc();
     data.set_size(std::distance(ibegin, iend)*2, 3, nr, nc);
 
-    long channel_offset = nr*nc;
-    long image_offset = 3*channel_offset;
-
-    float* data_ptr = data.host();
+    std::vector<const image_type*> images;
+    images.reserve(2*std::distance(ibegin, iend));
     for (auto i = ibegin; i != iend; ++i) {
         DLIB_CASSERT((*i->first).nc() == nc && (*i->second).nc() == nc &&
                      (*i->first).nr() == nr && (*i->second).nr() == nr,
                      "Image size mismatch.");
+        images.push_back(i->first);
+        images.push_back(i->second);
+    }
+
+    // Each image is an independent sample of the tensor
+    const long image_offset = 3*nr*nc;
+    float* data_ptr = data.host();
+    auto copy_image = [&](long j) {
+        const float* cached = cache ? cache->get(images[j]) : nullptr;
+        if (cached)
+            std::memcpy(data_ptr + j*image_offset, cached, image_offset*sizeof(float));
+        else
+            normalize_image(*images[j], data_ptr + j*image_offset);
+    };
+
+    const long num_images = images.size();
+    if (num_images > 2) {
+        dlib::parallel_for(0, num_images, copy_image);
+    }
+    else {
+        for (long j = 0; j < num_images; ++j)
+            copy_image(j);
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+template <typename input_iterator>
+void input_feature_maps::to_tensor(
+    input_iterator ibegin,
+    input_iterator iend,
+    dlib::resizable_tensor& data
+) const
+{
+    DLIB_CASSERT(std::distance(ibegin, iend) > 0, "Requires at least one example.");
+
+    const long k = (*ibegin)->k;
+    const long nr = (*ibegin)->nr;
+    const long nc = (*ibegin)->nc;
+    data.set_size(std::distance(ibegin, iend), k, nr, nc);
+
+    const long sample_size = k*nr*nc;
+    float* data_ptr = data.host();
+    for (auto i = ibegin; i != iend; ++i) {
+        DLIB_CASSERT((*i)->k == k && (*i)->nr == nr && (*i)->nc == nc,
+                     "Feature map size mismatch.");
 
-        // Find image statistics for normalization
-        dlib::running_stats<float> stats1, stats2;
-        for (long r = 0; r < nr; ++r) {
-            for (long c = 0; c < nc; ++c) {
-                stats1.add((*i->first)(r,c).red);
-                stats1.add((*i->first)(r,c).green);
-                stats1.add((*i->first)(r,c).blue);
-                stats2.add((*i->second)(r,c).red);
-                stats2.add((*i->second)(r,c).green);
-                stats2.add((*i->second)(r,c).blue);
-            }
-        }
-
-        // Populate data tensor
-        for (long r = 0; r < nr; ++r) {
-            for (long c = 0; c < nc; ++c) {
-                // Copy the data pointer
-                float* p = data_ptr++;
-                dlib::rgb_pixel tmp1 = (*i->first)(r,c);
-                dlib::rgb_pixel tmp2 = (*i->second)(r,c);
-
-                *p = (static_cast<float>(tmp1.red)-stats1.mean())/(stats1.stddev()+1e-7);
-                *(p+image_offset) = (static_cast<float>(tmp2.red)-stats2.mean())/(stats2.stddev()+1e-7);
-                p += channel_offset;
-
-                *p = (static_cast<float>(tmp1.green)-stats1.mean())/(stats1.stddev()+1e-7);
-                *(p+image_offset) = (static_cast<float>(tmp2.green)-stats2.mean())/(stats2.stddev()+1e-7);
-                p += channel_offset;
-
-                *p = (static_cast<float>(tmp1.blue)-stats1.mean())/(stats1.stddev()+1e-7);
-                *(p+image_offset) = (static_cast<float>(tmp2.blue)-stats2.mean())/(stats2.stddev()+1e-7);
-            }
-        }
-        data_ptr += 5*channel_offset;
+        std::memcpy(data_ptr, (*i)->values.data(), sample_size*sizeof(float));
+        data_ptr += sample_size;
     }
 }
 
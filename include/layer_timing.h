@@ -0,0 +1,246 @@
+#ifndef IDLA__LAYER_TIMING_H_
+#define IDLA__LAYER_TIMING_H_
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dlib/dnn.h>
+
+#include "trace.h"
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Timing statistics of a single layer object. Updated by every forward and
+    backward pass of the layer, possibly from several threads at once.
+*/
+struct layer_timing {
+    explicit layer_timing(const std::string& name_)
+        : name(name_), backward_name(name_+" (backward)") { }
+
+    const std::string name;
+    const std::string backward_name;    // names of the trace events
+    std::atomic<uint64_t> forward_calls{0};
+    std::atomic<uint64_t> forward_nanoseconds{0};
+    std::atomic<uint64_t> backward_calls{0};
+    std::atomic<uint64_t> backward_nanoseconds{0};
+    std::atomic<uint64_t> output_samples{0};    // summed over forward calls
+    std::atomic<long> output_k{0};              // shape of the last output
+    std::atomic<long> output_nr{0};
+    std::atomic<long> output_nc{0};
+};
+
+/*!
+    Timing statistics summed over all layer objects with the same name and
+    output shape, e.g. a layer and its copies in other network replicas.
+*/
+struct layer_timing_summary {
+    std::string name;
+    long k = 0;
+    long nr = 0;
+    long nc = 0;
+    uint64_t forward_calls = 0;
+    double forward_seconds = 0;
+    uint64_t backward_calls = 0;
+    double backward_seconds = 0;
+    double average_samples = 0;     // per forward call
+
+    double total_seconds() const { return forward_seconds + backward_seconds; }
+};
+
+/*!
+    ensures:
+        - returns a new timing entry with the given name, which is reported by
+          get_layer_timings() from now on.
+*/
+std::shared_ptr<layer_timing> register_layer_timing(const std::string& name);
+
+/*!
+    ensures:
+        - returns the summed statistics of all timed layers, including those
+          that have been destroyed, sorted by decreasing total time.
+*/
+std::vector<layer_timing_summary> get_layer_timings();
+
+/*!
+    ensures:
+        - zeroes the statistics of all timed layers, e.g. to time evaluation
+          separately from training.
+*/
+void reset_layer_timings();
+
+/*!
+    ensures:
+        - prints a table of get_layer_timings() to out. Prints nothing if no
+          timed layer has run.
+*/
+void print_layer_timings(std::ostream& out);
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Layer that behaves exactly like LAYER_DETAILS, but records the wall clock
+    time, number of calls and output sizes of its forward and backward passes.
+
+    timed_ derives from LAYER_DETAILS and only intercepts the forward and
+    backward functions that LAYER_DETAILS provides, so dlib treats both the
+    same (including running the layer in place). The serialization format is
+    that of LAYER_DETAILS, i.e. timed and untimed networks can load each
+    other's files.
+
+    Every object has its own statistics, which are registered on its first
+    forward pass. Copies start with fresh statistics.
+
+    While tracing (see trace.h), every pass is also recorded as a trace event
+    named after the layer.
+
+    When the layer runs on a GPU, the times are those of launching its
+    kernels, since dlib does not synchronize with the device.
+*/
+template <typename LAYER_DETAILS>
+class timed_ : public LAYER_DETAILS {
+public:
+    typedef LAYER_DETAILS details_type;
+
+    using LAYER_DETAILS::LAYER_DETAILS;
+
+    timed_() = default;
+
+    timed_(const timed_& item) : LAYER_DETAILS(item) { }
+
+    timed_& operator=(const timed_& item)
+    {
+        LAYER_DETAILS::operator=(item);
+        return *this;
+    }
+
+    template <typename T>
+    timed_(const timed_<T>& item) : LAYER_DETAILS(static_cast<const T&>(item)) { }
+
+    // Each function is a template whose return type only exists if
+    // LAYER_DETAILS has the intercepted function, which is how dlib
+    // detects the interface of a layer.
+    template <typename SUBNET, typename T = LAYER_DETAILS>
+    auto forward(const SUBNET& sub, dlib::resizable_tensor& output)
+        -> decltype(std::declval<T&>().forward(sub, output))
+    {
+        const int64_t start = trace_impl::now();
+        LAYER_DETAILS::forward(sub, output);
+        record_forward(start, output);
+    }
+
+    template <typename T = LAYER_DETAILS>
+    auto forward_inplace(const dlib::tensor& input, dlib::tensor& output)
+        -> decltype(std::declval<T&>().forward_inplace(input, output))
+    {
+        const int64_t start = trace_impl::now();
+        LAYER_DETAILS::forward_inplace(input, output);
+        record_forward(start, output);
+    }
+
+    // The backward signatures differ between dlib versions, so the arguments
+    // are forwarded as they are.
+    template <typename T = LAYER_DETAILS, typename... ARGS>
+    auto backward(ARGS&&... args)
+        -> decltype(std::declval<T&>().backward(std::forward<ARGS>(args)...))
+    {
+        const int64_t start = trace_impl::now();
+        LAYER_DETAILS::backward(std::forward<ARGS>(args)...);
+        record_backward(start);
+    }
+
+    template <typename T = LAYER_DETAILS, typename... ARGS>
+    auto backward_inplace(ARGS&&... args)
+        -> decltype(std::declval<T&>().backward_inplace(std::forward<ARGS>(args)...))
+    {
+        const int64_t start = trace_impl::now();
+        LAYER_DETAILS::backward_inplace(std::forward<ARGS>(args)...);
+        record_backward(start);
+    }
+private:
+    void record_forward(int64_t start, const dlib::tensor& output)
+    {
+        const int64_t end = trace_impl::now();
+        if (!timing) {
+            std::ostringstream sout;
+            sout << static_cast<const LAYER_DETAILS&>(*this);
+            timing = register_layer_timing(sout.str());
+        }
+        if (is_tracing())
+            trace_impl::record(timing->name.c_str(), start, end);
+        timing->forward_calls += 1;
+        timing->forward_nanoseconds += end-start;
+        timing->output_samples += output.num_samples();
+        timing->output_k = output.k();
+        timing->output_nr = output.nr();
+        timing->output_nc = output.nc();
+    }
+
+    void record_backward(int64_t start)
+    {
+        const int64_t end = trace_impl::now();
+        if (timing) {
+            if (is_tracing())
+                trace_impl::record(timing->backward_name.c_str(), start, end);
+            timing->backward_calls += 1;
+            timing->backward_nanoseconds += end-start;
+        }
+    }
+
+    std::shared_ptr<layer_timing> timing;
+};
+
+// ---------------------------------------------------------------------------
+
+/*!
+    timed<LAYER> is LAYER with its top layer wrapped in timed_, and
+    timed_net<NET> is NET with every computational layer wrapped in timed_,
+    down to its input layer or the first layer that is not an add_layer.
+    Both are only defined to do so if IDLA_LAYER_TIMING is defined, and are
+    the unchanged types otherwise, which leaves no overhead behind.
+*/
+namespace layer_timing_impl
+{
+    template <typename LAYER>
+    struct time_top_layer { typedef LAYER type; };
+
+    template <typename LAYER_DETAILS, typename SUBNET, typename E>
+    struct time_top_layer<dlib::add_layer<LAYER_DETAILS,SUBNET,E>> {
+        typedef dlib::add_layer<timed_<LAYER_DETAILS>,SUBNET> type;
+    };
+
+    template <typename NET>
+    struct time_all_layers { typedef NET type; };   // input layers
+
+    template <typename LAYER_DETAILS, typename SUBNET, typename E>
+    struct time_all_layers<dlib::add_layer<LAYER_DETAILS,SUBNET,E>> {
+        typedef dlib::add_layer<timed_<LAYER_DETAILS>, typename time_all_layers<SUBNET>::type> type;
+    };
+
+    template <typename LOSS_DETAILS, typename SUBNET>
+    struct time_all_layers<dlib::add_loss_layer<LOSS_DETAILS,SUBNET>> {
+        typedef dlib::add_loss_layer<LOSS_DETAILS, typename time_all_layers<SUBNET>::type> type;
+    };
+}
+
+#ifdef IDLA_LAYER_TIMING
+template <typename LAYER>
+using timed = typename layer_timing_impl::time_top_layer<LAYER>::type;
+
+template <typename NET>
+using timed_net = typename layer_timing_impl::time_all_layers<NET>::type;
+#else
+template <typename LAYER>
+using timed = LAYER;
+
+template <typename NET>
+using timed_net = NET;
+#endif
+
+#endif // IDLA__LAYER_TIMING_H_
@@ -0,0 +1,191 @@
+#ifndef IDLA__PATCH_SUMMARY_H_
+#define IDLA__PATCH_SUMMARY_H_
+
+#include <dlib/dnn.h>
+
+#ifdef DLIB_USE_CUDA
+  #include "difference_impl_gpu.h"
+#else
+  #include "difference_impl_cpu.h"
+#endif // DLIB_USE_CUDA
+
+/*!
+    This object represents a cross-input neighborhood differences layer,
+    followed by a ReLU and a "patch summary" convolution whose filters are the
+    size of one neighborhood and have a stride equal to that size. It is
+    equivalent to
+
+        con<num_filters,_nr,_nc,_nr,_nc,cross_neighborhood_differences_relu<_nr,_nc,SUBNET>>
+
+    but never stores the _nr*_nc times larger differencing output. This layer
+    only supports inference; its parameters are meant to be loaded from a
+    trained dlib::con_ layer with set_filters().
+*/
+template <long num_filters, long _nr=5, long _nc=5>
+class cross_neighborhood_patch_summary_ {
+public:
+    const static unsigned int sample_expansion_factor = 1;
+
+    static_assert(num_filters > 0, "The number of filters must be > 0");
+    static_assert(_nr > 0, "The number of rows in the neighborhood region must be > 0");
+    static_assert(_nc > 0, "The number of columns in the neighborhood region must be > 0");
+    static_assert(_nr % 2 != 0, "The number of rows in the neighborhood region must be an odd number");
+    static_assert(_nc % 2 != 0, "The number of columns in the neighborhood region must be an odd number");
+
+    cross_neighborhood_patch_summary_() { }
+
+    template <typename SUBNET>
+    void setup(const SUBNET& sub)
+    {
+        DLIB_CASSERT(broadcast || sub.get_output().num_samples() % 2 == 0, "");
+
+        // Same layout and initialization as dlib::con_, i.e. the filters
+        // followed by the biases.
+        long num_inputs = _nr*_nc*sub.get_output().k();
+        long num_outputs = num_filters;
+        params.set_size(num_inputs*num_filters + num_filters);
+
+        dlib::rand rnd(std::rand());
+        dlib::randomize_parameters(params, num_inputs+num_outputs, rnd);
+
+        dlib::alias_tensor biases(1, num_filters);
+        biases(params, num_inputs*num_filters) = 0;
+    }
+
+    /*!
+        requires:
+            - con_params is the parameter tensor of a dlib::con_ layer with
+              num_filters filters of size _nr by _nc and stride _nr by _nc
+              that was applied to the output of a differencing layer with the
+              same input as this layer.
+            - this layer has already been set up, i.e. a forward pass has been
+              run through it.
+
+        ensures:
+            - this layer computes the same output as that convolution did.
+    */
+    void set_filters(const dlib::tensor& con_params)
+    {
+        DLIB_CASSERT(con_params.size() == params.size(), "Filter size mismatch.");
+        dlib::memcpy(params, con_params);
+    }
+
+    /*!
+        ensures:
+            - if enable is true, this layer runs in broadcast mode: its input
+              holds one probe followed by N gallery samples, and its output
+              holds the 2N samples it would otherwise produce for the input
+              probe, gallery 1, probe, gallery 2, ...
+            - the mode is not serialized.
+    */
+    void set_broadcast(bool enable) { broadcast = enable; }
+    bool is_broadcast() const { return broadcast; }
+
+    /*!
+        Performs the fused differencing, ReLU and patch summary convolution.
+    */
+    template <typename SUBNET>
+    void forward(const SUBNET& sub, dlib::resizable_tensor& data_output)
+    {
+        // Each neighborhood is summarized into a single pixel, so the output
+        // has the same number of rows and columns as the input.
+        const dlib::tensor& input_tensor = sub.get_output();
+        DLIB_CASSERT(!broadcast || input_tensor.num_samples() >= 2, "");
+        const long num_samples = broadcast ? 2*(input_tensor.num_samples()-1) : input_tensor.num_samples();
+        data_output.set_size(num_samples, num_filters,
+                             input_tensor.nr(), input_tensor.nc());
+#ifdef DLIB_USE_CUDA
+        launch_patch_summary_kernel(input_tensor.device(),
+                                    params.device(),
+                                    data_output.device_write_only(),
+                                    num_filters,
+                                    input_tensor.k(),
+                                    input_tensor.nr(),
+                                    input_tensor.nc(),
+                                    _nr,
+                                    _nc,
+                                    data_output.size(),
+                                    broadcast);
+#else
+        perform_cross_neighborhood_patch_summary(input_tensor, params, data_output,
+                                                 num_filters, dlib::vector<long,2>(_nc, _nr),
+                                                 broadcast);
+#endif
+    }
+
+    /*!
+        This layer only supports inference.
+    */
+    template <typename SUBNET>
+    void backward(
+        const dlib::tensor& , // gradient_input
+        SUBNET& ,             // sub
+        dlib::tensor&         // params_grad
+    )
+    {
+        throw dlib::error("cross_neighborhood_patch_summary_ does not support training.");
+    }
+
+    const dlib::tensor& get_layer_params() const { return params; }
+    dlib::tensor& get_layer_params() { return params; }
+
+    friend void serialize(const cross_neighborhood_patch_summary_& item, std::ostream& out)
+    {
+        dlib::serialize("cross_neighborhood_patch_summary", out);
+        dlib::serialize(num_filters, out);
+        dlib::serialize(_nr, out);
+        dlib::serialize(_nc, out);
+        dlib::serialize(item.params, out);
+    }
+
+    friend void deserialize(cross_neighborhood_patch_summary_& item, std::istream& in)
+    {
+        std::string version;
+        dlib::deserialize(version, in);
+        long num_filters_;
+        long nr;
+        long nc;
+        if (version == "cross_neighborhood_patch_summary") {
+            dlib::deserialize(num_filters_, in);
+            dlib::deserialize(nr, in);
+            dlib::deserialize(nc, in);
+            dlib::deserialize(item.params, in);
+        }
+        else {
+            throw dlib::serialization_error("Unexpected version '"+version+"' found while deserializing cross_neighborhood_patch_summary_.");
+        }
+
+        if (num_filters != num_filters_) throw dlib::serialization_error("Wrong num_filters found while deserializing cross_neighborhood_patch_summary_");
+        if (_nr != nr) throw dlib::serialization_error("Wrong nr found while deserializing cross_neighborhood_patch_summary_");
+        if (_nc != nc) throw dlib::serialization_error("Wrong nc found while deserializing cross_neighborhood_patch_summary_");
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, const cross_neighborhood_patch_summary_& item)
+    {
+        out << "cross_neighborhood_patch_summary\t ("
+            << "num_filters="<<num_filters
+            << ", nr="<<_nr
+            << ", nc="<<_nc
+            << ")";
+        return out;
+    }
+
+    friend void to_xml(const cross_neighborhood_patch_summary_& item, std::ostream& out)
+    {
+        out << "<cross_neighborhood_patch_summary"
+            << " num_filters='"<<num_filters<<"'"
+            << " nr='"<<_nr<<"'"
+            << " nc='"<<_nc<<"'"
+            << ">\n";
+        out << dlib::mat(item.params);
+        out << "</cross_neighborhood_patch_summary>\n";
+    }
+private:
+    dlib::resizable_tensor params;
+    bool broadcast = false;
+};
+
+template <long num_filters, long nr, long nc, typename SUBNET>
+using cross_neighborhood_patch_summary = dlib::add_layer<cross_neighborhood_patch_summary_<num_filters, nr, nc>, SUBNET>;
+
+#endif // IDLA__PATCH_SUMMARY_H_
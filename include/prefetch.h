@@ -0,0 +1,147 @@
+#ifndef IDLA__PREFETCH_H_
+#define IDLA__PREFETCH_H_
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <dlib/assert.h>
+#include <dlib/noncopyable.h>
+#include <dlib/pipe.h>
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Produces items in background threads ahead of their use, e.g. the next
+    minibatches of a training loop while the current one is being trained on.
+
+    Each worker thread runs its own producer and fills its own queue, and
+    item i is always made by worker i % num_workers. Items are handed out in
+    that order, so the sequence of items only depends on the producers, not
+    on thread scheduling. Producers that are seeded per worker therefore give
+    reproducible results for a fixed number of workers.
+*/
+template <typename T>
+class prefetcher : dlib::noncopyable {
+public:
+    typedef std::function<T()> producer_type;
+
+    /*!
+        requires:
+            - num_workers > 0
+            - depth > 0
+            - make_producer(w) returns the producer_type run by worker w, for
+              w in [0, num_workers). Producers are only called from their own
+              worker thread.
+
+        ensures:
+            - starts num_workers threads, each of which keeps up to depth
+              produced items queued.
+    */
+    template <typename producer_factory>
+    prefetcher(size_t num_workers, size_t depth, producer_factory make_producer);
+
+    /*!
+        ensures:
+            - stops and joins all worker threads. Queued items are discarded.
+    */
+    ~prefetcher();
+
+    size_t num_workers() const { return workers.size(); }
+
+    /*!
+        ensures:
+            - returns the next item, waiting for it to be produced if needed.
+
+        throws:
+            - any exception thrown by the producer of that item. The prefetcher
+              must not be used afterwards.
+    */
+    T get();
+private:
+    struct worker {
+        explicit worker(size_t depth) : queue(depth) { }
+
+        dlib::pipe<T> queue;
+        producer_type producer;
+        std::exception_ptr error;
+        std::thread thread;
+    };
+
+    static void run(worker& w);
+
+    std::vector<std::unique_ptr<worker>> workers;
+    size_t next = 0;
+};
+
+// =========================================================================== //
+//                               IMPLEMENTATION                                //
+// =========================================================================== //
+
+template <typename T>
+template <typename producer_factory>
+prefetcher<T>::prefetcher(size_t num_workers, size_t depth, producer_factory make_producer)
+{
+    DLIB_CASSERT(num_workers > 0 && depth > 0, "");
+
+    for (size_t i = 0; i < num_workers; ++i) {
+        workers.emplace_back(new worker(depth));
+        workers.back()->producer = make_producer(i);
+    }
+
+    // Start the threads only once every producer exists, so that a throwing
+    // factory does not leave threads behind.
+    for (auto& w : workers) {
+        worker& ref = *w;
+        w->thread = std::thread([&ref]() { run(ref); });
+    }
+}
+
+template <typename T>
+prefetcher<T>::~prefetcher()
+{
+    for (auto& w : workers)
+        w->queue.disable();
+    for (auto& w : workers) {
+        if (w->thread.joinable())
+            w->thread.join();
+    }
+}
+
+template <typename T>
+T prefetcher<T>::get()
+{
+    worker& w = *workers[next];
+    next = (next+1) % workers.size();
+
+    T item;
+    if (!w.queue.dequeue(item)) {
+        if (w.error)
+            std::rethrow_exception(w.error);
+        throw std::runtime_error("The prefetcher has been stopped.");
+    }
+    return item;
+}
+
+template <typename T>
+void prefetcher<T>::run(worker& w)
+{
+    try {
+        for (;;) {
+            T item = w.producer();
+            if (!w.queue.enqueue(item))
+                return;
+        }
+    }
+    catch (...) {
+        // Let the consumer drain the items made before the failure, after
+        // which it sees the exception.
+        w.error = std::current_exception();
+        w.queue.disable_enqueue();
+    }
+}
+
+#endif // IDLA__PREFETCH_H_
@@ -0,0 +1,109 @@
+#ifndef IDLA__REPLICA_POOL_H_
+#define IDLA__REPLICA_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <dlib/assert.h>
+#include <dlib/noncopyable.h>
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Holds copies of a network so that several threads can run it at once.
+    dlib networks keep their outputs and temporaries in the network object,
+    so a single network must not be run from two threads concurrently.
+
+    parallel_for() runs a loop over as many threads as there are replicas,
+    with each thread using its own replica. Indices are handed out one at a
+    time from a shared counter, so a thread that finishes early takes over
+    work that would otherwise queue up behind a slow one.
+*/
+template <typename net_type>
+class replica_pool : dlib::noncopyable {
+public:
+    /*!
+        requires:
+            - num_replicas > 0
+
+        ensures:
+            - #size() == num_replicas
+            - every replica is a copy of net.
+    */
+    replica_pool(const net_type& net, size_t num_replicas);
+
+    size_t size() const { return replicas.size(); }
+
+    net_type& operator[](size_t w) { return *replicas[w]; }
+
+    /*!
+        ensures:
+            - calls f(w, i) for every i in [begin, end), where w < size() is
+              the index of the replica f must use. No two concurrent calls
+              get the same w.
+            - the order of the calls is unspecified, so results should be
+              stored per index and merged afterwards.
+
+        throws:
+            - the first exception thrown by f. The remaining indices are
+              skipped in that case.
+    */
+    template <typename F>
+    void parallel_for(long begin, long end, F f);
+private:
+    std::vector<std::unique_ptr<net_type>> replicas;
+};
+
+// =========================================================================== //
+//                               IMPLEMENTATION                                //
+// =========================================================================== //
+
+template <typename net_type>
+replica_pool<net_type>::replica_pool(const net_type& net, size_t num_replicas)
+{
+    DLIB_CASSERT(num_replicas > 0, "");
+    for (size_t w = 0; w < num_replicas; ++w)
+        replicas.emplace_back(new net_type(net));
+}
+
+template <typename net_type>
+template <typename F>
+void replica_pool<net_type>::parallel_for(long begin, long end, F f)
+{
+    std::atomic<long> next(begin);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto run = [&](size_t w) {
+        try {
+            for (long i = next++; i < end; i = next++)
+                f(w, i);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            next = end;
+        }
+    };
+
+    // The calling thread works with the first replica.
+    std::vector<std::thread> threads;
+    const size_t num_threads = std::min<size_t>(replicas.size(), std::max<long>(end-begin, 0));
+    for (size_t w = 1; w < num_threads; ++w)
+        threads.emplace_back(run, w);
+    if (num_threads > 0)
+        run(0);
+    for (std::thread& t : threads)
+        t.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+#endif // IDLA__REPLICA_POOL_H_
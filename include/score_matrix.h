@@ -0,0 +1,82 @@
+#ifndef IDLA__SCORE_MATRIX_H_
+#define IDLA__SCORE_MATRIX_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// ---------------------------------------------------------------------------
+
+/*!
+    The scores of every probe image of a test protocol against every gallery
+    image, together with the identities of the images. run_cuhk03 --scores
+    writes them to disk, so that metrics can be computed without running the
+    network again (see cuhk03_metrics.cpp).
+*/
+struct score_matrix {
+    std::vector<int32_t> probe_ids;     // identity of every probe image
+    std::vector<int32_t> gallery_ids;   // identity of every gallery image
+    std::vector<float> scores;          // probe p and gallery image g at p*num_gallery()+g
+
+    size_t num_probes() const { return probe_ids.size(); }
+    size_t num_gallery() const { return gallery_ids.size(); }
+    const float* row(size_t p) const { return &scores[p*gallery_ids.size()]; }
+};
+
+/*!
+    requires:
+        - m.scores.size() == m.num_probes()*m.num_gallery()
+
+    ensures:
+        - writes m to filename in a compact binary format: a header with the
+          sizes, the identities as int32 and the scores as float32.
+
+    throws:
+        - std::runtime_error if the file cannot be written.
+*/
+void save_score_matrix(const std::string& filename, const score_matrix& m);
+
+/*!
+    ensures:
+        - returns the matrix written by save_score_matrix() to filename.
+
+    throws:
+        - std::runtime_error if the file cannot be read or is not a score
+          matrix written on a machine of the same byte order.
+*/
+score_matrix load_score_matrix(const std::string& filename);
+
+// ---------------------------------------------------------------------------
+
+/*!
+    The metrics below skip probes whose identity does not appear in the
+    gallery. Ties between a correct and a wrong gallery image are resolved in
+    favor of the wrong one, except for the single-shot CMC.
+*/
+
+/*!
+    ensures:
+        - returns the expected single-shot CMC, where every gallery identity
+          is represented by one of its images chosen uniformly at random
+          (see add_expected_ranks() in cmc.h). Element r is the fraction of
+          probes whose match is among the first r+1 identities, and there is
+          one element per gallery identity.
+*/
+std::vector<double> single_shot_cmc(const score_matrix& m);
+
+/*!
+    ensures:
+        - returns the multi-shot CMC over all gallery images. Element k-1 is
+          the top-k accuracy, i.e. the fraction of probes with an image of
+          the same identity among the k best scoring gallery images.
+*/
+std::vector<double> top_k_accuracy(const score_matrix& m);
+
+/*!
+    ensures:
+        - returns the mean over all probes of the average precision of the
+          gallery images ranked by score.
+*/
+double mean_average_precision(const score_matrix& m);
+
+#endif // IDLA__SCORE_MATRIX_H_
@@ -0,0 +1,365 @@
+#ifndef IDLA__SYNC_BATCH_NORM_H_
+#define IDLA__SYNC_BATCH_NORM_H_
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include <dlib/dnn.h>
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Lets the replicas of a network that train on the shards of a minibatch
+    (see data_parallel_trainer.h) exchange the per-channel sums their batch
+    normalization layers need. The replicas pass through the same layers in
+    the same order, so a single object serves all layers.
+*/
+class batch_norm_sync : dlib::noncopyable {
+public:
+    /*!
+        requires:
+            - weights.size() > 0
+
+        ensures:
+            - #num_shards() == weights.size()
+            - #weight(i) == weights[i]
+    */
+    void begin_step(const std::vector<double>& weights);
+
+    /*!
+        ensures:
+            - #num_shards() == 0, so the layers normalize on their own again.
+    */
+    void end_step();
+
+    /*!
+        ensures:
+            - #is_setup_pass() == setup_pass. During a setup pass, the layers
+              normalize with the statistics of their own input and leave
+              their running statistics unchanged, since the pass only sets up
+              the network (see data_parallel_trainer.h).
+    */
+    void set_setup_pass(bool setup_pass_) { setup_pass = setup_pass_; }
+    bool is_setup_pass() const { return setup_pass; }
+
+    size_t num_shards() const { return weights.size(); }
+    double weight(size_t shard) const { return weights[shard]; }
+
+    /*!
+        requires:
+            - shard < num_shards()
+            - is called by every shard, with values of the same size.
+
+        ensures:
+            - waits for all shards, then sets #values to the sum over all
+              shards j of their values, each multiplied by weight(j) if
+              weighted is true. The sum is taken in shard order, so every
+              shard gets the same result.
+
+        throws:
+            - std::runtime_error if abort() is called before all shards
+              arrive.
+    */
+    void all_reduce(size_t shard, std::vector<double>& values, bool weighted);
+
+    /*!
+        ensures:
+            - wakes up the shards waiting in all_reduce() and makes them
+              throw. Called when a shard fails, since the other shards would
+              otherwise wait for it forever. begin_step() resets this.
+    */
+    void abort();
+private:
+    void wait(std::unique_lock<std::mutex>& lock);
+
+    std::vector<double> weights;
+    std::vector<std::vector<double>> slots;
+    size_t arrived = 0;
+    unsigned long generation = 0;
+    bool aborted = false;
+    bool setup_pass = false;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+// ---------------------------------------------------------------------------
+
+/*!
+    The part of a synchronized batch normalization layer that does not depend
+    on its mode, used by data_parallel_trainer to find the layers.
+*/
+class batch_norm_sync_client {
+public:
+    void set_batch_norm_sync(const std::shared_ptr<batch_norm_sync>& sync_, size_t shard_)
+    {
+        sync = sync_;
+        shard = shard_;
+    }
+protected:
+    bool is_synchronized() const { return sync && sync->num_shards() > 1; }
+    bool is_setup_pass() const { return sync && sync->is_setup_pass(); }
+
+    std::shared_ptr<batch_norm_sync> sync;
+    size_t shard = 0;
+};
+
+/*!
+    A dlib batch normalization layer whose statistics are computed over the
+    whole minibatch when it is split across replicas.
+
+    The forward pass sums each channel's values and squared values over every
+    shard before normalizing, and the backward pass does the same with the
+    sums the gradient depends on. The running statistics are updated with
+    the statistics of the whole minibatch in every replica. Training with any
+    number of replicas thus matches training on a single one, up to floating
+    point rounding. A setup pass leaves the running statistics unchanged.
+
+    Without a batch_norm_sync, or with a single shard, the layer is exactly
+    dlib's bn_. It is stored in the same format, and can be converted to an
+    affine layer for testing.
+*/
+template <dlib::layer_mode mode>
+class sync_bn_ : public dlib::bn_<mode>, public batch_norm_sync_client {
+public:
+    using dlib::bn_<mode>::bn_;
+
+    sync_bn_() = default;
+
+    template <typename SUBNET>
+    void forward(const SUBNET& sub, dlib::resizable_tensor& output);
+
+    template <typename SUBNET>
+    void backward(const dlib::tensor& gradient_input, SUBNET& sub, dlib::tensor& params_grad);
+private:
+    // Values of sample n and channel c are at
+    // data[(n*num_channels + c)*plane_size + j] for j < plane_size.
+    static long num_channels(const dlib::tensor& t)
+    {
+        return (mode == dlib::CONV_MODE) ? t.k() : t.k()*t.nr()*t.nc();
+    }
+    static long plane_size(const dlib::tensor& t)
+    {
+        return (mode == dlib::CONV_MODE) ? t.nr()*t.nc() : 1;
+    }
+
+    void update_running_stats(const dlib::tensor& input, const std::vector<double>& vars);
+
+    struct tensor_subnet {
+        const dlib::tensor& output;
+        const dlib::tensor& get_output() const { return output; }
+    };
+
+    bool synchronized_forward = false;
+    double count = 0;
+    std::vector<double> means;
+    std::vector<double> invstds;
+};
+
+template <typename SUBNET>
+using sync_bn_con = dlib::add_layer<sync_bn_<dlib::CONV_MODE>, SUBNET>;
+
+template <typename SUBNET>
+using sync_bn_fc = dlib::add_layer<sync_bn_<dlib::FC_MODE>, SUBNET>;
+
+// ---------------------------------------------------------------------------
+
+/*!
+    ensures:
+        - calls set_batch_norm_sync(sync, shard) on every synchronized batch
+          normalization layer of net.
+*/
+template <typename net_type>
+void set_batch_norm_sync(net_type& net, const std::shared_ptr<batch_norm_sync>& sync, size_t shard);
+
+// =========================================================================== //
+//                               IMPLEMENTATION                                //
+// =========================================================================== //
+
+template <dlib::layer_mode mode>
+template <typename SUBNET>
+void sync_bn_<mode>::forward(const SUBNET& sub, dlib::resizable_tensor& output)
+{
+    const dlib::tensor& x = sub.get_output();
+    const bool setup_pass = is_setup_pass();
+    synchronized_forward = is_synchronized() && !setup_pass;
+    if (!synchronized_forward && !setup_pass) {
+        dlib::bn_<mode>::forward(sub, output);
+        return;
+    }
+
+    const long nch = num_channels(x);
+    const long plane = plane_size(x);
+    const float* px = x.host();
+
+    // Channel sums, sums of squares and the number of values, over all shards
+    // unless this is a setup pass
+    std::vector<double> sums(2*nch+1, 0);
+    for (long n = 0; n < x.num_samples(); ++n) {
+        for (long c = 0; c < nch; ++c) {
+            const float* p = px + (n*nch + c)*plane;
+            for (long j = 0; j < plane; ++j) {
+                sums[c] += p[j];
+                sums[nch+c] += static_cast<double>(p[j])*p[j];
+            }
+        }
+    }
+    sums[2*nch] = x.num_samples()*plane;
+    if (synchronized_forward)
+        sync->all_reduce(shard, sums, false);
+
+    count = sums[2*nch];
+    means.resize(nch);
+    invstds.resize(nch);
+    std::vector<double> vars(nch);
+    for (long c = 0; c < nch; ++c) {
+        means[c] = sums[c]/count;
+        vars[c] = std::max(0.0, sums[nch+c]/count - means[c]*means[c]);
+        invstds[c] = 1/std::sqrt(vars[c] + this->get_eps());
+    }
+
+    const float* gamma = this->get_layer_params().host();
+    const float* beta = gamma + nch;
+    output.copy_size(x);
+    float* out = output.host();
+    for (long n = 0; n < x.num_samples(); ++n) {
+        for (long c = 0; c < nch; ++c) {
+            const long offset = (n*nch + c)*plane;
+            const double scale = gamma[c]*invstds[c];
+            for (long j = 0; j < plane; ++j)
+                out[offset+j] = scale*(px[offset+j] - means[c]) + beta[c];
+        }
+    }
+
+    if (!setup_pass)
+        update_running_stats(x, vars);
+}
+
+template <dlib::layer_mode mode>
+template <typename SUBNET>
+void sync_bn_<mode>::backward(const dlib::tensor& gradient_input, SUBNET& sub, dlib::tensor& params_grad)
+{
+    if (!synchronized_forward) {
+        dlib::bn_<mode>::backward(gradient_input, sub, params_grad);
+        return;
+    }
+
+    const dlib::tensor& x = sub.get_output();
+    const long nch = num_channels(x);
+    const long plane = plane_size(x);
+    const float* px = x.host();
+    const float* dy = gradient_input.host();
+
+    // Sums of the output gradient, and of it times the normalized input,
+    // which are also the gradients of beta and gamma.
+    std::vector<double> sums(2*nch, 0);
+    for (long n = 0; n < x.num_samples(); ++n) {
+        for (long c = 0; c < nch; ++c) {
+            const long offset = (n*nch + c)*plane;
+            for (long j = 0; j < plane; ++j) {
+                sums[c] += dy[offset+j];
+                sums[nch+c] += dy[offset+j]*(px[offset+j] - means[c])*invstds[c];
+            }
+        }
+    }
+    float* gamma_grad = params_grad.host();
+    float* beta_grad = gamma_grad + nch;
+    for (long c = 0; c < nch; ++c) {
+        gamma_grad[c] = sums[nch+c];
+        beta_grad[c] = sums[c];
+    }
+
+    // The gradient of this shard is that of its own loss, i.e. of the
+    // minibatch loss divided by the shard's weight. The sums over the whole
+    // minibatch are taken on the same scale.
+    sync->all_reduce(shard, sums, true);
+    const double scale = 1/(count*sync->weight(shard));
+
+    const float* gamma = this->get_layer_params().host();
+    float* dx = sub.get_gradient_input().host();
+    for (long n = 0; n < x.num_samples(); ++n) {
+        for (long c = 0; c < nch; ++c) {
+            const long offset = (n*nch + c)*plane;
+            const double mean_dy = sums[c]*scale;
+            const double mean_dy_xhat = sums[nch+c]*scale;
+            for (long j = 0; j < plane; ++j) {
+                const double xhat = (px[offset+j] - means[c])*invstds[c];
+                dx[offset+j] += gamma[c]*invstds[c]*(dy[offset+j] - mean_dy - xhat*mean_dy_xhat);
+            }
+        }
+    }
+}
+
+template <dlib::layer_mode mode>
+void sync_bn_<mode>::update_running_stats(const dlib::tensor& input, const std::vector<double>& vars)
+{
+    // bn_ keeps its running statistics to itself, so they are updated by
+    // running it on two samples per channel, mean+d and mean-d, which have
+    // the mean and the unbiased variance of the whole minibatch.
+    const long nch = means.size();
+    dlib::resizable_tensor stats_input;
+    if (mode == dlib::CONV_MODE)
+        stats_input.set_size(2, input.k());
+    else
+        stats_input.set_size(2, input.k(), input.nr(), input.nc());
+
+    float* p = stats_input.host();
+    for (long c = 0; c < nch; ++c) {
+        const double unbiased_var = (count > 1) ? vars[c]*count/(count-1) : 0;
+        const double d = std::sqrt(unbiased_var/2);
+        p[c] = means[c] + d;
+        p[nch+c] = means[c] - d;
+    }
+
+    dlib::resizable_tensor unused;
+    dlib::bn_<mode>::forward(tensor_subnet{stats_input}, unused);
+}
+
+// ---------------------------------------------------------------------------
+
+namespace sync_batch_norm_impl
+{
+    struct attach_sync {
+        const std::shared_ptr<batch_norm_sync>& sync;
+        size_t shard;
+
+        template <typename T>
+        typename std::enable_if<std::is_base_of<batch_norm_sync_client,T>::value>::type
+        details(T& item) const { item.set_batch_norm_sync(sync, shard); }
+
+        template <typename T>
+        typename std::enable_if<!std::is_base_of<batch_norm_sync_client,T>::value>::type
+        details(T&) const { }
+
+        template <typename LAYER_DETAILS, typename SUBNET, typename E>
+        void operator()(dlib::add_layer<LAYER_DETAILS,SUBNET,E>& layer) const { details(layer.layer_details()); }
+
+        template <typename LAYER>
+        void operator()(LAYER&) const { }   // loss, tag, skip and input layers
+    };
+
+    template <size_t i, typename net_type, typename F>
+    typename std::enable_if<(i == net_type::num_layers)>::type
+    visit_layers(net_type&, const F&) { }
+
+    template <size_t i, typename net_type, typename F>
+    typename std::enable_if<(i < net_type::num_layers)>::type
+    visit_layers(net_type& net, const F& f)
+    {
+        f(dlib::layer<i>(net));
+        visit_layers<i+1>(net, f);
+    }
+}
+
+template <typename net_type>
+void set_batch_norm_sync(net_type& net, const std::shared_ptr<batch_norm_sync>& sync, size_t shard)
+{
+    sync_batch_norm_impl::visit_layers<0>(net, sync_batch_norm_impl::attach_sync{sync, shard});
+}
+
+#endif // IDLA__SYNC_BATCH_NORM_H_
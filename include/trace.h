@@ -0,0 +1,88 @@
+#ifndef IDLA__TRACE_H_
+#define IDLA__TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Records a timeline of named stages, e.g. minibatch sampling, training
+    steps and checkpoint writes, for all threads of the process, and writes
+    it in the trace event format of Chrome (chrome://tracing, Perfetto).
+
+    Each thread records into its own ring buffer, which keeps the most recent
+    events once it is full. Recording an event only takes two clock reads and
+    an uncontended lock, and nothing at all while tracing is off.
+*/
+
+namespace trace_impl
+{
+    extern std::atomic<bool> enabled;
+
+    int64_t now();
+    void record(const char* name, int64_t start, int64_t end);
+}
+
+/*!
+    requires:
+        - events_per_thread > 0
+
+    ensures:
+        - starts recording events. Every thread keeps its last
+          events_per_thread events.
+*/
+void start_tracing(size_t events_per_thread = 1 << 18);
+
+/*!
+    ensures:
+        - stops recording events. Recorded events are kept.
+*/
+void stop_tracing();
+
+inline bool is_tracing() { return trace_impl::enabled.load(std::memory_order_relaxed); }
+
+/*!
+    ensures:
+        - names the calling thread in the trace.
+*/
+void set_trace_thread_name(const std::string& name);
+
+/*!
+    ensures:
+        - writes all recorded events to filename as trace event JSON.
+
+    throws:
+        - std::runtime_error if the file cannot be written.
+*/
+void write_trace(const std::string& filename);
+
+// ---------------------------------------------------------------------------
+
+/*!
+    Records the time from its construction to its destruction as an event of
+    the calling thread.
+
+    requires:
+        - name outlives the trace, e.g. is a string literal.
+*/
+class trace_scope {
+public:
+    explicit trace_scope(const char* name_)
+        : name(is_tracing() ? name_ : nullptr), start(name ? trace_impl::now() : 0) { }
+
+    ~trace_scope()
+    {
+        if (name)
+            trace_impl::record(name, start, trace_impl::now());
+    }
+
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+private:
+    const char* name;
+    int64_t start;
+};
+
+#endif // IDLA__TRACE_H_
@@ -0,0 +1,123 @@
+#include "checkpoint.h"
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+#include <sys/stat.h>
+
+namespace
+{
+    // Writes data to filename through a temporary file, so that filename
+    // either keeps its old contents or gets all of the new ones.
+    bool replace_file(const std::string& filename, const std::vector<char>& data)
+    {
+        const std::string tmp_file = filename+".tmp";
+        {
+            std::ofstream fout(tmp_file, std::ios::binary);
+            fout.write(data.data(), data.size());
+            fout.flush();
+            if (!fout) {
+                fout.close();
+                std::remove(tmp_file.c_str());
+                return false;
+            }
+        }
+
+        if (std::rename(tmp_file.c_str(), filename.c_str()) != 0) {
+            // Windows does not replace existing files on rename.
+            std::remove(filename.c_str());
+            if (std::rename(tmp_file.c_str(), filename.c_str()) != 0) {
+                std::remove(tmp_file.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+checkpoint_writer::checkpoint_writer()
+    : thread([this]() { run(); })
+{
+}
+
+checkpoint_writer::~checkpoint_writer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void checkpoint_writer::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    wait_until_idle(lock);
+}
+
+void checkpoint_writer::schedule(snapshot& next)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    wait_until_idle(lock);
+
+    // The writer is done with front, so it becomes the next back buffer.
+    std::swap(front, next);
+    busy = true;
+    lock.unlock();
+    cv.notify_all();
+}
+
+void checkpoint_writer::wait_until_idle(std::unique_lock<std::mutex>& lock)
+{
+    cv.wait(lock, [this]() { return !busy; });
+    if (!error.empty()) {
+        const std::string message = error;
+        error.clear();
+        throw std::runtime_error(message);
+    }
+}
+
+void checkpoint_writer::run()
+{
+    set_trace_thread_name("checkpoint writer");
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        cv.wait(lock, [this]() { return busy || stopping; });
+        if (!busy)
+            return;
+
+        // front is not touched by other threads while busy is set.
+        lock.unlock();
+        bool ok;
+        {
+            trace_scope scope("checkpoint write");
+            ok = replace_file(front.filename, front.data);
+        }
+        lock.lock();
+
+        if (!ok)
+            error = "Unable to write checkpoint " + front.filename + ".";
+        busy = false;
+        cv.notify_all();
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+std::string latest_checkpoint(const std::string& filename)
+{
+    const std::string alternate = filename+"_";
+    struct stat st, alternate_st;
+    const bool found = stat(filename.c_str(), &st) == 0;
+    const bool alternate_found = stat(alternate.c_str(), &alternate_st) == 0;
+
+    if (alternate_found && (!found || alternate_st.st_mtime > st.st_mtime))
+        return alternate;
+    return found ? filename : std::string();
+}
@@ -0,0 +1,118 @@
+#include "cmc.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <dlib/assert.h>
+
+void add_expected_ranks(
+    const float* scores,
+    const std::vector<size_t>& offsets,
+    size_t match,
+    std::vector<double>& rank_counts
+)
+{
+    const size_t num_ids = offsets.size()-1;
+    DLIB_CASSERT(offsets.size() >= 2 && match < num_ids && rank_counts.size() == num_ids, "");
+
+    // Sort the scores of every identity, so that the number of images of an
+    // identity scoring above a given score can be found with a sweep.
+    const size_t base = offsets.front();
+    std::vector<float> sorted(scores+base, scores+offsets.back());
+    for (size_t j = 0; j < num_ids; ++j) {
+        DLIB_CASSERT(offsets[j] < offsets[j+1], "");
+        std::sort(sorted.begin()+(offsets[j]-base), sorted.begin()+(offsets[j+1]-base));
+    }
+
+    // lower[j] and upper[j] point past the images of identity j that score
+    // below, and not above, the current image of the match.
+    std::vector<size_t> lower(num_ids);
+    for (size_t j = 0; j < num_ids; ++j)
+        lower[j] = offsets[j]-base;
+    std::vector<size_t> upper(lower);
+    const size_t match_begin = offsets[match]-base;
+    const size_t num_match_imgs = offsets[match+1]-offsets[match];
+
+    // The identities other than the match are ranked ahead of it
+    // independently of each other, so for a given image of the match the
+    // rank follows a Poisson binomial distribution. It is built up one
+    // identity at a time in dist.
+    std::vector<double> dist(num_ids);
+    for (size_t m = 0; m < num_match_imgs; ++m) {
+        const float s = sorted[match_begin+m];
+        dist.assign(num_ids, 0);
+        dist[0] = 1;
+        size_t max_rank = 0;
+
+        for (size_t j = 0; j < num_ids; ++j) {
+            if (j == match)
+                continue;
+            const size_t end = offsets[j+1]-base;
+            while (lower[j] < end && sorted[lower[j]] < s)
+                ++lower[j];
+            while (upper[j] < end && sorted[upper[j]] <= s)
+                ++upper[j];
+
+            const double num_above = end - upper[j];
+            const double num_equal = upper[j] - lower[j];
+            const double p = (num_above + 0.5*num_equal)/(offsets[j+1]-offsets[j]);
+            if (p == 0)
+                continue;
+
+            ++max_rank;
+            for (size_t r = max_rank; r > 0; --r)
+                dist[r] = dist[r]*(1-p) + dist[r-1]*p;
+            dist[0] *= 1-p;
+        }
+
+        for (size_t r = 0; r <= max_rank; ++r)
+            rank_counts[r] += dist[r]/num_match_imgs;
+    }
+}
+
+void add_sampled_ranks(
+    const float* scores,
+    const std::vector<size_t>& offsets,
+    size_t match,
+    int num_trials,
+    dlib::rand& rng,
+    std::vector<double>& rank_counts
+)
+{
+    const size_t num_ids = offsets.size()-1;
+    DLIB_CASSERT(offsets.size() >= 2 && match < num_ids && rank_counts.size() == num_ids, "");
+    DLIB_CASSERT(num_trials > 0, "");
+
+    std::vector<std::vector<std::pair<float,size_t>>> trials(num_trials);
+    for (auto& trial : trials) {
+        trial.reserve(num_ids);
+    }
+
+    for (size_t j = 0; j < num_ids; ++j) {
+        const size_t num_gallery_imgs = offsets[j+1]-offsets[j];
+
+        // Randomly choose one pairwise score to represent the current
+        // gallery ID
+        for (auto& trial : trials) {
+            size_t tmp = rng.get_random_32bit_number() % num_gallery_imgs;
+            trial.emplace_back(scores[offsets[j]+tmp], j);
+        }
+    }
+
+    for (auto& trial : trials) {
+        // Sort score and ID pairs and scan for the matching ID
+        std::sort(trial.begin(), trial.end(),
+                  [](const std::pair<float,size_t>& i, const std::pair<float,size_t>& j) -> bool
+                  {
+                      return i.first > j.first;
+                  });
+
+        // Find the first occurrence of the same ID person
+        for (size_t r = 0; r < trial.size(); ++r) {
+            if (trial[r].second == match) {
+                rank_counts[r] += 1.0/num_trials;
+                break;
+            }
+        }
+    }
+}
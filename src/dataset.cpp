@@ -1,43 +1,585 @@
 #include "dataset.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+#include <sys/stat.h>
+#if !defined _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include <dlib/rand.h>
 #include <dlib/matrix.h>
 #include <dlib/image_transforms.h>
+#include <dlib/threads.h>
 
 #include <H5Cpp.h>
 
 namespace
 {
     dlib::rand rng;
+
+    /*
+        An image as stored in the CUHK03 file, i.e. channel planes of
+        column-major pixels, together with its dimensions (channels, columns,
+        rows).
+    */
+    struct raw_image {
+        std::vector<unsigned char> data;
+        hsize_t dims[3];
+    };
+
+    /*
+        The images of one person. Their references are gathered first, which
+        fixes where each image goes in the arena, and they are then read and
+        decoded.
+    */
+    struct person_images {
+        std::vector<hobj_ref_t> refs;
+        std::vector<size_t> view_offsets;
+        std::vector<raw_image> raw;
+    };
+
+    void decode_image(const raw_image& raw, dlib::matrix<dlib::rgb_pixel>& img)
+    {
+        const long img_nc = raw.dims[1];
+        const long img_nr = raw.dims[2];
+        const long img_size = img_nr*img_nc;
+        const unsigned char* red = &raw.data[0];
+        const unsigned char* green = red + img_size;
+        const unsigned char* blue = green + img_size;
+
+        dlib::matrix<dlib::rgb_pixel> img_copy(img_nr, img_nc);
+        for (long c = 0; c < img_nc; ++c) {
+            for (long r = 0; r < img_nr; ++r) {
+                const long k = c*img_nr + r;
+                img_copy(r, c).red = red[k];
+                img_copy(r, c).green = green[k];
+                img_copy(r, c).blue = blue[k];
+            }
+        }
+
+        // Resize to final image
+        dlib::resize_image(img_copy, img);
+    }
+
+    void decode_person(person_images& person, image_arena& arena)
+    {
+        const size_t image_size = arena.nr()*arena.nc()*sizeof(dlib::rgb_pixel);
+        dlib::matrix<dlib::rgb_pixel> img(arena.nr(), arena.nc());
+        for (size_t k = 0; k < person.raw.size(); ++k) {
+            decode_image(person.raw[k], img);
+            std::memcpy(arena.image_data(person.view_offsets.front()+k), &img(0, 0), image_size);
+        }
+        person.raw.clear();
+        person.raw.shrink_to_fit();
+    }
+
+    void read_raw_image(const H5::H5File& file_, hobj_ref_t ref, raw_image& raw)
+    {
+        H5::DataSet img_dset(file_, &ref);
+        img_dset.getSpace().getSimpleExtentDims(raw.dims, NULL);
+        raw.data.resize(raw.dims[0]*raw.dims[1]*raw.dims[2]);
+        img_dset.read(&raw.data[0], H5::PredType::NATIVE_UINT8);
+    }
+
+    /*
+        Goes through each object reference of the dataset and gathers the
+        references of the images of each person, numbering the images
+        consecutively. Also returns the number of persons under each object
+        reference, for mapping test indices.
+    */
+    std::vector<person_images> gather_person_images(
+        const H5::H5File& file_,
+        cuhk03_dataset_type type,
+        std::vector<hsize_t>& ref_sizes,
+        size_t& num_images
+    )
+    {
+        hobj_ref_t ref_objs[5] = {0};
+        if (type == LABELED)
+            file_.openDataSet("labeled").read(ref_objs, H5::PredType::STD_REF_OBJ);
+        else
+            file_.openDataSet("detected").read(ref_objs, H5::PredType::STD_REF_OBJ);
+
+        std::vector<person_images> persons;
+        ref_sizes.assign(5, 0);
+        num_images = 0;
+        for (unsigned int i = 0; i < 5; ++i) {
+            H5::DataSet img_ref_dset(file_, &ref_objs[i]);
+            H5::DataSpace img_ref_space = img_ref_dset.getSpace();
+
+            hsize_t dims[2] = {0};
+            img_ref_space.getSimpleExtentDims(dims, NULL);
+            ref_sizes[i] = dims[1];
+
+            // Each object reference refers to a matrix of image object
+            // references. The first five rows hold the images of the first
+            // view.
+            dlib::matrix<hobj_ref_t> img_ref_objs(dims[0], dims[1]);
+            img_ref_objs = 0;
+            img_ref_dset.read(img_ref_objs.begin(), H5::PredType::STD_REF_OBJ);
+
+            for (long c = 0; c < img_ref_objs.nc(); ++c) {
+                persons.emplace_back();
+                person_images& person = persons.back();
+                person.view_offsets.push_back(num_images);
+                for (long r = 0; r < img_ref_objs.nr(); ++r) {
+                    if (r == 5)
+                        person.view_offsets.push_back(num_images);
+
+                    H5::DataSet img_dset(file_, &img_ref_objs(r, c));
+                    if (img_dset.getSpace().getSimpleExtentNdims() != 3)
+                        continue;
+
+                    person.refs.push_back(img_ref_objs(r, c));
+                    ++num_images;
+                }
+                if (img_ref_objs.nr() <= 5)
+                    person.view_offsets.push_back(num_images);
+                person.view_offsets.push_back(num_images);
+            }
+        }
+        return persons;
+    }
+
+    std::vector<std::vector<int>> read_test_protocols(
+        const H5::H5File& file_,
+        const std::vector<hsize_t>& ref_sizes
+    )
+    {
+        std::vector<std::vector<int>> test_protocols;
+        hobj_ref_t test_ref_objs[20] = {0};
+        file_.openDataSet("testsets").read(test_ref_objs, H5::PredType::STD_REF_OBJ);
+        for (unsigned int i = 0; i < 20; ++i) {
+            H5::DataSet test_ref_dset(file_, &test_ref_objs[i]);
+            double h5_indices[2][100] = {0.0};
+            test_ref_dset.read(h5_indices, H5::PredType::NATIVE_DOUBLE);
+
+            std::vector<int> test_indices(100, 0);
+            for (unsigned int j = 0; j < 100; ++j) {
+                int ref_idx = static_cast<int>(h5_indices[0][j])-1; // object reference index
+
+                // Apply offsets to use correct indices.
+                test_indices[j] = static_cast<int>(h5_indices[1][j])-1;
+                for (int k = 0; k < ref_idx; ++k) {
+                    test_indices[j] += ref_sizes[k];
+                }
+            }
+            test_protocols.push_back(std::move(test_indices));
+        }
+        return test_protocols;
+    }
+
+// ---------------------------------------------------------------------------
+
+    /*
+        Read-only view of a whole file. The file is memory-mapped where the
+        platform allows it, so that concurrent processes share its pages, and
+        read into memory otherwise. data() is null if the file could not be
+        opened.
+    */
+    class mapped_file : dlib::noncopyable {
+    public:
+        explicit mapped_file(const std::string& filename)
+        {
+#if defined _WIN32
+            std::ifstream fin(filename, std::ios::binary);
+            if (fin) {
+                buffer.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+                ptr = reinterpret_cast<const unsigned char*>(buffer.data());
+                length = buffer.size();
+            }
+#else
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+                return;
+
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if (addr != MAP_FAILED) {
+                    ptr = static_cast<const unsigned char*>(addr);
+                    length = st.st_size;
+                }
+            }
+            close(fd);
+#endif
+        }
+
+        ~mapped_file()
+        {
+#if !defined _WIN32
+            if (ptr)
+                munmap(const_cast<unsigned char*>(ptr), length);
+#endif
+        }
+
+        const unsigned char* data() const { return ptr; }
+        size_t size() const { return length; }
+    private:
+        const unsigned char* ptr = nullptr;
+        size_t length = 0;
+#if defined _WIN32
+        std::vector<char> buffer;
+#endif
+    };
+
+    /*
+        Layout of a dataset cache file:
+            - cache_header
+            - uint32_t image counts, num_views per person
+            - int32_t test protocol indices, protocol_size per protocol
+            - zero padding up to pixel_offset
+            - rgb_pixel data of every image, nr*nc pixels each, in the order of
+              the counts above
+    */
+    struct cache_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t type;
+        uint32_t num_views;
+        int64_t nr;
+        int64_t nc;
+        uint64_t source_size;
+        int64_t source_mtime;
+        uint64_t num_persons;
+        uint64_t num_images;
+        uint64_t num_protocols;
+        uint64_t protocol_size;
+        uint64_t pixel_offset;
+    };
+
+    const char cache_magic[8] = {'I', 'D', 'L', 'A', 'C', 'U', 'H', 'K'};
+    const uint32_t cache_version = 1;
+    const uint32_t cache_byte_order = 0x01020304;
+    const uint64_t cache_alignment = 64;
+
+    static_assert(sizeof(dlib::rgb_pixel) == 3, "rgb_pixel is expected to be tightly packed.");
+
+    // Fills in the fields of a cache header that identify the dataset, i.e.
+    // everything but its sizes.
+    cache_header make_cache_header(
+        const std::string& source_file,
+        cuhk03_dataset_type type,
+        long nr,
+        long nc
+    )
+    {
+        cache_header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+        header.version = cache_version;
+        header.byte_order = cache_byte_order;
+        header.type = type;
+        header.nr = nr;
+        header.nc = nc;
+
+        struct stat st;
+        if (stat(source_file.c_str(), &st) == 0) {
+            header.source_size = st.st_size;
+            header.source_mtime = st.st_mtime;
+        }
+        return header;
+    }
+
+    // Sets product to a*b*c and returns true if it does not exceed limit,
+    // without overflowing on the way.
+    bool bounded_product(uint64_t a, uint64_t b, uint64_t c, uint64_t limit, uint64_t& product)
+    {
+        product = 1;
+        for (uint64_t factor : {a, b, c}) {
+            if (factor != 0 && product > limit/factor)
+                return false;
+            product *= factor;
+        }
+        return true;
+    }
 }
 
 // ---------------------------------------------------------------------------
 
-person_set::person_set(std::vector<std::vector<dlib::matrix<dlib::rgb_pixel>>>& images_)
+bool read_dataset_cache(
+    const std::string& cache_file,
+    const std::string& source_file,
+    std::vector<person_set>& images,
+    std::vector<std::vector<int>>& test_protocols,
+    cuhk03_dataset_type type,
+    long nr,
+    long nc
+)
 {
-    images.swap(images_);
+    auto file = std::make_shared<mapped_file>(cache_file);
+    if (!file->data() || file->size() < sizeof(cache_header))
+        return false;
+
+    cache_header header;
+    std::memcpy(&header, file->data(), sizeof(header));
+
+    const cache_header expected = make_cache_header(source_file, type, nr, nc);
+    if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+        header.version != expected.version ||
+        header.byte_order != expected.byte_order ||
+        header.type != expected.type ||
+        header.nr != expected.nr ||
+        header.nc != expected.nc ||
+        header.source_size != expected.source_size ||
+        header.source_mtime != expected.source_mtime) {
+        return false;
+    }
+
+    // Validate the sizes before touching anything past the header. None of
+    // them may exceed the file size, which also keeps their products and
+    // sums from overflowing on a corrupt header.
+    const uint64_t file_size = file->size();
+    uint64_t image_size, counts_size, protocols_size, pixels_size;
+    if (!bounded_product(nr, nc, sizeof(dlib::rgb_pixel), file_size, image_size) ||
+        !bounded_product(header.num_persons, header.num_views, sizeof(uint32_t), file_size, counts_size) ||
+        !bounded_product(header.num_protocols, header.protocol_size, sizeof(int32_t), file_size, protocols_size) ||
+        !bounded_product(header.num_images, image_size, 1, file_size, pixels_size) ||
+        header.pixel_offset > file_size ||
+        header.pixel_offset < sizeof(cache_header)+counts_size+protocols_size ||
+        file_size-header.pixel_offset < pixels_size) {
+        return false;
+    }
+
+    const uint32_t* counts = reinterpret_cast<const uint32_t*>(file->data()+sizeof(cache_header));
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < header.num_persons*header.num_views; ++i)
+        total += counts[i];
+    if (total != header.num_images)
+        return false;
+
+    const uint32_t* indices_begin = counts + header.num_persons*header.num_views;
+    auto arena = std::make_shared<const image_arena>(
+        file, reinterpret_cast<const dlib::rgb_pixel*>(file->data()+header.pixel_offset),
+        nr, nc, header.num_images);
+
+    std::vector<person_set> cached_images;
+    cached_images.reserve(header.num_persons);
+    size_t offset = 0;
+    for (uint64_t i = 0; i < header.num_persons; ++i) {
+        std::vector<size_t> view_offsets(1, offset);
+        for (uint32_t v = 0; v < header.num_views; ++v) {
+            offset += *counts++;
+            view_offsets.push_back(offset);
+        }
+        cached_images.emplace_back(arena, std::move(view_offsets));
+    }
+
+    const int32_t* indices = reinterpret_cast<const int32_t*>(indices_begin);
+    std::vector<std::vector<int>> cached_protocols(header.num_protocols);
+    for (std::vector<int>& protocol : cached_protocols) {
+        protocol.assign(indices, indices+header.protocol_size);
+        indices += header.protocol_size;
+    }
+
+    std::move(cached_images.begin(), cached_images.end(), std::back_inserter(images));
+    std::move(cached_protocols.begin(), cached_protocols.end(), std::back_inserter(test_protocols));
+    return true;
 }
 
-person_set::person_set(person_set&& other)
+void write_dataset_cache(
+    const std::string& cache_file,
+    const std::string& source_file,
+    const image_arena& arena,
+    const std::vector<uint32_t>& counts,
+    uint32_t num_views,
+    const std::vector<std::vector<int>>& test_protocols,
+    cuhk03_dataset_type type
+)
+{
+    cache_header header = make_cache_header(source_file, type, arena.nr(), arena.nc());
+    header.num_views = num_views;
+    header.num_persons = num_views ? counts.size()/num_views : 0;
+    header.num_images = arena.size();
+    header.num_protocols = test_protocols.size();
+    header.protocol_size = test_protocols.empty() ? 0 : test_protocols.front().size();
+
+    std::vector<int32_t> indices;
+    for (const std::vector<int>& protocol : test_protocols) {
+        DLIB_CASSERT(protocol.size() == header.protocol_size, "");
+        indices.insert(indices.end(), protocol.begin(), protocol.end());
+    }
+
+    const uint64_t data_end = sizeof(cache_header)+counts.size()*sizeof(uint32_t)+indices.size()*sizeof(int32_t);
+    header.pixel_offset = (data_end+cache_alignment-1)/cache_alignment*cache_alignment;
+
+    // Write to a temporary file first, so that concurrent readers never
+    // map a partially written cache.
+    const std::string tmp_file = cache_file+".tmp";
+    {
+        std::ofstream fout(tmp_file, std::ios::binary);
+        fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        fout.write(reinterpret_cast<const char*>(counts.data()), counts.size()*sizeof(uint32_t));
+        fout.write(reinterpret_cast<const char*>(indices.data()), indices.size()*sizeof(int32_t));
+        const std::vector<char> padding(header.pixel_offset-data_end, 0);
+        fout.write(padding.data(), padding.size());
+
+        fout.write(reinterpret_cast<const char*>(arena.data()), arena.size()*arena.nr()*arena.nc()*sizeof(dlib::rgb_pixel));
+
+        if (!fout) {
+            fout.close();
+            std::remove(tmp_file.c_str());
+            throw std::runtime_error("Unable to write dataset cache " + cache_file + ".");
+        }
+    }
+
+    if (std::rename(tmp_file.c_str(), cache_file.c_str()) != 0) {
+        // Windows does not replace existing files on rename.
+        std::remove(cache_file.c_str());
+        if (std::rename(tmp_file.c_str(), cache_file.c_str()) != 0) {
+            std::remove(tmp_file.c_str());
+            throw std::runtime_error("Unable to write dataset cache " + cache_file + ".");
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+image_arena::image_arena(long nr, long nc, size_t num_images)
+    : owned(true), num_rows(nr), num_cols(nc)
 {
-    images.swap(other.images);
+    DLIB_CASSERT(nr >= 0 && nc >= 0, "");
+
+    const size_t bytes = num_images*nr*nc*sizeof(dlib::rgb_pixel);
+    std::shared_ptr<unsigned char> buffer(new unsigned char[bytes+alignment](),
+                                          std::default_delete<unsigned char[]>());
+    const size_t misalignment = reinterpret_cast<uintptr_t>(buffer.get()) % alignment;
+    pixels = reinterpret_cast<const dlib::rgb_pixel*>(buffer.get() + (alignment-misalignment)%alignment);
+    storage = buffer;
+
+    views.reserve(num_images);
+    for (size_t i = 0; i < num_images; ++i)
+        views.emplace_back(pixels + i*nr*nc, nr, nc);
 }
 
-unsigned long person_set::get_num_views() const
+image_arena::image_arena(
+    std::shared_ptr<const void> backing,
+    const dlib::rgb_pixel* pixels_,
+    long nr,
+    long nc,
+    size_t num_images
+) : storage(std::move(backing)), pixels(pixels_), owned(false), num_rows(nr), num_cols(nc)
+{
+    DLIB_CASSERT(nr >= 0 && nc >= 0, "");
+
+    views.reserve(num_images);
+    for (size_t i = 0; i < num_images; ++i)
+        views.emplace_back(pixels + i*nr*nc, nr, nc);
+}
+
+dlib::rgb_pixel* image_arena::image_data(size_t i)
+{
+    DLIB_CASSERT(owned && i < size(), "");
+    return const_cast<dlib::rgb_pixel*>(pixels + i*num_rows*num_cols);
+}
+
+// ---------------------------------------------------------------------------
+
+lazy_image_cache::lazy_image_cache(
+    std::shared_ptr<H5::H5File> file_,
+    std::vector<uint64_t> image_refs,
+    long nr,
+    long nc,
+    size_t capacity_bytes
+) : file(std::move(file_)), refs(std::move(image_refs)), num_rows(nr), num_cols(nc)
+{
+    static_assert(sizeof(hobj_ref_t) == sizeof(uint64_t), "Unexpected HDF5 object reference size.");
+    DLIB_CASSERT(file && nr > 0 && nc > 0, "");
+
+    views.reserve(refs.size());
+    for (size_t i = 0; i < refs.size(); ++i)
+        views.emplace_back(this, i, nr, nc);
+    stats.capacity_bytes = capacity_bytes;
+}
+
+std::shared_ptr<const dlib::rgb_pixel> lazy_image_cache::load(size_t index) const
+{
+    DLIB_CASSERT(index < size(), "");
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = entries.find(index);
+        if (it != entries.end()) {
+            ++stats.hits;
+            lru.splice(lru.begin(), lru, it->second.position);
+            return it->second.pixels;
+        }
+        ++stats.misses;
+    }
+
+    // Read and decode without holding the cache lock, so that hits are served
+    // while images are decoded.
+    raw_image raw;
+    {
+        std::lock_guard<std::mutex> lock(file_mutex);
+        read_raw_image(*file, refs[index], raw);
+    }
+    auto img = std::make_shared<dlib::matrix<dlib::rgb_pixel>>(num_rows, num_cols);
+    decode_image(raw, *img);
+    std::shared_ptr<const dlib::rgb_pixel> pixels(img, &(*img)(0, 0));
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = entries.find(index);
+    if (it != entries.end()) {
+        // Another thread loaded the same image in the meantime.
+        lru.splice(lru.begin(), lru, it->second.position);
+        return it->second.pixels;
+    }
+
+    lru.push_front(index);
+    entries[index] = entry{pixels, lru.begin()};
+    stats.cached_bytes += num_rows*num_cols*sizeof(dlib::rgb_pixel);
+    while (stats.cached_bytes > stats.capacity_bytes && !lru.empty()) {
+        entries.erase(lru.back());
+        lru.pop_back();
+        stats.cached_bytes -= num_rows*num_cols*sizeof(dlib::rgb_pixel);
+        ++stats.evictions;
+    }
+    return pixels;
+}
+
+lazy_image_cache::statistics lazy_image_cache::get_statistics() const
 {
-    return images.size();
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    statistics result = stats;
+    result.num_cached = entries.size();
+    return result;
 }
 
-std::vector<dlib::matrix<dlib::rgb_pixel>>& person_set::view(unsigned int view_index)
+// ---------------------------------------------------------------------------
+
+person_set::person_set(std::shared_ptr<const image_store> store_, std::vector<size_t> view_offsets_)
+    : store(std::move(store_)), view_offsets(std::move(view_offsets_))
+{
+    DLIB_CASSERT(store && !view_offsets.empty() && view_offsets.back() <= store->size(), "");
+    DLIB_CASSERT(std::is_sorted(view_offsets.begin(), view_offsets.end()), "");
+}
+
+person_set::person_set(person_set&& other)
+{
+    store.swap(other.store);
+    view_offsets.swap(other.view_offsets);
+}
+
+unsigned long person_set::get_num_views() const
 {
-    DLIB_CASSERT(view_index < images.size(), "");
-    return images[view_index];
+    return view_offsets.size()-1;
 }
 
-const std::vector<dlib::matrix<dlib::rgb_pixel>>& person_set::view(unsigned int view_index) const
+person_set::view_type person_set::view(unsigned int view_index) const
 {
-    DLIB_CASSERT(view_index < images.size(), "");
-    return images[view_index];
+    DLIB_CASSERT(view_index < get_num_views(), "");
+    const image_type* first = view_offsets[view_index] < store->size() ? &store->image(view_offsets[view_index]) : nullptr;
+    return view_type(first, first + (view_offsets[view_index+1]-view_offsets[view_index]));
 }
 
 // ---------------------------------------------------------------------------
@@ -48,102 +590,91 @@ void load_cuhk03_dataset(
     std::vector<std::vector<int>>& test_protocols,
     cuhk03_dataset_type type,
     long nr,
-    long nc
+    long nc,
+    const std::string& cache_file
 )
 {
+    if (!cache_file.empty() &&
+        read_dataset_cache(cache_file, cuhk03_file, images, test_protocols, type, nr, nc)) {
+        return;
+    }
+
     if (!H5::H5File::isHdf5(cuhk03_file.c_str())) {
         throw std::runtime_error(cuhk03_file + " is not an HDF5 file.");
     }
 
     H5::H5File file_(cuhk03_file.c_str(), H5F_ACC_RDONLY);
-    hobj_ref_t ref_objs[5] = {0};
-    if (type == LABELED)
-        file_.openDataSet("labeled").read(ref_objs, H5::PredType::STD_REF_OBJ);
-    else
-        file_.openDataSet("detected").read(ref_objs, H5::PredType::STD_REF_OBJ);
-
-    // Go through each object reference and retrieve image data from them.
-    std::vector<hsize_t> ref_sizes(5, 0); // store for mapping test indices
-    for (unsigned int i = 0; i < 5; ++i) {
-        H5::DataSet img_ref_dset(file_, &ref_objs[i]);
-        H5::DataSpace img_ref_space = img_ref_dset.getSpace();
-
-        hsize_t dims[2] = {0};
-        img_ref_space.getSimpleExtentDims(dims, NULL);
-        ref_sizes[i] = dims[1];
-
-        // Each object reference refers to a matrix of image object references.
-        // Pull these references and load the underlying images from them.
-        dlib::matrix<hobj_ref_t> img_ref_objs(dims[0], dims[1]);
-        img_ref_objs = 0;
-        img_ref_dset.read(img_ref_objs.begin(), H5::PredType::STD_REF_OBJ);
-
-        for (long c = 0; c < img_ref_objs.nc(); ++c) {
-            std::vector<dlib::matrix<dlib::rgb_pixel>> vimgs0, vimgs1;
-            vimgs0.reserve(img_ref_objs.nr());
-            vimgs1.reserve(img_ref_objs.nr());
-
-            for (long r = 0; r < img_ref_objs.nr(); ++r) {                
-                // Get the image dataset
-                H5::DataSet img_dset(file_, &img_ref_objs(r, c));
-                H5::DataSpace img_space = img_dset.getSpace();
-                std::vector<hsize_t> img_dims(img_space.getSimpleExtentNdims());
-                if (img_dims.size() != 3)
-                    continue;
-                img_space.getSimpleExtentDims(&img_dims[0], NULL);
-
-                // Transfer image from HDF5 to memory
-                std::vector<unsigned char> img_array(img_dims[0]*img_dims[1]*img_dims[2], 0);
-                img_dset.read(&img_array[0], H5::PredType::NATIVE_UINT8);
-
-                dlib::matrix<dlib::rgb_pixel> img_copy(img_dims[2], img_dims[1]);
-                unsigned int img_size = img_dims[1]*img_dims[2];
-                for (unsigned int k = 0; k < img_size; ++k) {
-                    unsigned int r_ = k % img_dims[2];
-                    unsigned int c_ = k/img_dims[2] % img_dims[1];
-
-                    img_copy(r_, c_).red = img_array[k];
-                    img_copy(r_, c_).green = img_array[k+img_size];
-                    img_copy(r_, c_).blue = img_array[k+2*img_size];
-                }
+    std::vector<hsize_t> ref_sizes;
+    size_t num_images = 0;
+    std::vector<person_images> persons = gather_person_images(file_, type, ref_sizes, num_images);
 
-                // Resize to final image
-                if (r < 5) {
-                    vimgs0.emplace_back(nr, nc);
-                    dlib::matrix<dlib::rgb_pixel>& img = vimgs0.back();
-                    dlib::resize_image(img_copy, img);
-                }
-                else {
-                    vimgs1.emplace_back(nr, nc);
-                    dlib::matrix<dlib::rgb_pixel>& img = vimgs1.back();
-                    dlib::resize_image(img_copy, img);
-                }
-            }
-            std::vector<std::vector<dlib::matrix<dlib::rgb_pixel>>> pimgs;
-            pimgs.push_back(std::move(vimgs0));
-            pimgs.push_back(std::move(vimgs1));
-            images.emplace_back(pimgs);
+    // HDF5 is not thread safe, so the raw images are read here one person at
+    // a time, while a thread pool decodes and resizes the persons that have
+    // already been read into the arena.
+    auto arena = std::make_shared<image_arena>(nr, nc, num_images);
+    {
+        dlib::thread_pool pool(std::max(1u, std::thread::hardware_concurrency()));
+        for (person_images& person : persons) {
+            // Transfer images from HDF5 to memory
+            person.raw.resize(person.refs.size());
+            for (size_t k = 0; k < person.refs.size(); ++k)
+                read_raw_image(file_, person.refs[k], person.raw[k]);
+
+            image_arena& dest = *arena;
+            pool.add_task_by_value([&person, &dest]() { decode_person(person, dest); });
         }
+        pool.wait_for_all_tasks();
     }
 
-    // Load test protocols
-    hobj_ref_t test_ref_objs[20] = {0};
-    file_.openDataSet("testsets").read(test_ref_objs, H5::PredType::STD_REF_OBJ);
-    for (unsigned int i = 0; i < 20; ++i) {
-        H5::DataSet test_ref_dset(file_, &test_ref_objs[i]);
-        double h5_indices[2][100] = {0.0};
-        test_ref_dset.read(h5_indices, H5::PredType::NATIVE_DOUBLE);
+    std::vector<person_set> loaded_images;
+    std::vector<uint32_t> counts;
+    loaded_images.reserve(persons.size());
+    for (person_images& person : persons) {
+        for (size_t v = 0; v+1 < person.view_offsets.size(); ++v)
+            counts.push_back(person.view_offsets[v+1]-person.view_offsets[v]);
+        loaded_images.emplace_back(arena, std::move(person.view_offsets));
+    }
 
-        std::vector<int> test_indices(100, 0);
-        for (unsigned int j = 0; j < 100; ++j) {
-            int ref_idx = static_cast<int>(h5_indices[0][j])-1; // object reference index
+    std::vector<std::vector<int>> loaded_protocols = read_test_protocols(file_, ref_sizes);
 
-            // Apply offsets to use correct indices.
-            test_indices[j] = static_cast<int>(h5_indices[1][j])-1;
-            for (unsigned int k = 0; k < ref_idx; ++k) {
-                test_indices[j] += ref_sizes[k];
-            }
-        }
-        test_protocols.push_back(std::move(test_indices));
+    if (!cache_file.empty())
+        write_dataset_cache(cache_file, cuhk03_file, *arena, counts, 2, loaded_protocols, type);
+
+    std::move(loaded_images.begin(), loaded_images.end(), std::back_inserter(images));
+    std::move(loaded_protocols.begin(), loaded_protocols.end(), std::back_inserter(test_protocols));
+}
+
+// ---------------------------------------------------------------------------
+
+std::shared_ptr<const lazy_image_cache> load_cuhk03_dataset_lazy(
+    const std::string& cuhk03_file,
+    std::vector<person_set>& images,
+    std::vector<std::vector<int>>& test_protocols,
+    size_t cache_bytes,
+    cuhk03_dataset_type type,
+    long nr,
+    long nc
+)
+{
+    if (!H5::H5File::isHdf5(cuhk03_file.c_str())) {
+        throw std::runtime_error(cuhk03_file + " is not an HDF5 file.");
     }
+
+    auto file_ = std::make_shared<H5::H5File>(cuhk03_file.c_str(), H5F_ACC_RDONLY);
+    std::vector<hsize_t> ref_sizes;
+    size_t num_images = 0;
+    std::vector<person_images> persons = gather_person_images(*file_, type, ref_sizes, num_images);
+
+    std::vector<uint64_t> image_refs;
+    image_refs.reserve(num_images);
+    for (const person_images& person : persons)
+        image_refs.insert(image_refs.end(), person.refs.begin(), person.refs.end());
+
+    std::vector<std::vector<int>> loaded_protocols = read_test_protocols(*file_, ref_sizes);
+
+    auto cache = std::make_shared<lazy_image_cache>(file_, std::move(image_refs), nr, nc, cache_bytes);
+    for (person_images& person : persons)
+        images.emplace_back(cache, std::move(person.view_offsets));
+    std::move(loaded_protocols.begin(), loaded_protocols.end(), std::back_inserter(test_protocols));
+    return cache;
 }
@@ -1,122 +1,913 @@
 #include "difference_impl_cpu.h"
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <dlib/threads.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+  #define IDLA_X86_SIMD
+  #include <immintrin.h>
+#endif
+
 namespace
 {
-    float* get_element_pointer(dlib::tensor& T, long n, long k, long r, long c)
+    /*
+        Returns the compile time neighborhood dimension N if one is given, and
+        the runtime value otherwise. Kernels instantiated with N > 0 therefore
+        see a constant, which lets the compiler fully unroll their
+        neighborhood loops and turn index math into constant multiplies.
+    */
+    template <long N>
+    inline long nbhd_dim(long runtime_value)
     {
-        return T.host() + ((n*T.k()+k)*T.nr()+r)*T.nc() + c;
+        return N > 0 ? N : runtime_value;
     }
 
-    const float* get_element_pointer(const dlib::tensor& T, long n, long k, long r, long c)
+    // -----------------------------------------------------------------------
+    //  Row primitives
+    //
+    //  Primitives that loop over a neighborhood row are templated on the
+    //  number of neighborhood columns NC (0 if only known at runtime).
+    //
+    //  difference_rows:  out[c*nbhd_nc + j] = center[c] - nbhd[c + j]
+    //                    for c in [0, count) and j in [0, nbhd_nc). If relu
+    //                    is set, negative differences are written as 0.
+    //  accumulate_row:   acc[i] += src[i] for i in [0, len)
+    //  accumulate_masked_rows:
+    //                    acc[c*nbhd_nc + j] += grad[c*nbhd_nc + j] for c in
+    //                    [0, count) and j in [0, nbhd_nc), but only where
+    //                    center[c] - nbhd[c + j] > 0.
+    //  dot_product:      returns the sum of a[i]*b[i] for i in [0, len)
+    // -----------------------------------------------------------------------
+
+    template <long NC>
+    void difference_rows_scalar(float* out, const float* center, const float* nbhd, long count, long nbhd_nc, bool relu)
     {
-        return T.host() + ((n*T.k()+k)*T.nr()+r)*T.nc() + c;
+        nbhd_nc = nbhd_dim<NC>(nbhd_nc);
+        for (long c = 0; c < count; ++c) {
+            for (long j = 0; j < nbhd_nc; ++j) {
+                float diff = center[c] - nbhd[c+j];
+                out[j] = (relu && diff < 0.0f) ? 0.0f : diff;
+            }
+            out += nbhd_nc;
+        }
     }
-}
 
+    void accumulate_row_scalar(float* acc, const float* src, long len)
+    {
+        for (long i = 0; i < len; ++i) {
+            acc[i] += src[i];
+        }
+    }
 
-void perform_cross_neighborhood_differencing(
-    const dlib::tensor& input_tensor,
-    dlib::resizable_tensor& output_tensor,
-    const dlib::vector<long,2>& neighborhood_size
-)
-{
-    long nbhd_nc = neighborhood_size.x();
-    long nbhd_nr = neighborhood_size.y();
+    template <long NC>
+    void accumulate_masked_rows_scalar(float* acc, const float* grad, const float* center, const float* nbhd, long count, long nbhd_nc)
+    {
+        nbhd_nc = nbhd_dim<NC>(nbhd_nc);
+        for (long c = 0; c < count; ++c) {
+            for (long j = 0; j < nbhd_nc; ++j) {
+                if (center[c] - nbhd[c+j] > 0.0f)
+                    acc[j] += grad[j];
+            }
+            acc += nbhd_nc;
+            grad += nbhd_nc;
+        }
+    }
+
+    float dot_product_scalar(const float* a, const float* b, long len)
+    {
+        float sum = 0.0f;
+        for (long i = 0; i < len; ++i) {
+            sum += a[i]*b[i];
+        }
+        return sum;
+    }
 
-    // Iterate through each dimension of the tensor
-    for (long n = 0; n < input_tensor.num_samples(); ++n) {
-        // Flag that determines the sample offset for the "neighborhood image"
-        long flag = (n % 2 == 0) ? 1 : -1;
+#ifdef IDLA_X86_SIMD
+    /*
+        Hand-tuned operand builders for common neighborhood widths. For four
+        consecutive columns c..c+3, load() fills cv and nv with NC vectors
+        such that, element by element, cv[v] - nv[v] are the differences
+        center[c + p/NC] - nbhd[c + p/NC + p%NC] for p in [4*v, 4*v+4), i.e. the
+        4*NC contiguous outputs of those columns. Only two or three unaligned
+        loads of the neighborhood row are needed, instead of one per column.
+    */
+    template <long NC>
+    struct nbhd_operands {
+        static const bool available = false;
+        static void load(const float*, const float*, __m128*, __m128*) { }
+    };
 
-        for (long k = 0; k < input_tensor.k(); ++k) {
-            for (long r = 0; r < input_tensor.nr(); ++r) {
-                for (long c = 0; c < input_tensor.nc(); ++c) {
-                    // Get central comparison pixel
-                    float comparison_pixel = *get_element_pointer(input_tensor, n, k, r, c);
+    template <>
+    struct nbhd_operands<3> {
+        static const bool available = true;
 
-                    // Iterate through the neighborhood
-                    for (long nbhd_r = 0; nbhd_r < nbhd_nr; ++nbhd_r) {
-                        // Get output pointer without the column offset
-                        float* output_ptr_no_c = get_element_pointer(output_tensor, n, k, r*nbhd_nr + nbhd_r, 0);
+        __attribute__((target("sse2")))
+        static void load(const float* center, const float* nbhd, __m128* cv, __m128* nv)
+        {
+            const __m128 a = _mm_loadu_ps(center);  // a0 a1 a2 a3
+            const __m128 b0 = _mm_loadu_ps(nbhd);   // b0 b1 b2 b3
+            const __m128 b2 = _mm_loadu_ps(nbhd+2); // b2 b3 b4 b5
+            cv[0] = _mm_shuffle_ps(a, a, _MM_SHUFFLE(1,0,0,0));    // a0 a0 a0 a1
+            cv[1] = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2,2,1,1));    // a1 a1 a2 a2
+            cv[2] = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3,3,3,2));    // a2 a3 a3 a3
+            nv[0] = _mm_shuffle_ps(b0, b0, _MM_SHUFFLE(1,2,1,0));  // b0 b1 b2 b1
+            nv[1] = _mm_shuffle_ps(b0, b0, _MM_SHUFFLE(3,2,3,2));  // b2 b3 b2 b3
+            nv[2] = _mm_shuffle_ps(b2, b2, _MM_SHUFFLE(3,2,1,2));  // b4 b3 b4 b5
+        }
+    };
 
-                        long img_r = r - nbhd_nr/2 + nbhd_r;  // image row position
-                        for (long nbhd_c = 0; nbhd_c < nbhd_nc; ++nbhd_c) {
-                            float* output_ptr = output_ptr_no_c + c*nbhd_nc + nbhd_c;
+    template <>
+    struct nbhd_operands<5> {
+        static const bool available = true;
 
-                            // If the current row is out of bounds...
-                            if (img_r < 0 || img_r >= input_tensor.nr()) {
-                                *output_ptr = 0.0;
-                                continue;
-                            }
+        __attribute__((target("sse2")))
+        static void load(const float* center, const float* nbhd, __m128* cv, __m128* nv)
+        {
+            const __m128 a = _mm_loadu_ps(center);  // a0 a1 a2 a3
+            const __m128 b0 = _mm_loadu_ps(nbhd);   // b0 b1 b2 b3
+            const __m128 b4 = _mm_loadu_ps(nbhd+4); // b4 b5 b6 b7
+            cv[0] = _mm_shuffle_ps(a, a, _MM_SHUFFLE(0,0,0,0));    // a0 a0 a0 a0
+            cv[1] = _mm_shuffle_ps(a, a, _MM_SHUFFLE(1,1,1,0));    // a0 a1 a1 a1
+            cv[2] = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2,2,1,1));    // a1 a1 a2 a2
+            cv[3] = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3,2,2,2));    // a2 a2 a2 a3
+            cv[4] = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3,3,3,3));    // a3 a3 a3 a3
+            nv[0] = b0;                                            // b0 b1 b2 b3
+            nv[1] = _mm_move_ss(b0, b4);                           // b4 b1 b2 b3
+            nv[2] = _mm_shuffle_ps(b4, b0, _MM_SHUFFLE(3,2,1,0));  // b4 b5 b2 b3
+            const __m128 t = _mm_shuffle_ps(b4, b0, _MM_SHUFFLE(3,3,2,2)); // b6 b6 b3 b3
+            nv[3] = _mm_shuffle_ps(b4, t, _MM_SHUFFLE(2,0,1,0));   // b4 b5 b6 b3
+            nv[4] = b4;                                            // b4 b5 b6 b7
+        }
+    };
 
-                            // If the current column is out of bounds...
-                            long img_c = c - nbhd_nc/2 + nbhd_c; // image column position
-                            if (img_c < 0 || img_c >= input_tensor.nc()) {
-                                *output_ptr = 0.0;
-                                continue;
-                            }
+    template <long NC>
+    __attribute__((target("sse2")))
+    void difference_rows_sse(float* out, const float* center, const float* nbhd, long count, long nbhd_nc, bool relu)
+    {
+        nbhd_nc = nbhd_dim<NC>(nbhd_nc);
+        const __m128 zero = _mm_setzero_ps();
+        long c = 0;
+        if (nbhd_operands<NC>::available) {
+            for (; c+4 <= count; c += 4) {
+                __m128 cv[NC > 0 ? NC : 1], nv[NC > 0 ? NC : 1];
+                nbhd_operands<NC>::load(center+c, nbhd+c, cv, nv);
+                for (long v = 0; v < nbhd_nc; ++v) {
+                    __m128 diff = _mm_sub_ps(cv[v], nv[v]);
+                    _mm_storeu_ps(out+4*v, relu ? _mm_max_ps(diff, zero) : diff);
+                }
+                out += 4*nbhd_nc;
+            }
+        }
+        for (; c < count; ++c) {
+            const float* b = nbhd + c;
+            __m128 a = _mm_set1_ps(center[c]);
+            long j = 0;
+            for (; j+4 <= nbhd_nc; j += 4) {
+                __m128 diff = _mm_sub_ps(a, _mm_loadu_ps(b+j));
+                _mm_storeu_ps(out+j, relu ? _mm_max_ps(diff, zero) : diff);
+            }
+            for (; j < nbhd_nc; ++j) {
+                float diff = center[c] - b[j];
+                out[j] = (relu && diff < 0.0f) ? 0.0f : diff;
+            }
+            out += nbhd_nc;
+        }
+    }
+
+    __attribute__((target("sse2")))
+    void accumulate_row_sse(float* acc, const float* src, long len)
+    {
+        long i = 0;
+        for (; i+4 <= len; i += 4) {
+            _mm_storeu_ps(acc+i, _mm_add_ps(_mm_loadu_ps(acc+i), _mm_loadu_ps(src+i)));
+        }
+        for (; i < len; ++i) {
+            acc[i] += src[i];
+        }
+    }
+
+    template <long NC>
+    __attribute__((target("sse2")))
+    void accumulate_masked_rows_sse(float* acc, const float* grad, const float* center, const float* nbhd, long count, long nbhd_nc)
+    {
+        nbhd_nc = nbhd_dim<NC>(nbhd_nc);
+        long c = 0;
+        if (nbhd_operands<NC>::available) {
+            for (; c+4 <= count; c += 4) {
+                __m128 cv[NC > 0 ? NC : 1], nv[NC > 0 ? NC : 1];
+                nbhd_operands<NC>::load(center+c, nbhd+c, cv, nv);
+                for (long v = 0; v < nbhd_nc; ++v) {
+                    __m128 g = _mm_and_ps(_mm_cmpgt_ps(cv[v], nv[v]), _mm_loadu_ps(grad+4*v));
+                    _mm_storeu_ps(acc+4*v, _mm_add_ps(_mm_loadu_ps(acc+4*v), g));
+                }
+                acc += 4*nbhd_nc;
+                grad += 4*nbhd_nc;
+            }
+        }
+        for (; c < count; ++c) {
+            const float* b = nbhd + c;
+            __m128 a = _mm_set1_ps(center[c]);
+            long j = 0;
+            for (; j+4 <= nbhd_nc; j += 4) {
+                __m128 mask = _mm_cmpgt_ps(a, _mm_loadu_ps(b+j));
+                __m128 g = _mm_and_ps(mask, _mm_loadu_ps(grad+j));
+                _mm_storeu_ps(acc+j, _mm_add_ps(_mm_loadu_ps(acc+j), g));
+            }
+            for (; j < nbhd_nc; ++j) {
+                if (center[c] - b[j] > 0.0f)
+                    acc[j] += grad[j];
+            }
+            acc += nbhd_nc;
+            grad += nbhd_nc;
+        }
+    }
+
+    __attribute__((target("sse2")))
+    float dot_product_sse(const float* a, const float* b, long len)
+    {
+        __m128 acc = _mm_setzero_ps();
+        long i = 0;
+        for (; i+4 <= len; i += 4) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+        }
+        float partial[4];
+        _mm_storeu_ps(partial, acc);
+        float sum = (partial[0]+partial[1]) + (partial[2]+partial[3]);
+        for (; i < len; ++i) {
+            sum += a[i]*b[i];
+        }
+        return sum;
+    }
+
+    template <long NC>
+    __attribute__((target("avx")))
+    void difference_rows_avx(float* out, const float* center, const float* nbhd, long count, long nbhd_nc, bool relu)
+    {
+        nbhd_nc = nbhd_dim<NC>(nbhd_nc);
+        const __m256 zero8 = _mm256_setzero_ps();
+        const __m128 zero4 = _mm_setzero_ps();
+        long c = 0;
+        if (nbhd_operands<NC>::available) {
+            for (; c+4 <= count; c += 4) {
+                __m128 cv[NC > 0 ? NC : 1], nv[NC > 0 ? NC : 1];
+                nbhd_operands<NC>::load(center+c, nbhd+c, cv, nv);
+                for (long v = 0; v < nbhd_nc; ++v) {
+                    __m128 diff = _mm_sub_ps(cv[v], nv[v]);
+                    _mm_storeu_ps(out+4*v, relu ? _mm_max_ps(diff, zero4) : diff);
+                }
+                out += 4*nbhd_nc;
+            }
+        }
+        for (; c < count; ++c) {
+            const float* b = nbhd + c;
+            long j = 0;
+            __m256 a8 = _mm256_set1_ps(center[c]);
+            for (; j+8 <= nbhd_nc; j += 8) {
+                __m256 diff = _mm256_sub_ps(a8, _mm256_loadu_ps(b+j));
+                _mm256_storeu_ps(out+j, relu ? _mm256_max_ps(diff, zero8) : diff);
+            }
+            __m128 a4 = _mm_set1_ps(center[c]);
+            for (; j+4 <= nbhd_nc; j += 4) {
+                __m128 diff = _mm_sub_ps(a4, _mm_loadu_ps(b+j));
+                _mm_storeu_ps(out+j, relu ? _mm_max_ps(diff, zero4) : diff);
+            }
+            for (; j < nbhd_nc; ++j) {
+                float diff = center[c] - b[j];
+                out[j] = (relu && diff < 0.0f) ? 0.0f : diff;
+            }
+            out += nbhd_nc;
+        }
+    }
+
+    __attribute__((target("avx")))
+    void accumulate_row_avx(float* acc, const float* src, long len)
+    {
+        long i = 0;
+        for (; i+8 <= len; i += 8) {
+            _mm256_storeu_ps(acc+i, _mm256_add_ps(_mm256_loadu_ps(acc+i), _mm256_loadu_ps(src+i)));
+        }
+        for (; i < len; ++i) {
+            acc[i] += src[i];
+        }
+    }
+
+    template <long NC>
+    __attribute__((target("avx")))
+    void accumulate_masked_rows_avx(float* acc, const float* grad, const float* center, const float* nbhd, long count, long nbhd_nc)
+    {
+        nbhd_nc = nbhd_dim<NC>(nbhd_nc);
+        long c = 0;
+        if (nbhd_operands<NC>::available) {
+            for (; c+4 <= count; c += 4) {
+                __m128 cv[NC > 0 ? NC : 1], nv[NC > 0 ? NC : 1];
+                nbhd_operands<NC>::load(center+c, nbhd+c, cv, nv);
+                for (long v = 0; v < nbhd_nc; ++v) {
+                    __m128 g = _mm_and_ps(_mm_cmpgt_ps(cv[v], nv[v]), _mm_loadu_ps(grad+4*v));
+                    _mm_storeu_ps(acc+4*v, _mm_add_ps(_mm_loadu_ps(acc+4*v), g));
+                }
+                acc += 4*nbhd_nc;
+                grad += 4*nbhd_nc;
+            }
+        }
+        for (; c < count; ++c) {
+            const float* b = nbhd + c;
+            long j = 0;
+            __m256 a8 = _mm256_set1_ps(center[c]);
+            for (; j+8 <= nbhd_nc; j += 8) {
+                __m256 mask = _mm256_cmp_ps(a8, _mm256_loadu_ps(b+j), _CMP_GT_OQ);
+                __m256 g = _mm256_and_ps(mask, _mm256_loadu_ps(grad+j));
+                _mm256_storeu_ps(acc+j, _mm256_add_ps(_mm256_loadu_ps(acc+j), g));
+            }
+            __m128 a4 = _mm_set1_ps(center[c]);
+            for (; j+4 <= nbhd_nc; j += 4) {
+                __m128 mask = _mm_cmpgt_ps(a4, _mm_loadu_ps(b+j));
+                __m128 g = _mm_and_ps(mask, _mm_loadu_ps(grad+j));
+                _mm_storeu_ps(acc+j, _mm_add_ps(_mm_loadu_ps(acc+j), g));
+            }
+            for (; j < nbhd_nc; ++j) {
+                if (center[c] - b[j] > 0.0f)
+                    acc[j] += grad[j];
+            }
+            acc += nbhd_nc;
+            grad += nbhd_nc;
+        }
+    }
+
+    __attribute__((target("avx")))
+    float dot_product_avx(const float* a, const float* b, long len)
+    {
+        __m256 acc = _mm256_setzero_ps();
+        long i = 0;
+        for (; i+8 <= len; i += 8) {
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+        }
+        __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        float partial[4];
+        _mm_storeu_ps(partial, acc4);
+        float sum = (partial[0]+partial[1]) + (partial[2]+partial[3]);
+        for (; i < len; ++i) {
+            sum += a[i]*b[i];
+        }
+        return sum;
+    }
+#endif // IDLA_X86_SIMD
 
-                            // Perform differencing
-                            *output_ptr = comparison_pixel - *get_element_pointer(input_tensor, n+flag, k, img_r, img_c);
+    // -----------------------------------------------------------------------
+
+    /*
+        Performs differencing for the columns [c_from, c_to) of a row whose
+        neighborhoods may extend past the edges of the "neighborhood image".
+    */
+    template <long NC>
+    void difference_border_columns(
+        float* out,
+        const float* center,
+        const float* nbhd,
+        long c_from,
+        long c_to,
+        long in_nc,
+        long nbhd_nc,
+        bool relu
+    )
+    {
+        nbhd_nc = nbhd_dim<NC>(nbhd_nc);
+        for (long c = c_from; c < c_to; ++c) {
+            for (long nbhd_c = 0; nbhd_c < nbhd_nc; ++nbhd_c) {
+                long img_c = c - nbhd_nc/2 + nbhd_c; // image column position
+                float diff = (img_c < 0 || img_c >= in_nc) ? 0.0f : center[c] - nbhd[img_c];
+                out[c*nbhd_nc + nbhd_c] = (relu && diff < 0.0f) ? 0.0f : diff;
+            }
+        }
+    }
+
+    /*
+        Accumulates the gradient for the columns [c_from, c_to) of a row, but
+        only where the difference was positive. Neighborhood positions outside
+        of the "neighborhood image" never produce an activation.
+    */
+    template <long NC>
+    void accumulate_masked_border_columns(
+        float* acc,
+        const float* grad,
+        const float* center,
+        const float* nbhd,
+        long c_from,
+        long c_to,
+        long in_nc,
+        long nbhd_nc
+    )
+    {
+        nbhd_nc = nbhd_dim<NC>(nbhd_nc);
+        for (long c = c_from; c < c_to; ++c) {
+            for (long nbhd_c = 0; nbhd_c < nbhd_nc; ++nbhd_c) {
+                long img_c = c - nbhd_nc/2 + nbhd_c; // image column position
+                if (img_c >= 0 && img_c < in_nc && center[c] - nbhd[img_c] > 0.0f)
+                    acc[c*nbhd_nc + nbhd_c] += grad[c*nbhd_nc + nbhd_c];
+            }
+        }
+    }
+
+    template <long NC>
+    struct row_kernels {
+        void (*difference_rows)(float*, const float*, const float*, long, long, bool);
+        void (*accumulate_row)(float*, const float*, long);
+        void (*accumulate_masked_rows)(float*, const float*, const float*, const float*, long, long);
+        float (*dot_product)(const float*, const float*, long);
+    };
+
+    cpu_simd_level detect_simd_level()
+    {
+#ifdef IDLA_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx"))
+            return cpu_simd_level::AVX;
+        if (__builtin_cpu_supports("sse2"))
+            return cpu_simd_level::SSE;
+#endif
+        return cpu_simd_level::SCALAR;
+    }
+
+    cpu_simd_level& active_simd_level()
+    {
+        static cpu_simd_level level = detect_simd_level();
+        return level;
+    }
+
+    // -----------------------------------------------------------------------
+
+    // Differencing layers of several network replicas may run concurrently,
+    // so the pool is (re)created under a lock.
+    dlib::thread_pool& differencing_thread_pool(unsigned long num_threads)
+    {
+        static std::mutex pool_mutex;
+        static std::unique_ptr<dlib::thread_pool> pool;
+
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if (!pool || pool->num_threads_in_pool() != num_threads)
+            pool.reset(new dlib::thread_pool(num_threads));
+        return *pool;
+    }
+
+    unsigned long& differencing_num_threads()
+    {
+        static unsigned long num_threads = std::max(1u, std::thread::hardware_concurrency());
+        return num_threads;
+    }
+
+    /*
+        Calls funct(begin, end) over contiguous blocks of [0, num_slices). With
+        more than one thread, blocks are executed concurrently on the
+        differencing thread pool. Every slice is always computed the same way,
+        so results do not depend on the number of threads.
+    */
+    template <typename T>
+    void run_over_slices(long num_slices, const T& funct)
+    {
+        const unsigned long num_threads = differencing_num_threads();
+        if (num_threads <= 1 || num_slices <= 1) {
+            funct(0, num_slices);
+            return;
+        }
+
+        dlib::parallel_for_blocked(differencing_thread_pool(num_threads), 0, num_slices, funct);
+    }
+
+    template <long NC>
+    row_kernels<NC> get_row_kernels()
+    {
+        row_kernels<NC> kernels;
+        switch (active_simd_level()) {
+#ifdef IDLA_X86_SIMD
+        case cpu_simd_level::AVX:
+            kernels.difference_rows = difference_rows_avx<NC>;
+            kernels.accumulate_row = accumulate_row_avx;
+            kernels.accumulate_masked_rows = accumulate_masked_rows_avx<NC>;
+            kernels.dot_product = dot_product_avx;
+            break;
+        case cpu_simd_level::SSE:
+            kernels.difference_rows = difference_rows_sse<NC>;
+            kernels.accumulate_row = accumulate_row_sse;
+            kernels.accumulate_masked_rows = accumulate_masked_rows_sse<NC>;
+            kernels.dot_product = dot_product_sse;
+            break;
+#endif
+        default:
+            kernels.difference_rows = difference_rows_scalar<NC>;
+            kernels.accumulate_row = accumulate_row_scalar;
+            kernels.accumulate_masked_rows = accumulate_masked_rows_scalar<NC>;
+            kernels.dot_product = dot_product_scalar;
+        }
+        return kernels;
+    }
+
+    // -----------------------------------------------------------------------
+
+    /*
+        Returns the input sample holding paired sample n. Pairs are normally
+        adjacent samples of the input. In broadcast mode, the input holds a
+        probe followed by N gallery samples and the pairs are (probe, gallery
+        1), (gallery 1, probe), (probe, gallery 2) and so on, so paired sample
+        n is the probe if n is even and gallery sample n/2 otherwise.
+    */
+    inline long input_sample(long n, bool broadcast)
+    {
+        if (!broadcast)
+            return n;
+        return (n % 2 == 0) ? 0 : 1 + n/2;
+    }
+
+    template <long NR, long NC>
+    void differencing_forward(
+        const dlib::tensor& input_tensor,
+        dlib::resizable_tensor& output_tensor,
+        const dlib::vector<long,2>& neighborhood_size,
+        bool relu,
+        bool broadcast
+    )
+    {
+        const row_kernels<NC> kernels = get_row_kernels<NC>();
+
+        const long in_nk = input_tensor.k();
+        const long nbhd_nc = nbhd_dim<NC>(neighborhood_size.x());
+        const long nbhd_nr = nbhd_dim<NR>(neighborhood_size.y());
+        const long in_nr = input_tensor.nr();
+        const long in_nc = input_tensor.nc();
+        const long half_nr = nbhd_nr/2;
+        const long half_nc = nbhd_nc/2;
+
+        const long in_slice = in_nr*in_nc;
+        const long out_row = in_nc*nbhd_nc;
+        const long out_slice = in_slice*nbhd_nr*nbhd_nc;
+
+        // Columns in [c_begin, c_end) have their entire neighborhood inside
+        // the "neighborhood image" and need no bounds checks.
+        const long c_begin = std::min(half_nc, in_nc);
+        const long c_end = std::max(c_begin, in_nc-half_nc);
+
+        const float* in = input_tensor.host();
+        float* out = output_tensor.host();
+
+        // Each (sample, channel) slice of the output is independent of the others
+        run_over_slices(output_tensor.num_samples()*in_nk, [&](long begin, long end) {
+            for (long slice = begin; slice < end; ++slice) {
+                const long n = slice/in_nk;
+                const long k = slice%in_nk;
+
+                // Flag that determines the sample offset for the "neighborhood image"
+                long flag = (n % 2 == 0) ? 1 : -1;
+
+                const float* center_slice = in + (input_sample(n, broadcast)*in_nk+k)*in_slice;
+                const float* nbhd_slice = in + (input_sample(n+flag, broadcast)*in_nk+k)*in_slice;
+                float* out_slice_ptr = out + slice*out_slice;
+
+                for (long r = 0; r < in_nr; ++r) {
+                    const float* center = center_slice + r*in_nc;
+
+                    for (long nbhd_r = 0; nbhd_r < nbhd_nr; ++nbhd_r) {
+                        float* output_ptr = out_slice_ptr + (r*nbhd_nr + nbhd_r)*out_row;
+
+                        // Rows outside of the "neighborhood image" produce no
+                        // activation.
+                        long img_r = r - half_nr + nbhd_r;
+                        if (img_r < 0 || img_r >= in_nr) {
+                            std::fill(output_ptr, output_ptr+out_row, 0.0f);
+                            continue;
                         }
+                        const float* nbhd = nbhd_slice + img_r*in_nc;
+
+                        // Border columns
+                        difference_border_columns<NC>(output_ptr, center, nbhd, 0, c_begin, in_nc, nbhd_nc, relu);
+                        difference_border_columns<NC>(output_ptr, center, nbhd, c_end, in_nc, in_nc, nbhd_nc, relu);
+
+                        // Interior columns
+                        kernels.difference_rows(output_ptr + c_begin*nbhd_nc,
+                                                center + c_begin,
+                                                nbhd + c_begin - half_nc,
+                                                c_end - c_begin,
+                                                nbhd_nc,
+                                                relu);
                     }
                 }
             }
-        }
+        });
     }
-}
 
-void backpropagate_differencing_gradient(const dlib::tensor& gradient_input, dlib::tensor& gradient_output)
-{
-    long nbhd_nr = gradient_input.nr()/gradient_output.nr();
-    long nbhd_nc = gradient_input.nc()/gradient_output.nc();
-
-    // Iterate through each dimension of the tensor
-    for (long n = 0; n < gradient_output.num_samples(); ++n) {
-        // Flag that determines the sample offset for the "neighborhood image"
-        long flag = (n % 2 == 0) ? 1 : -1;
-
-        for (long k = 0; k < gradient_output.k(); ++k) {
-            for (long r = 0; r < gradient_output.nr(); ++r) {
-                for (long c = 0; c < gradient_output.nc(); ++c) {
-                    float* output_ptr = get_element_pointer(gradient_output, n, k, r, c);
-                    *output_ptr = 0.0;
-
-                    // Iterate through the neighborhood and accumulate gradients
-                    // for when the current pixel was the central comparison
-                    // pixel and a "neighborhood image" pixel
+    /*
+        Backpropagates the differencing gradient. If input_tensor is not null,
+        the forward pass is treated as having applied a ReLU, so only positions
+        with a positive difference propagate gradient.
+    */
+    template <long NR, long NC>
+    void differencing_backward(
+        const dlib::tensor* input_tensor,
+        const dlib::tensor& gradient_input,
+        dlib::tensor& gradient_output,
+        bool broadcast
+    )
+    {
+        const row_kernels<NC> kernels = get_row_kernels<NC>();
+
+        const long out_nk = gradient_output.k();
+        const long out_nr = gradient_output.nr();
+        const long out_nc = gradient_output.nc();
+        const long nbhd_nr = nbhd_dim<NR>(gradient_input.nr()/out_nr);
+        const long nbhd_nc = nbhd_dim<NC>(gradient_input.nc()/out_nc);
+        const long half_nr = nbhd_nr/2;
+        const long half_nc = nbhd_nc/2;
+
+        const long out_slice = out_nr*out_nc;
+        const long in_row = out_nc*nbhd_nc;
+        const long in_slice = out_slice*nbhd_nr*nbhd_nc;
+
+        const long c_begin = std::min(half_nc, out_nc);
+        const long c_end = std::max(c_begin, out_nc-half_nc);
+
+        const float* gin = gradient_input.host();
+        const float* in = input_tensor ? input_tensor->host() : nullptr;
+        float* gout = gradient_output.host();
+
+        // Adds one row of the incoming gradient to acc. With a ReLU, the
+        // row's differences are recomputed from its central comparison image
+        // row and "neighborhood image" row, and used to mask the gradient.
+        auto accumulate = [&](float* acc, const float* grad, long center_slice, long center_r, long nbhd_slice, long nbhd_r) {
+            if (!in) {
+                kernels.accumulate_row(acc, grad, in_row);
+                return;
+            }
+            auto input_slice = [&](long slice) {
+                return input_sample(slice/out_nk, broadcast)*out_nk + slice%out_nk;
+            };
+            const float* center = in + input_slice(center_slice)*out_slice + center_r*out_nc;
+            const float* nbhd = in + input_slice(nbhd_slice)*out_slice + nbhd_r*out_nc;
+            accumulate_masked_border_columns<NC>(acc, grad, center, nbhd, 0, c_begin, out_nc, nbhd_nc);
+            accumulate_masked_border_columns<NC>(acc, grad, center, nbhd, c_end, out_nc, out_nc, nbhd_nc);
+            kernels.accumulate_masked_rows(acc + c_begin*nbhd_nc,
+                                           grad + c_begin*nbhd_nc,
+                                           center + c_begin,
+                                           nbhd + c_begin - half_nc,
+                                           c_end - c_begin,
+                                           nbhd_nc);
+        };
+
+        // Each (sample, channel) slice of the gradient is independent of the others
+        run_over_slices(gradient_output.num_samples()*out_nk, [&](long begin, long end) {
+            // Row sums of the incoming gradient. `center_sum` accumulates the
+            // rows in which the current pixel was the central comparison pixel
+            // and `nbhd_sum` the rows in which it was part of the "neighborhood
+            // image".
+            std::vector<float> center_sum(in_row), nbhd_sum(in_row);
+
+            for (long slice = begin; slice < end; ++slice) {
+                const long n = slice/out_nk;
+                const long k = slice%out_nk;
+
+                // Flag that determines the sample offset for the "neighborhood image"
+                long flag = (n % 2 == 0) ? 1 : -1;
+                const long pair_slice = (n+flag)*out_nk+k;
+
+                const float* center_slice = gin + slice*in_slice;
+                const float* nbhd_slice = gin + pair_slice*in_slice;
+                float* out_slice_ptr = gout + slice*out_slice;
+
+                for (long r = 0; r < out_nr; ++r) {
+                    std::fill(center_sum.begin(), center_sum.end(), 0.0f);
+                    std::fill(nbhd_sum.begin(), nbhd_sum.end(), 0.0f);
+
                     for (long nbhd_r = 0; nbhd_r < nbhd_nr; ++nbhd_r) {
-                        const float* input_ptr1 = nullptr;
-                        long img_r1 = r + (nbhd_r-nbhd_nr/2);
-                        if (img_r1 >= 0 && img_r1 < gradient_output.nr()) {
-                            input_ptr1 = get_element_pointer(gradient_input, n, k, r*nbhd_nr + nbhd_r, 0);
+                        long img_r = r + nbhd_r - half_nr;
+                        if (img_r >= 0 && img_r < out_nr) {
+                            accumulate(&center_sum[0],
+                                       center_slice + (r*nbhd_nr + nbhd_r)*in_row,
+                                       slice, r, pair_slice, img_r);
                         }
 
-                        const float* input_ptr2 = nullptr;
-                        long scan_r = r + nbhd_nr/2 - nbhd_r; // neighborhood image row
-                        long img_r2 = scan_r + (nbhd_r-nbhd_nr/2);
-                        if (img_r2 >= 0 && img_r2 < gradient_output.nr()) {
-                            input_ptr2 = get_element_pointer(gradient_input, n+flag, k, scan_r*nbhd_nr + nbhd_r, 0);
+                        long scan_r = r + half_nr - nbhd_r; // neighborhood image row
+                        if (scan_r >= 0 && scan_r < out_nr) {
+                            accumulate(&nbhd_sum[0],
+                                       nbhd_slice + (scan_r*nbhd_nr + nbhd_r)*in_row,
+                                       pair_slice, scan_r, slice, r);
                         }
+                    }
 
+                    float* output_ptr = out_slice_ptr + r*out_nc;
+                    for (long c = 0; c < out_nc; ++c) {
+                        const bool interior = c >= c_begin && c < c_end;
+                        float grad = 0.0f;
                         for (long nbhd_c = 0; nbhd_c < nbhd_nc; ++nbhd_c) {
-                            if (input_ptr1 != nullptr) {
-                                long img_c1 = c + (nbhd_c-nbhd_nc/2);
-                                if (img_c1 >= 0 && img_c1 < gradient_output.nc()) {
-                                    *output_ptr += *(input_ptr1 + c*nbhd_nc + nbhd_c);
-                                }
+                            long img_c = c + nbhd_c - half_nc;
+                            if (interior || (img_c >= 0 && img_c < out_nc)) {
+                                grad += center_sum[c*nbhd_nc + nbhd_c];
+                            }
+
+                            long scan_c = c + half_nc - nbhd_c; // neighborhood image column
+                            if (interior || (scan_c >= 0 && scan_c < out_nc)) {
+                                grad -= nbhd_sum[scan_c*nbhd_nc + nbhd_c];
                             }
-                            if (input_ptr2 != nullptr) {
-                                long scan_c = c + nbhd_nc/2 - nbhd_c; // neighborhood image column
-                                long img_c2 = scan_c + (nbhd_c-nbhd_nc/2);
-                                if (img_c2 >= 0 && img_c2 < gradient_output.nc()) {
-                                    *output_ptr -= *(input_ptr2 + scan_c*nbhd_nc + nbhd_c);
+                        }
+                        output_ptr[c] = grad;
+                    }
+                } // r
+            } // slice
+        });
+    }
+
+    template <long NR, long NC>
+    void patch_summary_forward(
+        const dlib::tensor& input_tensor,
+        const dlib::tensor& params,
+        dlib::resizable_tensor& output_tensor,
+        long num_filters,
+        const dlib::vector<long,2>& neighborhood_size,
+        bool broadcast
+    )
+    {
+        const row_kernels<NC> kernels = get_row_kernels<NC>();
+
+        const long in_nk = input_tensor.k();
+        const long nbhd_nc = nbhd_dim<NC>(neighborhood_size.x());
+        const long nbhd_nr = nbhd_dim<NR>(neighborhood_size.y());
+        const long in_nr = input_tensor.nr();
+        const long in_nc = input_tensor.nc();
+        const long half_nr = nbhd_nr/2;
+        const long half_nc = nbhd_nc/2;
+
+        const long in_slice = in_nr*in_nc;
+        const long in_sample = in_nk*in_slice;
+        const long filter_size = in_nk*nbhd_nr*nbhd_nc;
+        DLIB_CASSERT(params.size() == (size_t)(num_filters*filter_size + num_filters), "");
+
+        const float* in = input_tensor.host();
+        const float* filters = params.host();
+        const float* biases = filters + num_filters*filter_size;
+        float* out = output_tensor.host();
+
+        // Each sample is independent of the others
+        run_over_slices(output_tensor.num_samples(), [&](long begin, long end) {
+            // Rectified differences of a single pixel's neighborhoods, laid out
+            // in the same (k, nbhd_r, nbhd_c) order as a filter.
+            std::vector<float> nbhd_diffs(filter_size);
+
+            for (long n = begin; n < end; ++n) {
+                // Flag that determines the sample offset for the "neighborhood image"
+                long flag = (n % 2 == 0) ? 1 : -1;
+
+                const float* center_sample = in + input_sample(n, broadcast)*in_sample;
+                const float* nbhd_sample = in + input_sample(n+flag, broadcast)*in_sample;
+                float* out_sample = out + n*num_filters*in_slice;
+
+                for (long r = 0; r < in_nr; ++r) {
+                    for (long c = 0; c < in_nc; ++c) {
+                        float* d = &nbhd_diffs[0];
+                        for (long k = 0; k < in_nk; ++k) {
+                            const float center = center_sample[k*in_slice + r*in_nc + c];
+                            for (long nbhd_r = 0; nbhd_r < nbhd_nr; ++nbhd_r) {
+                                long img_r = r - half_nr + nbhd_r;
+                                const float* nbhd = nbhd_sample + k*in_slice + img_r*in_nc;
+                                for (long nbhd_c = 0; nbhd_c < nbhd_nc; ++nbhd_c) {
+                                    long img_c = c - half_nc + nbhd_c;
+                                    float diff = 0.0f;
+                                    if (img_r >= 0 && img_r < in_nr && img_c >= 0 && img_c < in_nc)
+                                        diff = center - nbhd[img_c];
+                                    *d++ = (diff < 0.0f) ? 0.0f : diff;
                                 }
                             }
-                        } // nbhd_c
-                    } // nbhd_r
-                } // c
-            } // r
-        } // k
-    } // n
+                        }
+
+                        for (long f = 0; f < num_filters; ++f) {
+                            out_sample[f*in_slice + r*in_nc + c] =
+                                biases[f] + kernels.dot_product(filters + f*filter_size, &nbhd_diffs[0], filter_size);
+                        }
+                    }
+                }
+            }
+        });
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+cpu_simd_level get_differencing_simd_level()
+{
+    return active_simd_level();
+}
+
+void set_differencing_simd_level(cpu_simd_level level)
+{
+    active_simd_level() = std::min(level, detect_simd_level());
+}
+
+unsigned long get_differencing_num_threads()
+{
+    return differencing_num_threads();
+}
+
+void set_differencing_num_threads(unsigned long num_threads)
+{
+    DLIB_CASSERT(num_threads > 0, "");
+    differencing_num_threads() = num_threads;
+}
+
+// ---------------------------------------------------------------------------
+
+void perform_cross_neighborhood_differencing(
+    const dlib::tensor& input_tensor,
+    dlib::resizable_tensor& output_tensor,
+    const dlib::vector<long,2>& neighborhood_size,
+    bool broadcast
+)
+{
+    if (neighborhood_size.x() == 5 && neighborhood_size.y() == 5)
+        differencing_forward<5,5>(input_tensor, output_tensor, neighborhood_size, false, broadcast);
+    else if (neighborhood_size.x() == 3 && neighborhood_size.y() == 3)
+        differencing_forward<3,3>(input_tensor, output_tensor, neighborhood_size, false, broadcast);
+    else
+        differencing_forward<0,0>(input_tensor, output_tensor, neighborhood_size, false, broadcast);
+}
+
+void backpropagate_differencing_gradient(const dlib::tensor& gradient_input, dlib::tensor& gradient_output)
+{
+    const long nbhd_nr = gradient_input.nr()/gradient_output.nr();
+    const long nbhd_nc = gradient_input.nc()/gradient_output.nc();
+    if (nbhd_nr == 5 && nbhd_nc == 5)
+        differencing_backward<5,5>(nullptr, gradient_input, gradient_output, false);
+    else if (nbhd_nr == 3 && nbhd_nc == 3)
+        differencing_backward<3,3>(nullptr, gradient_input, gradient_output, false);
+    else
+        differencing_backward<0,0>(nullptr, gradient_input, gradient_output, false);
+}
+
+void reduce_broadcast_gradient(const dlib::tensor& pair_gradient, dlib::tensor& gradient_output)
+{
+    const long num_pairs = pair_gradient.num_samples()/2;
+    const long sample_size = gradient_output.k()*gradient_output.nr()*gradient_output.nc();
+    DLIB_CASSERT(pair_gradient.num_samples() == 2*num_pairs && gradient_output.num_samples() == num_pairs+1, "");
+    DLIB_CASSERT(pair_gradient.size() == (size_t)(2*num_pairs*sample_size), "");
+
+    const row_kernels<0> kernels = get_row_kernels<0>();
+    const float* pair_grad = pair_gradient.host();
+    float* gout = gradient_output.host();
+
+    // The probe is paired sample 2*p of every pair p, while gallery sample p
+    // only appears as paired sample 2*p+1.
+    std::fill(gout, gout+sample_size, 0.0f);
+    for (long p = 0; p < num_pairs; ++p) {
+        kernels.accumulate_row(gout, pair_grad + 2*p*sample_size, sample_size);
+        std::copy(pair_grad + (2*p+1)*sample_size,
+                  pair_grad + (2*p+2)*sample_size,
+                  gout + (p+1)*sample_size);
+    }
+}
+
+void perform_cross_neighborhood_differencing_relu(
+    const dlib::tensor& input_tensor,
+    dlib::resizable_tensor& output_tensor,
+    const dlib::vector<long,2>& neighborhood_size,
+    bool broadcast
+)
+{
+    if (neighborhood_size.x() == 5 && neighborhood_size.y() == 5)
+        differencing_forward<5,5>(input_tensor, output_tensor, neighborhood_size, true, broadcast);
+    else if (neighborhood_size.x() == 3 && neighborhood_size.y() == 3)
+        differencing_forward<3,3>(input_tensor, output_tensor, neighborhood_size, true, broadcast);
+    else
+        differencing_forward<0,0>(input_tensor, output_tensor, neighborhood_size, true, broadcast);
+}
+
+void backpropagate_differencing_relu_gradient(
+    const dlib::tensor& input_tensor,
+    const dlib::tensor& gradient_input,
+    dlib::tensor& gradient_output,
+    bool broadcast
+)
+{
+    const long nbhd_nr = gradient_input.nr()/gradient_output.nr();
+    const long nbhd_nc = gradient_input.nc()/gradient_output.nc();
+    if (nbhd_nr == 5 && nbhd_nc == 5)
+        differencing_backward<5,5>(&input_tensor, gradient_input, gradient_output, broadcast);
+    else if (nbhd_nr == 3 && nbhd_nc == 3)
+        differencing_backward<3,3>(&input_tensor, gradient_input, gradient_output, broadcast);
+    else
+        differencing_backward<0,0>(&input_tensor, gradient_input, gradient_output, broadcast);
+}
+
+void perform_cross_neighborhood_patch_summary(
+    const dlib::tensor& input_tensor,
+    const dlib::tensor& params,
+    dlib::resizable_tensor& output_tensor,
+    long num_filters,
+    const dlib::vector<long,2>& neighborhood_size,
+    bool broadcast
+)
+{
+    if (neighborhood_size.x() == 5 && neighborhood_size.y() == 5)
+        patch_summary_forward<5,5>(input_tensor, params, output_tensor, num_filters, neighborhood_size, broadcast);
+    else if (neighborhood_size.x() == 3 && neighborhood_size.y() == 3)
+        patch_summary_forward<3,3>(input_tensor, params, output_tensor, num_filters, neighborhood_size, broadcast);
+    else
+        patch_summary_forward<0,0>(input_tensor, params, output_tensor, num_filters, neighborhood_size, broadcast);
 }
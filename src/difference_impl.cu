@@ -2,6 +2,31 @@
 
 #include <dlib/dnn/cuda_utils.h>
 
+/*
+    The kernels below are templated on the neighborhood size. NBHD_NR and
+    NBHD_NC are either the compile time neighborhood dimensions or 0 if the
+    dimensions are only known at runtime. When they are known, the
+    neighborhood loops fully unroll and the index math reduces to constant
+    divisions and multiplies. The generic instantiation has runtime loop
+    bounds, so its unroll factor is 1.
+*/
+template <long N>
+__device__ inline long nbhd_dim(long runtime_value)
+{
+    return N > 0 ? N : runtime_value;
+}
+
+// Returns the input sample holding paired sample n. In broadcast mode, the
+// input holds a probe followed by N gallery samples, and paired sample n is
+// the probe if n is even and gallery sample n/2 otherwise.
+__device__ inline long input_sample(long n, bool broadcast)
+{
+    if (!broadcast)
+        return n;
+    return (n % 2 == 0) ? 0 : 1 + n/2;
+}
+
+template <long NBHD_NR, long NBHD_NC>
 __global__ void apply_differencing_impl(
     const float* input_tensor,
     float* output_tensor,
@@ -10,19 +35,26 @@ __global__ void apply_differencing_impl(
     long in_nc,
     long nbhd_nr,
     long nbhd_nc,
-    long n
+    long n,
+    bool relu,
+    bool broadcast
 )
 {
+    nbhd_nr = nbhd_dim<NBHD_NR>(nbhd_nr);
+    nbhd_nc = nbhd_dim<NBHD_NC>(nbhd_nc);
     for (auto i : dlib::cuda::grid_stride_range(0, n)) {
-        // Find neighborhood indices (center comparison pixel location)
-        long nbhd_c = i/nbhd_nc % in_nc;               // also center column
-        long nbhd_r = i/nbhd_nc/in_nc/nbhd_nr % in_nr; // also center row
-        long k = i/nbhd_nc/in_nc/nbhd_nr/in_nr % in_nk;
-        long sample = i/nbhd_nc/in_nc/nbhd_nr/in_nr/in_nk;
-
-        // Find in-neighborhood row and column indices
-        long in_nbhd_c = i % nbhd_nc;
-        long in_nbhd_r = i/nbhd_nc/in_nc % nbhd_nr;
+        // Peel off one index at a time, so that each division is by a single
+        // (possibly constant) dimension.
+        long q = i/nbhd_nc;
+        long in_nbhd_c = i - q*nbhd_nc;     // in-neighborhood column index
+        long nbhd_c = q % in_nc;            // also center column
+        q /= in_nc;
+        long in_nbhd_r = q % nbhd_nr;       // in-neighborhood row index
+        q /= nbhd_nr;
+        long nbhd_r = q % in_nr;            // also center row
+        q /= in_nr;
+        long k = q % in_nk;
+        long sample = q/in_nk;
 
         // Find the "neighborhood image" row and column indices
         long in_c = nbhd_c - nbhd_nc/2 + in_nbhd_c;
@@ -38,14 +70,17 @@ __global__ void apply_differencing_impl(
             output_tensor[i] = 0.0;
         }
         else {
-            long idx1 = ((sample*in_nk + k)*in_nr + nbhd_r)*in_nc + nbhd_c;
-            long idx2 = (((sample+flag)*in_nk + k)*in_nr + in_r)*in_nc + in_c;
-            output_tensor[i] = input_tensor[idx1]-input_tensor[idx2];
+            long idx1 = ((input_sample(sample, broadcast)*in_nk + k)*in_nr + nbhd_r)*in_nc + nbhd_c;
+            long idx2 = ((input_sample(sample+flag, broadcast)*in_nk + k)*in_nr + in_r)*in_nc + in_c;
+            float diff = input_tensor[idx1]-input_tensor[idx2];
+            output_tensor[i] = (relu && diff < 0) ? 0 : diff;
         }
     }
 }
 
+template <long NBHD_NR, long NBHD_NC>
 __global__ void get_differencing_gradient_impl(
+    const float* input_tensor,
     const float* gradient_input,
     float* gradient_output,
     long out_nk,
@@ -53,54 +88,220 @@ __global__ void get_differencing_gradient_impl(
     long out_nc,
     long nbhd_nr,
     long nbhd_nc,
-    long n
+    long n,
+    bool broadcast
 )
 {
-    for (auto i : dlib::cuda::grid_stride_range(0, n)) {
-        // Find the output indices
-        long out_c = i % out_nc;
-        long out_r = i/out_nc % out_nr;
-        long k = i/out_nc/out_nr % out_nk;
-        long sample = i/out_nc/out_nr/out_nk;
+    nbhd_nr = nbhd_dim<NBHD_NR>(nbhd_nr);
+    nbhd_nc = nbhd_dim<NBHD_NC>(nbhd_nc);
 
-        // Backpropagate gradients for when the current pixel was the center
-        // comparison pixel.
-        gradient_output[i] = 0;
-        for (long r = out_r*nbhd_nr; r < (out_r+1)*nbhd_nr; ++r) {
-            long offset = ((sample*out_nk + k)*out_nr*nbhd_nr + r)*out_nc*nbhd_nc;
-            for (long c = out_c*nbhd_nc; c < (out_c+1)*nbhd_nc; ++c) {
-                gradient_output[i] += gradient_input[offset + c];
-            }
-        }
+    // If `input_tensor` is not null, the forward pass applied a ReLU and only
+    // positive differences propagate gradient.
+    for (auto i : dlib::cuda::grid_stride_range(0, n)) {
+        // Find the output indices, one dimension at a time as above
+        long q = i/out_nc;
+        long out_c = i - q*out_nc;
+        long out_r = q % out_nr;
+        q /= out_nr;
+        long k = q % out_nk;
+        long sample = q/out_nk;
 
         long flag = (sample % 2 == 0) ? 1 : -1;
         long r_off = nbhd_nr/2;
         long c_off = nbhd_nc/2;
+        long slice_size = out_nr*out_nc;
+        long pair_offset = (input_sample(sample+flag, broadcast)*out_nk + k)*slice_size;
+        float pixel = input_tensor ? input_tensor[(input_sample(sample, broadcast)*out_nk + k)*slice_size + out_r*out_nc + out_c] : 0;
+
+        // Backpropagate gradients for when the current pixel was the center
+        // comparison pixel. Neighborhood positions outside of the
+        // "neighborhood image" are constant and receive no gradient.
+        float grad = 0;
+        #pragma unroll (NBHD_NR > 0 ? NBHD_NR : 1)
+        for (long in_nbhd_r = 0; in_nbhd_r < nbhd_nr; ++in_nbhd_r) {
+            long in_r = out_r - r_off + in_nbhd_r;
+            if (in_r < 0 || in_r >= out_nr)
+                continue;
+            long offset = ((sample*out_nk + k)*out_nr*nbhd_nr + out_r*nbhd_nr + in_nbhd_r)*out_nc*nbhd_nc;
+            #pragma unroll (NBHD_NC > 0 ? NBHD_NC : 1)
+            for (long in_nbhd_c = 0; in_nbhd_c < nbhd_nc; ++in_nbhd_c) {
+                long in_c = out_c - c_off + in_nbhd_c;
+                if (in_c < 0 || in_c >= out_nc)
+                    continue;
+                if (input_tensor && pixel - input_tensor[pair_offset + in_r*out_nc + in_c] <= 0)
+                    continue;
+                grad += gradient_input[offset + out_c*nbhd_nc + in_nbhd_c];
+            }
+        }
 
         // Backpropagate gradients for when the current pixel was part of the
         // "neighborhood image"
-        long out_nbhd_r = 0;  // in-neighborhood row index
-        for (long r = out_r+r_off; r >= out_r-r_off; --r) {
-            if (r < 0 || r >= out_nr) {
-                ++out_nbhd_r;
+        #pragma unroll (NBHD_NR > 0 ? NBHD_NR : 1)
+        for (long out_nbhd_r = 0; out_nbhd_r < nbhd_nr; ++out_nbhd_r) {
+            long r = out_r + r_off - out_nbhd_r;
+            if (r < 0 || r >= out_nr)
                 continue;
-            }
-            long out_nbhd_c = 0;  // in-neighborhood column index
             long offset = (((sample+flag)*out_nk + k)*out_nr*nbhd_nr + r*nbhd_nr + out_nbhd_r)*out_nc*nbhd_nc;
-            ++out_nbhd_r;
+            #pragma unroll (NBHD_NC > 0 ? NBHD_NC : 1)
+            for (long out_nbhd_c = 0; out_nbhd_c < nbhd_nc; ++out_nbhd_c) {
+                long c = out_c + c_off - out_nbhd_c;
+                if (c < 0 || c >= out_nc)
+                    continue;
+                if (!input_tensor || input_tensor[pair_offset + r*out_nc + c] - pixel > 0)
+                    grad -= gradient_input[offset + c*nbhd_nc + out_nbhd_c];
+            }
+        }
+        gradient_output[i] = grad;
+    }
+}
+
+template <long NBHD_NR, long NBHD_NC>
+__global__ void apply_patch_summary_impl(
+    const float* input_tensor,
+    const float* filters,
+    const float* biases,
+    float* output_tensor,
+    long num_filters,
+    long in_nk,
+    long in_nr,
+    long in_nc,
+    long nbhd_nr,
+    long nbhd_nc,
+    long n,
+    bool broadcast
+)
+{
+    nbhd_nr = nbhd_dim<NBHD_NR>(nbhd_nr);
+    nbhd_nc = nbhd_dim<NBHD_NC>(nbhd_nc);
+    for (auto i : dlib::cuda::grid_stride_range(0, n)) {
+        // Find the output indices, one dimension at a time as above
+        long q = i/in_nc;
+        long c = i - q*in_nc;
+        long r = q % in_nr;
+        q /= in_nr;
+        long f = q % num_filters;
+        long sample = q/num_filters;
 
-            for (long c = out_c+c_off; c >= out_c-c_off; --c) {
-                if (c < 0 || c >= out_nc) {
-                    ++out_nbhd_c;
+        long flag = (sample % 2 == 0) ? 1 : -1;
+        const float* filter = filters + f*in_nk*nbhd_nr*nbhd_nc;
+
+        // Convolve the filter with the rectified neighborhood differences of
+        // pixel (r, c) without storing them.
+        float sum = biases[f];
+        for (long k = 0; k < in_nk; ++k) {
+            float center = input_tensor[((input_sample(sample, broadcast)*in_nk + k)*in_nr + r)*in_nc + c];
+            #pragma unroll (NBHD_NR > 0 ? NBHD_NR : 1)
+            for (long in_nbhd_r = 0; in_nbhd_r < nbhd_nr; ++in_nbhd_r) {
+                long in_r = r - nbhd_nr/2 + in_nbhd_r;
+                if (in_r < 0 || in_r >= in_nr)
                     continue;
+                #pragma unroll (NBHD_NC > 0 ? NBHD_NC : 1)
+                for (long in_nbhd_c = 0; in_nbhd_c < nbhd_nc; ++in_nbhd_c) {
+                    long in_c = c - nbhd_nc/2 + in_nbhd_c;
+                    if (in_c < 0 || in_c >= in_nc)
+                        continue;
+                    float diff = center - input_tensor[((input_sample(sample+flag, broadcast)*in_nk + k)*in_nr + in_r)*in_nc + in_c];
+                    if (diff > 0)
+                        sum += filter[(k*nbhd_nr + in_nbhd_r)*nbhd_nc + in_nbhd_c]*diff;
                 }
-                gradient_output[i] -= gradient_input[offset + c*nbhd_nc + out_nbhd_c];
-                ++out_nbhd_c;
             }
         }
+        output_tensor[i] = sum;
+    }
+}
+
+__global__ void reduce_broadcast_gradient_impl(
+    const float* pair_gradient,
+    float* gradient_output,
+    long sample_size,
+    long num_pairs,
+    long n
+)
+{
+    for (auto i : dlib::cuda::grid_stride_range(0, n)) {
+        long sample = i/sample_size;
+        long j = i % sample_size;
+
+        // The probe is paired sample 2*p of every pair p, while gallery
+        // sample p only appears as paired sample 2*p+1.
+        if (sample == 0) {
+            float grad = 0;
+            for (long p = 0; p < num_pairs; ++p)
+                grad += pair_gradient[2*p*sample_size + j];
+            gradient_output[i] = grad;
+        }
+        else {
+            gradient_output[i] = pair_gradient[(2*sample-1)*sample_size + j];
+        }
     }
 }
 
+// ---------------------------------------------------------------------------
+
+/*
+    Launch the kernel instantiation for the given neighborhood size. The
+    neighborhoods used by the network (3x3 and 5x5) get dedicated
+    instantiations, everything else runs the generic one.
+*/
+namespace
+{
+    void differencing(
+        const float* input_tensor,
+        float* data_output,
+        long in_nk,
+        long in_nr,
+        long in_nc,
+        long nbhd_nr,
+        long nbhd_nc,
+        long n,
+        bool relu,
+        bool broadcast
+    )
+    {
+        if (nbhd_nr == 5 && nbhd_nc == 5)
+            dlib::cuda::launch_kernel(apply_differencing_impl<5,5>, dlib::cuda::max_jobs(n),
+                                      input_tensor, data_output, in_nk, in_nr, in_nc,
+                                      nbhd_nr, nbhd_nc, n, relu, broadcast);
+        else if (nbhd_nr == 3 && nbhd_nc == 3)
+            dlib::cuda::launch_kernel(apply_differencing_impl<3,3>, dlib::cuda::max_jobs(n),
+                                      input_tensor, data_output, in_nk, in_nr, in_nc,
+                                      nbhd_nr, nbhd_nc, n, relu, broadcast);
+        else
+            dlib::cuda::launch_kernel(apply_differencing_impl<0,0>, dlib::cuda::max_jobs(n),
+                                      input_tensor, data_output, in_nk, in_nr, in_nc,
+                                      nbhd_nr, nbhd_nc, n, relu, broadcast);
+    }
+
+    void differencing_gradient(
+        const float* input_tensor,
+        const float* gradient_input,
+        float* gradient_output,
+        long in_nk,
+        long in_nr,
+        long in_nc,
+        long nbhd_nr,
+        long nbhd_nc,
+        long n,
+        bool broadcast
+    )
+    {
+        if (nbhd_nr == 5 && nbhd_nc == 5)
+            dlib::cuda::launch_kernel(get_differencing_gradient_impl<5,5>, dlib::cuda::max_jobs(n),
+                                      input_tensor, gradient_input, gradient_output,
+                                      in_nk, in_nr, in_nc, nbhd_nr, nbhd_nc, n, broadcast);
+        else if (nbhd_nr == 3 && nbhd_nc == 3)
+            dlib::cuda::launch_kernel(get_differencing_gradient_impl<3,3>, dlib::cuda::max_jobs(n),
+                                      input_tensor, gradient_input, gradient_output,
+                                      in_nk, in_nr, in_nc, nbhd_nr, nbhd_nc, n, broadcast);
+        else
+            dlib::cuda::launch_kernel(get_differencing_gradient_impl<0,0>, dlib::cuda::max_jobs(n),
+                                      input_tensor, gradient_input, gradient_output,
+                                      in_nk, in_nr, in_nc, nbhd_nr, nbhd_nc, n, broadcast);
+    }
+}
+
+// ---------------------------------------------------------------------------
+
 void launch_differencing_kernel(
     const float* input_tensor,
     float* data_output,
@@ -109,15 +310,12 @@ void launch_differencing_kernel(
     long in_nc,
     long nbhd_nr,
     long nbhd_nc,
-    long n
+    long n,
+    bool broadcast
 )
 {
-    dlib::cuda::launch_kernel(apply_differencing_impl,
-                              dlib::cuda::max_jobs(n),
-                              input_tensor,
-                              data_output,
-                              in_nk, in_nr, in_nc,
-                              nbhd_nr, nbhd_nc, n);
+    differencing(input_tensor, data_output, in_nk, in_nr, in_nc,
+                 nbhd_nr, nbhd_nc, n, false, broadcast);
 }
 
 void launch_differencing_gradient_kernel(
@@ -131,10 +329,85 @@ void launch_differencing_gradient_kernel(
     long n
 )
 {
-    dlib::cuda::launch_kernel(get_differencing_gradient_impl,
+    differencing_gradient(nullptr, gradient_input, gradient_output,
+                          in_nk, in_nr, in_nc, nbhd_nr, nbhd_nc, n, false);
+}
+
+void launch_differencing_relu_kernel(
+    const float* input_tensor,
+    float* data_output,
+    long in_nk,
+    long in_nr,
+    long in_nc,
+    long nbhd_nr,
+    long nbhd_nc,
+    long n,
+    bool broadcast
+)
+{
+    differencing(input_tensor, data_output, in_nk, in_nr, in_nc,
+                 nbhd_nr, nbhd_nc, n, true, broadcast);
+}
+
+void launch_differencing_relu_gradient_kernel(
+    const float* input_tensor,
+    const float* gradient_input,
+    float* gradient_output,
+    long in_nk,
+    long in_nr,
+    long in_nc,
+    long nbhd_nr,
+    long nbhd_nc,
+    long n,
+    bool broadcast
+)
+{
+    differencing_gradient(input_tensor, gradient_input, gradient_output,
+                          in_nk, in_nr, in_nc, nbhd_nr, nbhd_nc, n, broadcast);
+}
+
+void launch_patch_summary_kernel(
+    const float* input_tensor,
+    const float* params,
+    float* data_output,
+    long num_filters,
+    long in_nk,
+    long in_nr,
+    long in_nc,
+    long nbhd_nr,
+    long nbhd_nc,
+    long n,
+    bool broadcast
+)
+{
+    const float* biases = params + num_filters*in_nk*nbhd_nr*nbhd_nc;
+    if (nbhd_nr == 5 && nbhd_nc == 5)
+        dlib::cuda::launch_kernel(apply_patch_summary_impl<5,5>, dlib::cuda::max_jobs(n),
+                                  input_tensor, params, biases, data_output, num_filters,
+                                  in_nk, in_nr, in_nc, nbhd_nr, nbhd_nc, n, broadcast);
+    else if (nbhd_nr == 3 && nbhd_nc == 3)
+        dlib::cuda::launch_kernel(apply_patch_summary_impl<3,3>, dlib::cuda::max_jobs(n),
+                                  input_tensor, params, biases, data_output, num_filters,
+                                  in_nk, in_nr, in_nc, nbhd_nr, nbhd_nc, n, broadcast);
+    else
+        dlib::cuda::launch_kernel(apply_patch_summary_impl<0,0>, dlib::cuda::max_jobs(n),
+                                  input_tensor, params, biases, data_output, num_filters,
+                                  in_nk, in_nr, in_nc, nbhd_nr, nbhd_nc, n, broadcast);
+}
+
+void launch_broadcast_gradient_reduce_kernel(
+    const float* pair_gradient,
+    float* gradient_output,
+    long sample_size,
+    long num_pairs
+)
+{
+    const long n = (num_pairs+1)*sample_size;
+    dlib::cuda::launch_kernel(reduce_broadcast_gradient_impl,
                               dlib::cuda::max_jobs(n),
-                              gradient_input,
+                              pair_gradient,
                               gradient_output,
-                              in_nk, in_nr, in_nc,
-                              nbhd_nr, nbhd_nc, n);
+                              sample_size,
+                              num_pairs,
+                              n);
 }
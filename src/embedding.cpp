@@ -0,0 +1,91 @@
+#include "embedding.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include <dlib/assert.h>
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+
+namespace
+{
+    // Returns the dot product of the len floats at a and b. The SSE version
+    // handles 8 floats per iteration in two accumulators and leaves the
+    // remainder to the scalar loop.
+    float dot(const float* a, const float* b, size_t len)
+    {
+        size_t i = 0;
+        float sum = 0;
+#ifdef __SSE2__
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        for (; i+8 <= len; i += 8) {
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a+i+4), _mm_loadu_ps(b+i+4)));
+        }
+        float tmp[4];
+        _mm_storeu_ps(tmp, _mm_add_ps(acc0, acc1));
+        sum = (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+#endif
+        for (; i < len; ++i)
+            sum += a[i]*b[i];
+        return sum;
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+std::vector<float> pooled_embedding(const feature_map& fmap)
+{
+    const long plane_size = fmap.nr*fmap.nc;
+    DLIB_CASSERT(fmap.values.size() == static_cast<size_t>(fmap.k*plane_size), "");
+
+    std::vector<float> embedding(fmap.k);
+    double norm = 0;
+    for (long c = 0; c < fmap.k; ++c) {
+        const float* plane = &fmap.values[c*plane_size];
+        embedding[c] = std::accumulate(plane, plane+plane_size, 0.0)/plane_size;
+        norm += embedding[c]*embedding[c];
+    }
+
+    if (norm > 0) {
+        const float scale = 1/std::sqrt(norm);
+        for (float& v : embedding)
+            v *= scale;
+    }
+    return embedding;
+}
+
+// ---------------------------------------------------------------------------
+
+void embedding_index::add(const std::vector<float>& embedding)
+{
+    DLIB_CASSERT(size() == 0 || embedding.size() == dim, "");
+    dim = embedding.size();
+    data.insert(data.end(), embedding.begin(), embedding.end());
+}
+
+void embedding_index::similarities(const std::vector<float>& query, std::vector<float>& sims) const
+{
+    DLIB_CASSERT(query.size() == dim, "");
+    sims.resize(size());
+    for (size_t i = 0; i < sims.size(); ++i)
+        sims[i] = dot(query.data(), &data[i*dim], dim);
+}
+
+std::vector<size_t> embedding_index::nearest(const std::vector<float>& query, size_t k, std::vector<float>& sims) const
+{
+    similarities(query, sims);
+
+    std::vector<size_t> order(sims.size());
+    std::iota(order.begin(), order.end(), 0);
+    k = std::min(k, order.size());
+    std::partial_sort(order.begin(), order.begin()+k, order.end(), [&](size_t a, size_t b) {
+        return sims[a] > sims[b] || (sims[a] == sims[b] && a < b);
+    });
+    order.resize(k);
+    return order;
+}
@@ -1,5 +1,178 @@
 #include "input.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
+
+namespace
+{
+    // -----------------------------------------------------------------------
+    //  pixel_sums:             adds the sum and the sum of squares of the
+    //                          len bytes in src to sum and sum_sqr.
+    //  deinterleave_normalize: splits num_pixels interleaved RGB pixels into
+    //                          the planes r, g and b, mapping each value v to
+    //                          v*scale + offset.
+    //
+    //  With SSE2, pixel_sums handles 16 bytes and deinterleave_normalize 96
+    //  bytes (32 pixels) per iteration, leaving the remainder to the scalar
+    //  loops. SSE2 is part of x86-64, so no runtime dispatch is needed.
+    // -----------------------------------------------------------------------
+
+    void pixel_sums(const unsigned char* src, long len, uint64_t& sum, uint64_t& sum_sqr)
+    {
+        long i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        __m128i vsum = _mm_setzero_si128();
+        __m128i vsum_sqr = _mm_setzero_si128();
+        for (; i+16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+            vsum = _mm_add_epi64(vsum, _mm_sad_epu8(v, zero));
+
+            // Squares of 16 bit values, summed in adjacent pairs to 32 bits
+            // and widened to 64 bits before accumulating.
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            __m128i sqr = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+            vsum_sqr = _mm_add_epi64(vsum_sqr, _mm_unpacklo_epi32(sqr, zero));
+            vsum_sqr = _mm_add_epi64(vsum_sqr, _mm_unpackhi_epi32(sqr, zero));
+        }
+        uint64_t tmp[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(tmp), vsum);
+        sum += tmp[0] + tmp[1];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(tmp), vsum_sqr);
+        sum_sqr += tmp[0] + tmp[1];
+#endif
+        for (; i < len; ++i) {
+            sum += src[i];
+            sum_sqr += src[i]*src[i];
+        }
+    }
+
+#ifdef __SSE2__
+    // One round of the byte interleaving network that splits 48 bytes of
+    // RGB pixels into their channels. Applying it five times to the six
+    // registers holding 32 pixels leaves the red, green and blue values of
+    // the pixels in v[0..1], v[2..3] and v[4..5] respectively.
+    inline void deinterleave_round(__m128i* v)
+    {
+        __m128i t0 = _mm_unpacklo_epi8(v[0], v[3]);
+        __m128i t1 = _mm_unpackhi_epi8(v[0], v[3]);
+        __m128i t2 = _mm_unpacklo_epi8(v[1], v[4]);
+        __m128i t3 = _mm_unpackhi_epi8(v[1], v[4]);
+        __m128i t4 = _mm_unpacklo_epi8(v[2], v[5]);
+        __m128i t5 = _mm_unpackhi_epi8(v[2], v[5]);
+        v[0] = t0; v[1] = t1; v[2] = t2; v[3] = t3; v[4] = t4; v[5] = t5;
+    }
+
+    // Converts 16 bytes to floats, maps them to v*scale + offset and stores
+    // them at dest.
+    inline void normalize_bytes(__m128i v, __m128 scale, __m128 offset, float* dest)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i words[4] = {
+            _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+            _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)
+        };
+        for (int j = 0; j < 4; ++j) {
+            __m128 f = _mm_cvtepi32_ps(words[j]);
+            _mm_storeu_ps(dest + 4*j, _mm_add_ps(_mm_mul_ps(f, scale), offset));
+        }
+    }
+#endif
+
+    void deinterleave_normalize(
+        const unsigned char* src,
+        long num_pixels,
+        float scale,
+        float offset,
+        float* r,
+        float* g,
+        float* b
+    )
+    {
+        long i = 0;
+#ifdef __SSE2__
+        const __m128 vscale = _mm_set1_ps(scale);
+        const __m128 voffset = _mm_set1_ps(offset);
+        for (; i+32 <= num_pixels; i += 32) {
+            __m128i v[6];
+            for (int j = 0; j < 6; ++j)
+                v[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3*i + 16*j));
+            for (int round = 0; round < 5; ++round)
+                deinterleave_round(v);
+
+            normalize_bytes(v[0], vscale, voffset, r+i);
+            normalize_bytes(v[1], vscale, voffset, r+i+16);
+            normalize_bytes(v[2], vscale, voffset, g+i);
+            normalize_bytes(v[3], vscale, voffset, g+i+16);
+            normalize_bytes(v[4], vscale, voffset, b+i);
+            normalize_bytes(v[5], vscale, voffset, b+i+16);
+        }
+#endif
+        for (; i < num_pixels; ++i) {
+            r[i] = src[3*i]*scale + offset;
+            g[i] = src[3*i+1]*scale + offset;
+            b[i] = src[3*i+2]*scale + offset;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+void normalize_image(const rgb_image_view& img, float* dest)
+{
+    static_assert(sizeof(dlib::rgb_pixel) == 3, "rgb_pixel must be 3 packed bytes");
+
+    const long num_pixels = img.size();
+    if (num_pixels == 0)
+        return;
+    const std::shared_ptr<const dlib::rgb_pixel> pixels = img.pixels();
+    const unsigned char* src = &pixels->red;
+
+    // Image statistics over all channels, accumulated exactly as integers
+    uint64_t sum = 0;
+    uint64_t sum_sqr = 0;
+    pixel_sums(src, 3*num_pixels, sum, sum_sqr);
+
+    const double n = 3.0*num_pixels;
+    const double mean = sum/n;
+    const double variance = (n > 1) ? std::max(0.0, (sum_sqr - n*mean*mean)/(n-1)) : 0.0;
+
+    // (v - mean)/(stddev + 1e-7) as a single multiply-add per value
+    const float scale = 1.0/(std::sqrt(variance)+1e-7);
+    const float offset = -mean*scale;
+    deinterleave_normalize(src, num_pixels, scale, offset,
+                           dest, dest + num_pixels, dest + 2*num_pixels);
+}
+
+// ---------------------------------------------------------------------------
+
+void normalized_image_cache::add(const image_type& img)
+{
+    if (offsets.count(&img) != 0)
+        return;
+
+    if (offsets.empty()) {
+        nr = img.nr();
+        nc = img.nc();
+    }
+    DLIB_CASSERT(img.nr() == nr && img.nc() == nc, "Image size mismatch.");
+
+    const size_t offset = values.size();
+    values.resize(offset + 3*nr*nc);
+    normalize_image(img, &values[offset]);
+    offsets[&img] = offset;
+}
+
+// ---------------------------------------------------------------------------
+
 void serialize(const input_rgb_image_pair& item, std::ostream& out)
 {
     dlib::serialize("input_rgb_image_pair", out);
@@ -24,3 +197,30 @@ void to_xml(const input_rgb_image_pair& item, std::ostream& out)
 {
     out << "<input_rgb_image_pair/>";
 }
+
+// ---------------------------------------------------------------------------
+
+void serialize(const input_feature_maps& item, std::ostream& out)
+{
+    dlib::serialize("input_feature_maps", out);
+}
+
+void deserialize(input_feature_maps& item, std::istream& in)
+{
+    std::string version;
+    dlib::deserialize(version, in);
+    if (version != "input_feature_maps") {
+        throw dlib::serialization_error("Unexpected version found while deserializing input_feature_maps.");
+    }
+}
+
+std::ostream& operator<<(std::ostream& out, const input_feature_maps& item)
+{
+    out << "input_feature_maps";
+    return out;
+}
+
+void to_xml(const input_feature_maps& item, std::ostream& out)
+{
+    out << "<input_feature_maps/>";
+}
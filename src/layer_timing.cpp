@@ -0,0 +1,126 @@
+#include "layer_timing.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+namespace
+{
+    struct layer_timing_registry {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<layer_timing>> timings;
+    };
+
+    layer_timing_registry& registry()
+    {
+        static layer_timing_registry instance;
+        return instance;
+    }
+
+    // Layer descriptions may span several columns, so tabs are replaced.
+    std::string single_line(std::string name)
+    {
+        std::replace(name.begin(), name.end(), '\t', ' ');
+        std::replace(name.begin(), name.end(), '\n', ' ');
+        return name;
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+std::shared_ptr<layer_timing> register_layer_timing(const std::string& name)
+{
+    auto timing = std::make_shared<layer_timing>(single_line(name));
+    layer_timing_registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.timings.push_back(timing);
+    return timing;
+}
+
+std::vector<layer_timing_summary> get_layer_timings()
+{
+    typedef std::tuple<std::string, long, long, long> key_type;
+    std::map<key_type, layer_timing_summary> summaries;
+    std::map<key_type, uint64_t> samples;
+
+    layer_timing_registry& reg = registry();
+    {
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        for (const auto& timing : reg.timings) {
+            if (timing->forward_calls == 0)
+                continue;
+
+            const key_type key(timing->name, timing->output_k, timing->output_nr, timing->output_nc);
+            layer_timing_summary& summary = summaries[key];
+            summary.name = timing->name;
+            summary.k = timing->output_k;
+            summary.nr = timing->output_nr;
+            summary.nc = timing->output_nc;
+            summary.forward_calls += timing->forward_calls;
+            summary.forward_seconds += timing->forward_nanoseconds*1e-9;
+            summary.backward_calls += timing->backward_calls;
+            summary.backward_seconds += timing->backward_nanoseconds*1e-9;
+            samples[key] += timing->output_samples;
+        }
+    }
+
+    std::vector<layer_timing_summary> result;
+    for (auto& entry : summaries) {
+        entry.second.average_samples = static_cast<double>(samples[entry.first])/entry.second.forward_calls;
+        result.push_back(entry.second);
+    }
+    std::stable_sort(result.begin(), result.end(),
+                     [](const layer_timing_summary& a, const layer_timing_summary& b) {
+                         return a.total_seconds() > b.total_seconds();
+                     });
+    return result;
+}
+
+void reset_layer_timings()
+{
+    layer_timing_registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    for (const auto& timing : reg.timings) {
+        timing->forward_calls = 0;
+        timing->forward_nanoseconds = 0;
+        timing->backward_calls = 0;
+        timing->backward_nanoseconds = 0;
+        timing->output_samples = 0;
+    }
+}
+
+void print_layer_timings(std::ostream& out)
+{
+    const std::vector<layer_timing_summary> timings = get_layer_timings();
+    if (timings.empty())
+        return;
+
+    double total = 0;
+    for (const layer_timing_summary& t : timings)
+        total += t.total_seconds();
+
+    // Times are in milliseconds, per call averages are over all calls.
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3)
+        << std::setw(7) << "total%" << std::setw(12) << "fwd ms/call" << std::setw(12) << "bwd ms/call"
+        << std::setw(10) << "fwd calls" << std::setw(10) << "bwd calls" << std::setw(10) << "samples"
+        << "  output (k x nr x nc)  layer\n";
+    for (const layer_timing_summary& t : timings) {
+        std::ostringstream shape;
+        shape << t.k << " x " << t.nr << " x " << t.nc;
+        out << std::setw(7) << std::setprecision(1) << (total > 0 ? 100*t.total_seconds()/total : 0.0)
+            << std::setprecision(3)
+            << std::setw(12) << 1e3*t.forward_seconds/t.forward_calls
+            << std::setw(12) << (t.backward_calls ? 1e3*t.backward_seconds/t.backward_calls : 0.0)
+            << std::setw(10) << t.forward_calls << std::setw(10) << t.backward_calls
+            << std::setw(10) << std::setprecision(1) << t.average_samples
+            << "  " << std::left << std::setw(20) << shape.str() << std::right
+            << "  " << t.name << "\n";
+    }
+    out << "Total: " << std::setprecision(3) << total << " s" << std::endl;
+    out.flags(flags);
+    out.precision(precision);
+}
@@ -0,0 +1,231 @@
+#include "score_matrix.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+
+#include <dlib/assert.h>
+
+#include "cmc.h"
+
+namespace
+{
+    /*
+        Layout of a score matrix file:
+            - score_header
+            - int32_t probe identities, num_probes of them
+            - int32_t gallery identities, num_gallery of them
+            - float scores, num_probes rows of num_gallery each
+    */
+    struct score_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint64_t num_probes;
+        uint64_t num_gallery;
+    };
+
+    const char score_magic[8] = {'I', 'D', 'L', 'A', 'S', 'C', 'O', 'R'};
+    const uint32_t score_version = 1;
+    const uint32_t score_byte_order = 0x01020304;
+
+    template <typename T>
+    void write_array(std::ostream& out, const std::vector<T>& data)
+    {
+        out.write(reinterpret_cast<const char*>(data.data()), data.size()*sizeof(T));
+    }
+
+    // Sets product to a*b*c and returns true, unless it exceeds limit.
+    bool bounded_product(uint64_t a, uint64_t b, uint64_t c, uint64_t limit, uint64_t& product)
+    {
+        product = 1;
+        for (uint64_t factor : {a, b, c}) {
+            if (factor != 0 && product > limit/factor)
+                return false;
+            product *= factor;
+        }
+        return true;
+    }
+
+    template <typename T>
+    void read_array(std::istream& in, std::vector<T>& data, uint64_t size)
+    {
+        data.resize(size);
+        in.read(reinterpret_cast<char*>(data.data()), size*sizeof(T));
+    }
+
+    // Returns whether p is in the gallery, and if so the number of wrong
+    // gallery images scoring at least as high as its best correct one.
+    bool first_match_rank(const score_matrix& m, size_t p, size_t& rank)
+    {
+        const float* row = m.row(p);
+        bool found = false;
+        float best = 0;
+        for (size_t g = 0; g < m.num_gallery(); ++g) {
+            if (m.gallery_ids[g] == m.probe_ids[p] && (!found || row[g] > best)) {
+                best = row[g];
+                found = true;
+            }
+        }
+
+        rank = 0;
+        for (size_t g = 0; g < m.num_gallery() && found; ++g) {
+            if (m.gallery_ids[g] != m.probe_ids[p] && row[g] >= best)
+                ++rank;
+        }
+        return found;
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+void save_score_matrix(const std::string& filename, const score_matrix& m)
+{
+    DLIB_CASSERT(m.scores.size() == m.num_probes()*m.num_gallery(), "");
+
+    score_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, score_magic, sizeof(score_magic));
+    header.version = score_version;
+    header.byte_order = score_byte_order;
+    header.num_probes = m.num_probes();
+    header.num_gallery = m.num_gallery();
+
+    std::ofstream fout(filename, std::ios::binary);
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write_array(fout, m.probe_ids);
+    write_array(fout, m.gallery_ids);
+    write_array(fout, m.scores);
+    fout.flush();
+    if (!fout)
+        throw std::runtime_error("Unable to write score matrix " + filename + ".");
+}
+
+score_matrix load_score_matrix(const std::string& filename)
+{
+    std::ifstream fin(filename, std::ios::binary | std::ios::ate);
+    if (!fin)
+        throw std::runtime_error("Unable to open score matrix " + filename + ".");
+    const uint64_t file_size = fin.tellg();
+    fin.seekg(0);
+
+    score_header header;
+    fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!fin ||
+        std::memcmp(header.magic, score_magic, sizeof(score_magic)) != 0 ||
+        header.version != score_version ||
+        header.byte_order != score_byte_order) {
+        throw std::runtime_error(filename + " is not a score matrix.");
+    }
+
+    // Validate the sizes before allocating anything. None of them may exceed
+    // the file size, which also keeps their products and sums from
+    // overflowing on a corrupt header.
+    uint64_t probes_size, gallery_size, scores_size;
+    if (!bounded_product(header.num_probes, sizeof(int32_t), 1, file_size, probes_size) ||
+        !bounded_product(header.num_gallery, sizeof(int32_t), 1, file_size, gallery_size) ||
+        !bounded_product(header.num_probes, header.num_gallery, sizeof(float), file_size, scores_size) ||
+        file_size-sizeof(header) < probes_size+gallery_size+scores_size) {
+        throw std::runtime_error("Score matrix " + filename + " is truncated.");
+    }
+
+    score_matrix m;
+    read_array(fin, m.probe_ids, header.num_probes);
+    read_array(fin, m.gallery_ids, header.num_gallery);
+    read_array(fin, m.scores, header.num_probes*header.num_gallery);
+    if (!fin)
+        throw std::runtime_error("Score matrix " + filename + " is truncated.");
+    return m;
+}
+
+// ---------------------------------------------------------------------------
+
+std::vector<double> single_shot_cmc(const score_matrix& m)
+{
+    // Group the gallery images by identity.
+    std::vector<size_t> order(m.num_gallery());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return m.gallery_ids[a] < m.gallery_ids[b];
+    });
+    std::vector<int32_t> ids;
+    std::vector<size_t> offsets;
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (ids.empty() || m.gallery_ids[order[i]] != ids.back()) {
+            ids.push_back(m.gallery_ids[order[i]]);
+            offsets.push_back(i);
+        }
+    }
+    offsets.push_back(order.size());
+
+    std::vector<double> cmc(ids.size(), 0);
+    std::vector<float> grouped(order.size());
+    size_t num_probes = 0;
+    for (size_t p = 0; p < m.num_probes(); ++p) {
+        auto match = std::lower_bound(ids.begin(), ids.end(), m.probe_ids[p]);
+        if (match == ids.end() || *match != m.probe_ids[p])
+            continue;
+
+        const float* row = m.row(p);
+        for (size_t i = 0; i < order.size(); ++i)
+            grouped[i] = row[order[i]];
+        add_expected_ranks(grouped.data(), offsets, match-ids.begin(), cmc);
+        ++num_probes;
+    }
+
+    std::partial_sum(cmc.begin(), cmc.end(), cmc.begin());
+    for (double& c : cmc)
+        c /= std::max<size_t>(num_probes, 1);
+    return cmc;
+}
+
+std::vector<double> top_k_accuracy(const score_matrix& m)
+{
+    std::vector<double> accuracy(m.num_gallery(), 0);
+    size_t num_probes = 0;
+    for (size_t p = 0; p < m.num_probes(); ++p) {
+        size_t rank;
+        if (!first_match_rank(m, p, rank))
+            continue;
+        accuracy[rank] += 1;
+        ++num_probes;
+    }
+
+    std::partial_sum(accuracy.begin(), accuracy.end(), accuracy.begin());
+    for (double& a : accuracy)
+        a /= std::max<size_t>(num_probes, 1);
+    return accuracy;
+}
+
+double mean_average_precision(const score_matrix& m)
+{
+    double total = 0;
+    size_t num_probes = 0;
+    std::vector<size_t> order(m.num_gallery());
+    for (size_t p = 0; p < m.num_probes(); ++p) {
+        const float* row = m.row(p);
+        const int32_t id = m.probe_ids[p];
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            if (row[a] != row[b])
+                return row[a] > row[b];
+            return (m.gallery_ids[a] == id) < (m.gallery_ids[b] == id);
+        });
+
+        double precision_sum = 0;
+        size_t num_hits = 0;
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (m.gallery_ids[order[i]] == id) {
+                ++num_hits;
+                precision_sum += static_cast<double>(num_hits)/(i+1);
+            }
+        }
+        if (num_hits == 0)
+            continue;
+        total += precision_sum/num_hits;
+        ++num_probes;
+    }
+    return num_probes > 0 ? total/num_probes : 0;
+}
@@ -0,0 +1,59 @@
+#include "sync_batch_norm.h"
+
+#include <stdexcept>
+
+void batch_norm_sync::begin_step(const std::vector<double>& weights_)
+{
+    DLIB_CASSERT(weights_.size() > 0, "");
+    std::lock_guard<std::mutex> lock(mutex);
+    weights = weights_;
+    slots.resize(weights.size());
+    arrived = 0;
+    aborted = false;
+}
+
+void batch_norm_sync::end_step()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    weights.clear();
+}
+
+void batch_norm_sync::all_reduce(size_t shard, std::vector<double>& values, bool weighted)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    DLIB_CASSERT(shard < weights.size(), "");
+    slots[shard] = values;
+    wait(lock);
+
+    for (size_t j = 0; j < slots.size(); ++j) {
+        DLIB_CASSERT(slots[j].size() == values.size(), "");
+        const double w = weighted ? weights[j] : 1;
+        for (size_t i = 0; i < values.size(); ++i)
+            values[i] = (j == 0) ? w*slots[j][i] : values[i] + w*slots[j][i];
+    }
+
+    // Nobody may overwrite the slots before all shards have read them.
+    wait(lock);
+}
+
+void batch_norm_sync::abort()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    aborted = true;
+    cv.notify_all();
+}
+
+void batch_norm_sync::wait(std::unique_lock<std::mutex>& lock)
+{
+    const unsigned long current = generation;
+    if (!aborted && ++arrived == weights.size()) {
+        arrived = 0;
+        ++generation;
+        cv.notify_all();
+    }
+    else {
+        cv.wait(lock, [&]() { return generation != current || aborted; });
+    }
+    if (aborted)
+        throw std::runtime_error("Batch normalization was aborted because another replica failed.");
+}
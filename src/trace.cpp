@@ -0,0 +1,176 @@
+#include "trace.h"
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include <dlib/assert.h>
+
+namespace trace_impl
+{
+    std::atomic<bool> enabled(false);
+}
+
+namespace
+{
+    struct trace_event {
+        const char* name;
+        int64_t start;
+        int64_t end;
+    };
+
+    // Only written by its own thread, but read by write_trace().
+    struct thread_buffer {
+        std::mutex mutex;
+        std::vector<trace_event> events;
+        size_t next = 0;                // oldest event once the buffer is full
+        int tid = 0;
+        std::string name;
+    };
+
+    struct trace_registry {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<thread_buffer>> buffers;
+        std::atomic<size_t> capacity{1 << 18};
+        int next_tid = 1;
+    };
+
+    trace_registry& registry()
+    {
+        static trace_registry instance;
+        return instance;
+    }
+
+    std::chrono::steady_clock::time_point origin()
+    {
+        static const std::chrono::steady_clock::time_point instance = std::chrono::steady_clock::now();
+        return instance;
+    }
+
+    // The buffers are owned by the registry as well, so the events of a
+    // thread survive it.
+    thread_buffer& local_buffer()
+    {
+        thread_local std::shared_ptr<thread_buffer> buffer;
+        if (!buffer) {
+            buffer = std::make_shared<thread_buffer>();
+            trace_registry& reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            buffer->tid = reg.next_tid++;
+            reg.buffers.push_back(buffer);
+        }
+        return *buffer;
+    }
+
+    void write_json_string(std::ostream& out, const std::string& str)
+    {
+        out << '"';
+        for (char c : str) {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if (static_cast<unsigned char>(c) < 0x20)
+                out << ' ';
+            else
+                out << c;
+        }
+        out << '"';
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+int64_t trace_impl::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - origin()).count();
+}
+
+void trace_impl::record(const char* name, int64_t start, int64_t end)
+{
+    thread_buffer& buffer = local_buffer();
+    const size_t capacity = registry().capacity;
+
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    if (buffer.events.size() < capacity) {
+        buffer.events.push_back({name, start, end});
+    }
+    else {
+        buffer.events[buffer.next] = {name, start, end};
+        buffer.next = (buffer.next+1) % buffer.events.size();
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+void start_tracing(size_t events_per_thread)
+{
+    DLIB_CASSERT(events_per_thread > 0, "");
+    origin();
+    registry().capacity = events_per_thread;
+    trace_impl::enabled = true;
+}
+
+void stop_tracing()
+{
+    trace_impl::enabled = false;
+}
+
+void set_trace_thread_name(const std::string& name)
+{
+    thread_buffer& buffer = local_buffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    buffer.name = name;
+}
+
+void write_trace(const std::string& filename)
+{
+    std::vector<std::shared_ptr<thread_buffer>> buffers;
+    {
+        trace_registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        buffers = reg.buffers;
+    }
+
+    std::ofstream fout(filename);
+    fout << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&]() -> std::ostream& {
+        if (!first)
+            fout << ",";
+        first = false;
+        return fout << "\n";
+    };
+
+    // Timestamps and durations are in microseconds.
+    fout.precision(3);
+    fout << std::fixed;
+    for (const auto& buffer : buffers) {
+        std::vector<trace_event> events;
+        std::string name;
+        {
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            events = buffer->events;
+            name = buffer->name;
+        }
+
+        if (!name.empty()) {
+            separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+                        << ",\"args\":{\"name\":";
+            write_json_string(fout, name);
+            fout << "}}";
+        }
+        for (const trace_event& e : events) {
+            separator() << "{\"name\":";
+            write_json_string(fout, e.name);
+            fout << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                 << ",\"ts\":" << e.start*1e-3 << ",\"dur\":" << (e.end-e.start)*1e-3 << "}";
+        }
+    }
+    fout << "\n]}\n";
+
+    if (!fout)
+        throw std::runtime_error("Unable to write trace " + filename + ".");
+}
@@ -0,0 +1,109 @@
+#include <difference.h>
+#include <patch_summary.h>
+
+#include <dlib/dnn.h>
+#include <dlib/rand.h>
+
+#include "input_test.h"
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.broadcast");
+
+    class test_broadcast : public tester {
+    public:
+        test_broadcast() : tester("test_broadcast",
+                                  "Runs test on the broadcast mode of the cross neighborhood differences layers")
+        { }
+
+        /*
+            Checks a layer in broadcast mode against the same layer run on the
+            batch probe, gallery 1, probe, gallery 2, ...
+        */
+        template <typename net_type>
+        void check_layer(
+            const dlib::resizable_tensor& input_tensor,
+            const dlib::resizable_tensor& paired_tensor,
+            const dlib::resizable_tensor& gradient_input
+        )
+        {
+            net_type broadcast_net;
+            net_type net;
+            broadcast_net.layer_details().set_broadcast(true);
+
+            // =============== //
+            //  FORWARD CHECK  //
+            // =============== //
+            dlib::matrix<float> broadcast_output = dlib::mat(broadcast_net.forward(input_tensor));
+            dlib::matrix<float> output = dlib::mat(net.forward(paired_tensor));
+            DLIB_TEST(broadcast_output.nr() == output.nr());
+            DLIB_TEST(dlib::max(dlib::abs(broadcast_output-output)) <= 1e-6);
+
+            // ================ //
+            //  GRADIENT CHECK  //
+            // ================ //
+            broadcast_net.back_propagate_error(input_tensor, gradient_input);
+            net.back_propagate_error(paired_tensor, gradient_input);
+
+            // The probe gradient is the sum of the gradients of its copies.
+            dlib::matrix<float> broadcast_grad = dlib::mat(broadcast_net.get_final_data_gradient());
+            dlib::matrix<float> grad = dlib::mat(net.get_final_data_gradient());
+            const long num_pairs = input_tensor.num_samples()-1;
+            dlib::matrix<float> expected_grad(num_pairs+1, grad.nc());
+            dlib::set_rowm(expected_grad, 0) = 0;
+            for (long p = 0; p < num_pairs; ++p) {
+                dlib::set_rowm(expected_grad, 0) += dlib::rowm(grad, 2*p);
+                dlib::set_rowm(expected_grad, p+1) = dlib::rowm(grad, 2*p+1);
+            }
+            DLIB_TEST(dlib::max(dlib::abs(broadcast_grad-expected_grad)) <= 1e-4);
+        }
+
+        void perform_test()
+        {
+            dlib::rand rnd;
+            const long num_gallery = 3;
+            dlib::resizable_tensor input_tensor;
+            input_tensor.set_size(num_gallery+1, 2, 5, 6);
+            for (float& v : input_tensor) v = rnd.get_random_gaussian();
+
+            // Duplicate the probe in front of every gallery sample
+            const long sample_size = input_tensor.k()*input_tensor.nr()*input_tensor.nc();
+            dlib::resizable_tensor paired_tensor;
+            paired_tensor.set_size(2*num_gallery, 2, 5, 6);
+            for (long p = 0; p < num_gallery; ++p) {
+                std::copy(input_tensor.begin(), input_tensor.begin()+sample_size,
+                          paired_tensor.begin()+2*p*sample_size);
+                std::copy(input_tensor.begin()+(p+1)*sample_size, input_tensor.begin()+(p+2)*sample_size,
+                          paired_tensor.begin()+(2*p+1)*sample_size);
+            }
+
+            dlib::resizable_tensor gradient_input;
+            gradient_input.set_size(2*num_gallery, 2, 15, 18);
+            for (float& v : gradient_input) v = rnd.get_random_gaussian();
+
+            check_layer<cross_neighborhood_differences<3,3,input_test>>(input_tensor, paired_tensor, gradient_input);
+            check_layer<cross_neighborhood_differences_relu<3,3,input_test>>(input_tensor, paired_tensor, gradient_input);
+
+            // The patch summary layer only supports inference
+            using summary_net_type = cross_neighborhood_patch_summary<4,3,3,input_test>;
+            summary_net_type broadcast_net;
+            summary_net_type net;
+            broadcast_net.layer_details().set_broadcast(true);
+            broadcast_net.forward(input_tensor);
+            net.forward(paired_tensor);
+            broadcast_net.layer_details().set_filters(net.layer_details().get_layer_params());
+
+            dlib::matrix<float> broadcast_output = dlib::mat(broadcast_net.forward(input_tensor));
+            dlib::matrix<float> output = dlib::mat(net.forward(paired_tensor));
+            DLIB_TEST(broadcast_output.nr() == output.nr());
+            DLIB_TEST(dlib::max(dlib::abs(broadcast_output-output)) <= 1e-5);
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_broadcast a;
+}
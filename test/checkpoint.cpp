@@ -0,0 +1,103 @@
+#include <checkpoint.h>
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if !defined _WIN32
+#include <utime.h>
+#endif
+
+#include <dlib/serialize.h>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.checkpoint");
+
+    std::vector<int> load(const std::string& filename)
+    {
+        std::vector<int> item;
+        dlib::deserialize(filename) >> item;
+        return item;
+    }
+
+    class test_checkpoint : public tester {
+    public:
+        test_checkpoint() : tester("test_checkpoint",
+                                   "Runs test on the background checkpoint writer")
+        { }
+
+        void perform_test()
+        {
+            const std::string filename = "test_checkpoint.dat";
+            const std::string other_filename = "test_checkpoint_other.dat";
+
+            {
+                checkpoint_writer checkpoints;
+
+                // The snapshot is taken by save(), so later changes to the
+                // item are not written.
+                std::vector<int> item = {1, 2, 3};
+                checkpoints.save(filename, item);
+                item.push_back(4);
+                checkpoints.wait();
+                DLIB_TEST(load(filename) == std::vector<int>({1, 2, 3}));
+
+                // Consecutive snapshots are all written, in order.
+                for (int i = 0; i < 10; ++i) {
+                    item.assign(1000, i);
+                    checkpoints.save(filename, item);
+                    checkpoints.save(other_filename, std::vector<int>(1, i));
+                }
+                checkpoints.wait();
+                DLIB_TEST(load(filename) == std::vector<int>(1000, 9));
+                DLIB_TEST(load(other_filename) == std::vector<int>(1, 9));
+
+                // Failed writes are reported by the next call.
+                checkpoints.save("no_such_directory/test_checkpoint.dat", item);
+                bool failed = false;
+                try {
+                    checkpoints.wait();
+                }
+                catch (std::runtime_error&) {
+                    failed = true;
+                }
+                DLIB_TEST(failed);
+
+                // The destructor writes pending snapshots.
+                checkpoints.save(filename, std::vector<int>(1, 42));
+            }
+            DLIB_TEST(load(filename) == std::vector<int>(1, 42));
+
+            // dnn_trainer alternates between filename and filename+"_", and
+            // the newer one is the one to resume from.
+            const std::string alternate = filename+"_";
+            DLIB_TEST(latest_checkpoint(filename) == filename);
+            dlib::serialize(alternate) << std::vector<int>(1, 7);
+#if !defined _WIN32
+            utimbuf times;
+            times.actime = times.modtime = 1000000000;
+            DLIB_TEST(utime(filename.c_str(), &times) == 0);
+            DLIB_TEST(latest_checkpoint(filename) == alternate);
+            times.actime = times.modtime = 999999999;
+            DLIB_TEST(utime(alternate.c_str(), &times) == 0);
+            DLIB_TEST(latest_checkpoint(filename) == filename);
+#endif
+
+            std::remove(filename.c_str());
+            DLIB_TEST(latest_checkpoint(filename) == alternate);
+            std::remove(alternate.c_str());
+            DLIB_TEST(latest_checkpoint(filename).empty());
+            std::remove(other_filename.c_str());
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_checkpoint a;
+}
@@ -0,0 +1,103 @@
+#include <cmc.h>
+
+#include <cmath>
+#include <vector>
+
+#include <dlib/rand.h>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.cmc");
+
+    // Adds the rank of the match for every combination of gallery images,
+    // each weighted by its probability. Scores must be distinct.
+    void enumerate_ranks(
+        const std::vector<float>& scores,
+        const std::vector<size_t>& offsets,
+        size_t match,
+        std::vector<double>& rank_counts
+    )
+    {
+        const size_t num_ids = offsets.size()-1;
+        std::vector<size_t> choice(offsets.begin(), offsets.end()-1);
+        double num_combinations = 1;
+        for (size_t j = 0; j < num_ids; ++j)
+            num_combinations *= offsets[j+1]-offsets[j];
+
+        for (;;) {
+            size_t rank = 0;
+            for (size_t j = 0; j < num_ids; ++j) {
+                if (scores[choice[j]] > scores[choice[match]])
+                    ++rank;
+            }
+            rank_counts[rank] += 1/num_combinations;
+
+            size_t j = 0;
+            while (j < num_ids && ++choice[j] == offsets[j+1]) {
+                choice[j] = offsets[j];
+                ++j;
+            }
+            if (j == num_ids)
+                break;
+        }
+    }
+
+    class test_cmc : public tester {
+    public:
+        test_cmc() : tester("test_cmc",
+                            "Runs test on the rank statistics of the CMC")
+        { }
+
+        void perform_test()
+        {
+            dlib::rand rnd(0);
+            for (int iter = 0; iter < 20; ++iter) {
+                // Gallery identities with 1 to 4 images and distinct scores
+                const size_t num_ids = 1 + rnd.get_random_32bit_number() % 6;
+                std::vector<size_t> offsets(1, 0);
+                for (size_t j = 0; j < num_ids; ++j)
+                    offsets.push_back(offsets.back() + 1 + rnd.get_random_32bit_number() % 4);
+                std::vector<float> scores(offsets.back());
+                for (size_t i = 0; i < scores.size(); ++i)
+                    scores[i] = (i*7919 % scores.size())/static_cast<float>(scores.size());
+
+                const size_t match = rnd.get_random_32bit_number() % num_ids;
+                std::vector<double> expected(num_ids, 0), exact(num_ids, 0), sampled(num_ids, 0);
+                enumerate_ranks(scores, offsets, match, expected);
+                add_expected_ranks(scores.data(), offsets, match, exact);
+                add_sampled_ranks(scores.data(), offsets, match, 20000, rnd, sampled);
+
+                double exact_total = 0, sampled_total = 0;
+                for (size_t r = 0; r < num_ids; ++r) {
+                    DLIB_TEST_MSG(std::abs(exact[r] - expected[r]) < 1e-9, exact[r] << " " << expected[r]);
+                    DLIB_TEST_MSG(std::abs(sampled[r] - expected[r]) < 0.02, sampled[r] << " " << expected[r]);
+                    exact_total += exact[r];
+                    sampled_total += sampled[r];
+                }
+                DLIB_TEST(std::abs(exact_total - 1) < 1e-9);
+                DLIB_TEST(std::abs(sampled_total - 1) < 1e-9);
+            }
+
+            // Equal scores are ranked ahead of the match half of the time.
+            std::vector<float> tied = {0.5f, 0.5f, 0.9f, 0.1f};
+            std::vector<size_t> offsets = {0, 1, 2, 4};
+            std::vector<double> ranks(3, 0);
+            add_expected_ranks(tied.data(), offsets, 0, ranks);
+            DLIB_TEST(std::abs(ranks[0] - 0.25) < 1e-12);
+            DLIB_TEST(std::abs(ranks[1] - 0.5) < 1e-12);
+            DLIB_TEST(std::abs(ranks[2] - 0.25) < 1e-12);
+
+            // Calls accumulate.
+            add_expected_ranks(tied.data(), offsets, 1, ranks);
+            DLIB_TEST(std::abs(ranks[0] + ranks[1] + ranks[2] - 2) < 1e-12);
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_cmc a;
+}
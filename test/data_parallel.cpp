@@ -0,0 +1,266 @@
+#include <data_parallel_trainer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <dlib/dnn.h>
+#include <dlib/rand.h>
+
+#include <multiclass_less.h>
+#include <reinterpret.h>
+#include <sync_batch_norm.h>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.data_parallel");
+
+    using net_type = dlib::loss_multiclass_log<
+                         dlib::fc<2,
+                         dlib::relu<dlib::fc<5,
+                         dlib::input<dlib::matrix<float>>
+                         >>>>;
+
+    template <template <typename> class BN_CON, template <typename> class BN_FC>
+    using bn_net = dlib::loss_multiclass_log<
+                       dlib::fc<2,
+                       dlib::relu<BN_FC<dlib::fc<6,
+                       dlib::relu<BN_CON<dlib::con<3,3,3,1,1,
+                       dlib::input<dlib::matrix<float>>
+                       >>>>>>>;
+
+    using bn_net_type = bn_net<sync_bn_con, sync_bn_fc>;
+    using bn_anet_type = bn_net<dlib::affine, dlib::affine>;
+
+    // An input layer that turns each matrix into two samples, the matrix and
+    // its transpose, like input_rgb_image_pair turns a pair into two images.
+    class input_with_transpose {
+    public:
+        typedef dlib::matrix<float> input_type;
+
+        template <typename input_iterator>
+        void to_tensor(
+            input_iterator ibegin,
+            input_iterator iend,
+            dlib::resizable_tensor& data
+        ) const
+        {
+            const long nr = ibegin->nr();
+            const long nc = ibegin->nc();
+            data.set_size(std::distance(ibegin, iend)*2, 1, nr, nc);
+
+            float* data_ptr = data.host();
+            for (auto i = ibegin; i != iend; ++i) {
+                const dlib::matrix<float> t = dlib::trans(*i);
+                data_ptr = std::copy(i->begin(), i->end(), data_ptr);
+                data_ptr = std::copy(t.begin(), t.end(), data_ptr);
+            }
+        }
+    private:
+        friend void serialize(const input_with_transpose&, std::ostream& out)
+        {
+            dlib::serialize("input_with_transpose", out);
+        }
+
+        friend void deserialize(input_with_transpose&, std::istream& in)
+        {
+            std::string version;
+            dlib::deserialize(version, in);
+            if (version != "input_with_transpose") {
+                throw dlib::serialization_error("Unexpected version found while deserializing input_with_transpose.");
+            }
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const input_with_transpose&)
+        {
+            out << "input_with_transpose";
+            return out;
+        }
+
+        friend void to_xml(const input_with_transpose&, std::ostream& out)
+        {
+            out << "<input_with_transpose/>";
+        }
+    };
+
+    template <template <typename> class BN_CON, template <typename> class BN_FC>
+    using pair_bn_net = loss_multiclass_log_lr<
+                            dlib::fc<2,
+                            dlib::relu<BN_FC<dlib::fc<6,
+                            reinterpret<2,
+                            dlib::relu<BN_CON<dlib::con<3,3,3,1,1,
+                            input_with_transpose
+                            >>>>>>>>>;
+
+    using pair_bn_net_type = pair_bn_net<sync_bn_con, sync_bn_fc>;
+    using pair_bn_anet_type = pair_bn_net<dlib::affine, dlib::affine>;
+
+    template <typename net_type>
+    std::vector<float> get_parameters(net_type& net)
+    {
+        std::vector<float> values;
+        dlib::visit_layer_parameters(net, [&](size_t, dlib::tensor& t) {
+            values.insert(values.end(), t.begin(), t.end());
+        });
+        return values;
+    }
+
+    void make_samples(
+        long nr,
+        long nc,
+        std::vector<dlib::matrix<float>>& samples,
+        std::vector<unsigned long>& labels
+    )
+    {
+        dlib::rand rnd(0);
+        samples.clear();
+        labels.clear();
+        for (int i = 0; i < 37; ++i) {
+            dlib::matrix<float> x(nr,nc);
+            for (long j = 0; j < x.size(); ++j)
+                x(j) = rnd.get_random_gaussian();
+            samples.push_back(x);
+            labels.push_back(x(0) + 0.5*x(1) > 0 ? 1 : 0);
+        }
+    }
+
+    template <typename net_type>
+    void train(
+        net_type& net,
+        unsigned long num_replicas,
+        const std::vector<dlib::matrix<float>>& samples,
+        const std::vector<unsigned long>& labels
+    )
+    {
+        data_parallel_trainer<net_type> trainer(net, num_replicas);
+        trainer.set_learning_rate(0.1);
+        for (int step = 0; step < 20; ++step)
+            trainer.train_one_step(samples.begin(), samples.end(), labels.begin());
+        DLIB_TEST(trainer.get_train_one_step_calls() == 20);
+    }
+
+    void check_close(
+        const std::vector<float>& params,
+        const std::vector<float>& expected,
+        double tolerance,
+        unsigned long num_replicas
+    )
+    {
+        DLIB_TEST(params.size() == expected.size());
+        for (size_t i = 0; i < params.size(); ++i)
+            DLIB_TEST_MSG(std::abs(params[i]-expected[i]) < tolerance, num_replicas << " replicas, parameter " << i);
+    }
+
+    class test_data_parallel : public tester {
+    public:
+        test_data_parallel() : tester("test_data_parallel",
+                                      "Runs test on the data-parallel trainer")
+        { }
+
+        void perform_test()
+        {
+            test_replicas();
+            test_batch_norm<bn_net_type, bn_anet_type>();
+            test_batch_norm<pair_bn_net_type, pair_bn_anet_type>();
+            test_dnn_trainer();
+        }
+
+        void test_replicas()
+        {
+            std::vector<dlib::matrix<float>> samples;
+            std::vector<unsigned long> labels;
+            make_samples(3, 1, samples, labels);
+
+            // Every trainer starts from the same parameters.
+            net_type initial;
+            initial(samples.front());
+
+            // Without batch normalization, splitting the minibatch across
+            // replicas only changes the rounding of the summed gradients.
+            // 37 samples cannot be split evenly, and 50 replicas leave some
+            // of them idle.
+            std::vector<float> expected;
+            for (unsigned long num_replicas : {1, 2, 3, 50}) {
+                net_type net = initial;
+                train(net, num_replicas, samples, labels);
+                const std::vector<float> params = get_parameters(net);
+                if (num_replicas == 1)
+                    expected = params;
+                else
+                    check_close(params, expected, 1e-4, num_replicas);
+            }
+        }
+
+        template <typename net_type, typename anet_type>
+        void test_batch_norm()
+        {
+            std::vector<dlib::matrix<float>> samples;
+            std::vector<unsigned long> labels;
+            make_samples(4, 4, samples, labels);
+
+            net_type initial;
+            initial(samples.front());
+
+            // Synchronized batch normalization uses the statistics of the
+            // whole minibatch, so the replicas train the same parameters as
+            // a single network. The running statistics end up in the testing
+            // net, whose affine layers are compared as well. They are not
+            // changed by the pass that sets up the replicas, even if the input
+            // layer turns its single input into several samples.
+            std::vector<float> expected;
+            std::vector<float> expected_testing;
+            for (unsigned long num_replicas : {1, 2, 3, 50}) {
+                net_type net = initial;
+                train(net, num_replicas, samples, labels);
+                anet_type anet = net;
+                const std::vector<float> params = get_parameters(net);
+                const std::vector<float> testing_params = get_parameters(anet);
+                if (num_replicas == 1) {
+                    expected = params;
+                    expected_testing = testing_params;
+                }
+                else {
+                    check_close(params, expected, 1e-3, num_replicas);
+                    check_close(testing_params, expected_testing, 1e-3, num_replicas);
+                }
+            }
+        }
+
+        void test_dnn_trainer()
+        {
+            std::vector<dlib::matrix<float>> samples;
+            std::vector<unsigned long> labels;
+            make_samples(4, 4, samples, labels);
+
+            bn_net_type initial;
+            initial(samples.front());
+
+            // A single replica takes the same steps as dlib's trainer with
+            // the same solver and learning rate.
+            bn_net_type net = initial;
+            train(net, 1, samples, labels);
+
+            bn_net_type reference = initial;
+            dlib::dnn_trainer<bn_net_type> trainer(reference, dlib::sgd());
+            trainer.set_learning_rate(0.1);
+            for (int step = 0; step < 20; ++step)
+                trainer.train_one_step(samples.begin(), samples.end(), labels.begin());
+            trainer.get_net();
+
+            bn_anet_type anet = net;
+            bn_anet_type reference_anet = reference;
+            check_close(get_parameters(net), get_parameters(reference), 1e-6, 1);
+            check_close(get_parameters(anet), get_parameters(reference_anet), 1e-6, 1);
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_data_parallel a;
+}
@@ -0,0 +1,160 @@
+#include <dataset.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#if !defined _WIN32
+#include <utime.h>
+#endif
+
+#include <dlib/rand.h>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.dataset");
+
+    std::string read_file(const std::string& filename)
+    {
+        std::ifstream fin(filename, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+    }
+
+    void write_file(const std::string& filename, const std::string& contents)
+    {
+        std::ofstream fout(filename, std::ios::binary);
+        fout.write(contents.data(), contents.size());
+    }
+
+    void patch_file(const std::string& filename, size_t offset, uint64_t value, size_t num_bytes)
+    {
+        std::fstream f(filename, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(offset);
+        f.write(reinterpret_cast<const char*>(&value), num_bytes);
+    }
+
+    class test_dataset : public tester {
+    public:
+        test_dataset() : tester("test_dataset",
+                                "Runs test on the dataset cache")
+        { }
+
+        void perform_test()
+        {
+            const std::string source_file = "test_dataset_source.mat";
+            const std::string cache_file = "test_dataset_cache.bin";
+            const std::string source_contents = "not really an HDF5 file";
+            write_file(source_file, source_contents);
+
+            // Two persons with two views each, seven images in total
+            dlib::rand rnd;
+            const long nr = 4;
+            const long nc = 3;
+            image_arena arena(nr, nc, 7);
+            for (size_t i = 0; i < arena.size(); ++i) {
+                dlib::rgb_pixel* pixels = arena.image_data(i);
+                for (long j = 0; j < nr*nc; ++j) {
+                    pixels[j].red = rnd.get_random_8bit_number();
+                    pixels[j].green = rnd.get_random_8bit_number();
+                    pixels[j].blue = rnd.get_random_8bit_number();
+                }
+            }
+            const std::vector<uint32_t> counts = {2, 1, 1, 3};
+            const std::vector<std::vector<int>> protocols = {{0, 1}, {1, 0}, {1, 1}};
+
+            auto write_cache = [&]() {
+                write_dataset_cache(cache_file, source_file, arena, counts, 2, protocols, LABELED);
+            };
+            auto rejected = [&](long read_nr, long read_nc) {
+                std::vector<person_set> images;
+                std::vector<std::vector<int>> test_protocols;
+                const bool read = read_dataset_cache(cache_file, source_file, images, test_protocols,
+                                                     LABELED, read_nr, read_nc);
+                return !read && images.empty() && test_protocols.empty();
+            };
+
+            // The pixels and the test protocols survive the round trip.
+            write_cache();
+            {
+                std::vector<person_set> images;
+                std::vector<std::vector<int>> test_protocols;
+                DLIB_TEST(read_dataset_cache(cache_file, source_file, images, test_protocols, LABELED, nr, nc));
+                DLIB_TEST(test_protocols == protocols);
+                DLIB_TEST(images.size() == 2);
+
+                size_t i = 0;
+                for (size_t p = 0; p < images.size(); ++p) {
+                    DLIB_TEST(images[p].get_num_views() == 2);
+                    for (unsigned int v = 0; v < 2; ++v) {
+                        DLIB_TEST(images[p].view(v).size() == counts[2*p+v]);
+                        for (const rgb_image_view& img : images[p].view(v)) {
+                            DLIB_TEST(img.nr() == nr && img.nc() == nc);
+                            const dlib::rgb_pixel* expected = arena.image(i).data();
+                            for (long j = 0; j < nr*nc; ++j) {
+                                DLIB_TEST(img.data()[j].red == expected[j].red &&
+                                          img.data()[j].green == expected[j].green &&
+                                          img.data()[j].blue == expected[j].blue);
+                            }
+                            ++i;
+                        }
+                    }
+                }
+                DLIB_TEST(i == arena.size());
+            }
+
+            // A different magic or version. The magic takes the first 8
+            // bytes of the header, followed by the 4 byte version.
+            patch_file(cache_file, 0, 'X', 1);
+            DLIB_TEST(rejected(nr, nc));
+            write_cache();
+            patch_file(cache_file, 8, 2, 4);
+            DLIB_TEST(rejected(nr, nc));
+
+            // A different image size
+            write_cache();
+            DLIB_TEST(rejected(nr+1, nc));
+            DLIB_TEST(rejected(nr, nc+1));
+
+            // A source file of a different size
+            write_file(source_file, source_contents + "!");
+            DLIB_TEST(rejected(nr, nc));
+            write_file(source_file, source_contents);
+
+#if !defined _WIN32
+            // A source file with a different modification time
+            write_cache();
+            utimbuf times;
+            times.actime = 1000000000;
+            times.modtime = 1000000000;
+            DLIB_TEST(utime(source_file.c_str(), &times) == 0);
+            DLIB_TEST(rejected(nr, nc));
+#endif
+
+            // A truncated cache
+            write_cache();
+            const std::string cache_contents = read_file(cache_file);
+            write_file(cache_file, cache_contents.substr(0, cache_contents.size()-1));
+            DLIB_TEST(rejected(nr, nc));
+
+            // A corrupt person count, whose size would overflow. It follows
+            // the 8 byte magic, four 4 byte fields and four 8 byte fields.
+            write_file(cache_file, cache_contents);
+            patch_file(cache_file, 8+4*4+4*8, uint64_t(1) << 62, 8);
+            DLIB_TEST(rejected(nr, nc));
+
+            std::remove(cache_file.c_str());
+            std::remove(source_file.c_str());
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_dataset a;
+}
@@ -3,6 +3,7 @@
 #include <utility>
 
 #include <dlib/dnn.h>
+#include <dlib/rand.h>
 
 #include "input_test.h"
 #include "dlib_testing_suite/tester.h"
@@ -113,6 +114,53 @@ namespace
 
             dlib::matrix<float,3,3> netgrad2 = dlib::reshape(dlib::rowm(grad_mat, 1), 3, 3);
             DLIB_TEST(dlib::sum(grad2-netgrad2) <= 1e-4);
+
+#ifndef DLIB_USE_CUDA
+            // ======================== //
+            //  SIMD CONSISTENCY CHECK  //
+            // ======================== //
+            const unsigned long default_threads = get_differencing_num_threads();
+            set_differencing_num_threads(1);
+            dlib::rand rnd;
+            dlib::resizable_tensor x, gx;
+            x.set_size(4, 3, 7, 9);
+            gx.set_size(4, 3, 5*7, 5*9);
+            for (float& v : x) v = rnd.get_random_gaussian();
+            for (float& v : gx) v = rnd.get_random_gaussian();
+
+            const cpu_simd_level default_level = get_differencing_simd_level();
+            dlib::resizable_tensor scalar_out, simd_out, scalar_grad, simd_grad;
+            scalar_out.copy_size(gx);
+            simd_out.copy_size(gx);
+            scalar_grad.copy_size(x);
+            simd_grad.copy_size(x);
+
+            set_differencing_simd_level(cpu_simd_level::SCALAR);
+            perform_cross_neighborhood_differencing(x, scalar_out, dlib::vector<long,2>(5, 5));
+            backpropagate_differencing_gradient(gx, scalar_grad);
+
+            set_differencing_simd_level(default_level);
+            perform_cross_neighborhood_differencing(x, simd_out, dlib::vector<long,2>(5, 5));
+            backpropagate_differencing_gradient(gx, simd_grad);
+
+            DLIB_TEST(dlib::max(dlib::abs(dlib::mat(scalar_out)-dlib::mat(simd_out))) <= 1e-5);
+            DLIB_TEST(dlib::max(dlib::abs(dlib::mat(scalar_grad)-dlib::mat(simd_grad))) <= 1e-4);
+
+            // ========================== //
+            //  THREAD DETERMINISM CHECK  //
+            // ========================== //
+            dlib::resizable_tensor threaded_out, threaded_grad;
+            threaded_out.copy_size(gx);
+            threaded_grad.copy_size(x);
+
+            set_differencing_num_threads(4);
+            perform_cross_neighborhood_differencing(x, threaded_out, dlib::vector<long,2>(5, 5));
+            backpropagate_differencing_gradient(gx, threaded_grad);
+            set_differencing_num_threads(default_threads);
+
+            DLIB_TEST(dlib::max(dlib::abs(dlib::mat(threaded_out)-dlib::mat(simd_out))) == 0);
+            DLIB_TEST(dlib::max(dlib::abs(dlib::mat(threaded_grad)-dlib::mat(simd_grad))) == 0);
+#endif
         }
     };
 
@@ -0,0 +1,60 @@
+#include <difference.h>
+
+#include <dlib/dnn.h>
+#include <dlib/rand.h>
+
+#include "input_test.h"
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.difference_relu");
+
+    class test_difference_relu : public tester {
+    public:
+        test_difference_relu() : tester("test_difference_relu",
+                                        "Runs test on fused cross neighborhood differences and relu layer")
+        { }
+
+        void perform_test()
+        {
+            using fused_net_type = cross_neighborhood_differences_relu<3,3,input_test>;
+            using net_type = dlib::relu<cross_neighborhood_differences<3,3,input_test>>;
+            fused_net_type fused_net;
+            net_type net;
+
+            dlib::rand rnd;
+            dlib::resizable_tensor input_tensor;
+            input_tensor.set_size(4, 2, 5, 6);
+            for (float& v : input_tensor) v = rnd.get_random_gaussian();
+
+            // =============== //
+            //  FORWARD CHECK  //
+            // =============== //
+            dlib::matrix<float> fused_output = dlib::mat(fused_net.forward(input_tensor));
+            dlib::matrix<float> output = dlib::mat(net.forward(input_tensor));
+            DLIB_TEST(dlib::max(dlib::abs(fused_output-output)) <= 1e-6);
+            DLIB_TEST(dlib::min(fused_output) >= 0);
+
+            // ================ //
+            //  GRADIENT CHECK  //
+            // ================ //
+            dlib::resizable_tensor gradient_input;
+            gradient_input.set_size(4, 2, 15, 18);
+            for (float& v : gradient_input) v = rnd.get_random_gaussian();
+
+            fused_net.back_propagate_error(input_tensor, gradient_input);
+            net.back_propagate_error(input_tensor, gradient_input);
+
+            dlib::matrix<float> fused_grad = dlib::mat(fused_net.get_final_data_gradient());
+            dlib::matrix<float> grad = dlib::mat(net.get_final_data_gradient());
+            DLIB_TEST(dlib::max(dlib::abs(fused_grad-grad)) <= 1e-4);
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_difference_relu a;
+}
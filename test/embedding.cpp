@@ -0,0 +1,155 @@
+#include <embedding.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <dlib/dnn.h>
+#include <dlib/rand.h>
+
+#include <cascade_scorer.h>
+#include <gallery_scorer.h>
+#include <input.h>
+#include <patch_summary.h>
+#include <reinterpret.h>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.embedding");
+
+    using head_type = dlib::softmax<dlib::fc<2,
+                      reinterpret<2,
+                      cross_neighborhood_patch_summary<4,3,3,
+                      input_feature_maps
+                      >>>>;
+
+    feature_map random_map(dlib::rand& rnd, long k, long nr, long nc)
+    {
+        feature_map fmap;
+        fmap.k = k;
+        fmap.nr = nr;
+        fmap.nc = nc;
+        fmap.values.resize(k*nr*nc);
+        for (float& v : fmap.values) v = rnd.get_random_gaussian();
+        return fmap;
+    }
+
+    class test_embedding : public tester {
+    public:
+        test_embedding() : tester("test_embedding",
+                                  "Runs test on pooled embeddings and cascade scoring")
+        { }
+
+        void perform_test()
+        {
+            test_pooled_embedding();
+            test_index();
+            test_cascade();
+        }
+
+        void test_pooled_embedding()
+        {
+            feature_map fmap;
+            fmap.k = 2;
+            fmap.nr = 1;
+            fmap.nc = 2;
+            fmap.values = {1, 5, 4, 4};
+            const std::vector<float> embedding = pooled_embedding(fmap);
+            DLIB_TEST(embedding.size() == 2);
+            DLIB_TEST(std::abs(embedding[0] - 0.6f) < 1e-6);
+            DLIB_TEST(std::abs(embedding[1] - 0.8f) < 1e-6);
+
+            fmap.values.assign(4, 0);
+            DLIB_TEST(pooled_embedding(fmap) == std::vector<float>(2, 0));
+        }
+
+        void test_index()
+        {
+            // Dimensions around the SSE block size compare equal to the
+            // scalar dot product.
+            dlib::rand rnd;
+            for (long dim = 1; dim <= 19; ++dim) {
+                embedding_index index;
+                std::vector<std::vector<float>> items;
+                for (int i = 0; i < 30; ++i) {
+                    items.push_back(pooled_embedding(random_map(rnd, dim, 2, 3)));
+                    index.add(items.back());
+                }
+                DLIB_TEST(index.size() == items.size() && index.dimension() == static_cast<size_t>(dim));
+
+                const std::vector<float> query = pooled_embedding(random_map(rnd, dim, 2, 3));
+                std::vector<float> sims;
+                index.similarities(query, sims);
+                DLIB_TEST(sims.size() == items.size());
+                for (size_t i = 0; i < items.size(); ++i) {
+                    double expected = 0;
+                    for (long c = 0; c < dim; ++c)
+                        expected += query[c]*items[i][c];
+                    DLIB_TEST(std::abs(sims[i] - expected) < 1e-5);
+                }
+
+                std::vector<float> nearest_sims;
+                const std::vector<size_t> nearest = index.nearest(query, 5, nearest_sims);
+                DLIB_TEST(nearest_sims == sims);
+                DLIB_TEST(nearest.size() == 5);
+                std::vector<float> sorted = sims;
+                std::sort(sorted.rbegin(), sorted.rend());
+                for (size_t i = 0; i < nearest.size(); ++i)
+                    DLIB_TEST(sims[nearest[i]] == sorted[i]);
+
+                DLIB_TEST(index.nearest(query, 100, nearest_sims).size() == items.size());
+            }
+        }
+
+        void test_cascade()
+        {
+            dlib::rand rnd;
+            std::vector<feature_map> maps;
+            for (int i = 0; i < 8; ++i)
+                maps.push_back(random_map(rnd, 2, 5, 6));
+            const std::vector<const feature_map*> probes = {&maps[0], &maps[1]};
+            const std::vector<const feature_map*> gallery = {&maps[2], &maps[3], &maps[4], &maps[5], &maps[6], &maps[7]};
+            embedding_index index;
+            for (const feature_map* fmap : gallery)
+                index.add(pooled_embedding(*fmap));
+
+            head_type head;
+            dlib::layer<3>(head).layer_details().set_broadcast(true);
+            gallery_scorer<head_type> scorer(head);
+            std::vector<float> expected;
+            scorer.score(probes, gallery, expected);
+
+            // Reranking the whole gallery gives the scores of the head.
+            cascade_scorer<head_type> full(head, index, 100);
+            std::vector<float> scores;
+            full.score(probes, gallery, scores);
+            DLIB_TEST(scores.size() == expected.size());
+            for (size_t i = 0; i < scores.size(); ++i)
+                DLIB_TEST(std::abs(scores[i] - expected[i]) < 1e-5);
+
+            // Otherwise only the k closest gallery images are reranked, and
+            // the others keep their similarity below all head scores.
+            cascade_scorer<head_type> cascade(head, index, 2);
+            cascade.score(probes, gallery, scores);
+            for (size_t p = 0; p < probes.size(); ++p) {
+                std::vector<float> sims;
+                const std::vector<size_t> candidates = index.nearest(pooled_embedding(*probes[p]), 2, sims);
+                for (size_t g = 0; g < gallery.size(); ++g) {
+                    const float score = scores[p*gallery.size()+g];
+                    if (std::find(candidates.begin(), candidates.end(), g) != candidates.end())
+                        DLIB_TEST(std::abs(score - expected[p*gallery.size()+g]) < 1e-5);
+                    else
+                        DLIB_TEST(score == sims[g] - 2 && score < 0);
+                }
+            }
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_embedding a;
+}
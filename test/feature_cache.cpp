@@ -0,0 +1,131 @@
+#include <feature_cache.h>
+
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+#include <dlib/dnn.h>
+#include <dlib/rand.h>
+
+#include <difference.h>
+#include <input.h>
+#include <layer_timing.h>
+#include <patch_summary.h>
+#include <replica_pool.h>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.feature_cache");
+
+    template <typename SUBNET>
+    using tower = dlib::relu<dlib::con<4,3,3,1,1,SUBNET>>;
+
+    // A small version of the CUHK03 testing net and of the head that runs
+    // on its cached tower outputs.
+    using testing_net_type = dlib::softmax<dlib::fc<2,
+                             dlib::relu<dlib::affine<
+                             dlib::add_layer<dlib::con_<5,3,3,3,3,0,0>,
+                             cross_neighborhood_differences_relu<3,3,
+                             tower<input_rgb_image_pair>
+                             >>>>>>;
+
+    using head_type = dlib::softmax<dlib::fc<2,
+                      dlib::relu<dlib::affine<
+                      cross_neighborhood_patch_summary<5,3,3,
+                      input_feature_maps
+                      >>>>>;
+
+    // The same with every layer timed, as in run_cuhk03 with layer timing
+    // enabled. Used directly, since timed_net only adds timing if
+    // IDLA_LAYER_TIMING is defined.
+    using timed_testing_net_type = layer_timing_impl::time_all_layers<testing_net_type>::type;
+    using timed_head_type = layer_timing_impl::time_all_layers<head_type>::type;
+
+    class test_feature_cache : public tester {
+    public:
+        test_feature_cache() : tester("test_feature_cache",
+                                      "Runs test on the tower feature cache and the inference head")
+        { }
+
+        void perform_test()
+        {
+            test_cache_and_head<testing_net_type, head_type>();
+            test_cache_and_head<timed_testing_net_type, timed_head_type>();
+        }
+
+        template <typename tnet_type, typename hnet_type>
+        void test_cache_and_head()
+        {
+            dlib::rand rnd;
+            std::vector<dlib::matrix<dlib::rgb_pixel>> imgs(5);
+            for (auto& img : imgs) {
+                img.set_size(8, 6);
+                for (auto& p : img) {
+                    p.red = rnd.get_random_8bit_number();
+                    p.green = rnd.get_random_8bit_number();
+                    p.blue = rnd.get_random_8bit_number();
+                }
+            }
+            std::vector<rgb_image_view> views(imgs.begin(), imgs.end());
+
+            // Set up the testing net before its tower is copied.
+            tnet_type tnet;
+            std::vector<input_rgb_image_pair::input_type> setup = {{&views[0], &views[1]}};
+            tnet(setup.begin(), setup.end());
+
+            auto& tower_net = dlib::layer<hnet_type::num_computational_layers+1>(tnet);
+            typedef typename std::remove_reference<decltype(tower_net)>::type tower_type;
+            replica_pool<tower_type> towers(tower_net, 2);
+
+            // Duplicates are only run once. With two images per batch, the
+            // five images leave an odd one out, which is paired with itself.
+            feature_cache fcache;
+            fcache.add(towers, {&views[0], &views[1], &views[2], &views[0], &views[3], &views[4], &views[1]}, 1);
+            DLIB_TEST(fcache.size() == 5);
+
+            // Every feature map is that of the image in a pair of its own.
+            for (const rgb_image_view& view : views) {
+                DLIB_TEST(fcache.contains(&view));
+                std::vector<input_rgb_image_pair::input_type> pair = {{&view, &view}};
+                const dlib::tensor& out = tower_net(pair.begin(), pair.end());
+                const feature_map& fmap = fcache.get(&view);
+                DLIB_TEST(fmap.k == out.k() && fmap.nr == out.nr() && fmap.nc == out.nc());
+                DLIB_TEST(fmap.values.size() == static_cast<size_t>(out.k()*out.nr()*out.nc()));
+                for (size_t i = 0; i < fmap.values.size(); ++i)
+                    DLIB_TEST(std::abs(fmap.values[i] - out.host()[i]) < 1e-5);
+            }
+
+            // Images that are already cached are not run again.
+            const std::vector<float> first = fcache.get(&views[0]).values;
+            fcache.add(towers, {&views[0], &views[4]});
+            DLIB_TEST(fcache.size() == 5);
+            DLIB_TEST(fcache.get(&views[0]).values == first);
+
+            // The head scores the cached features of a probe and the gallery
+            // like the testing net scores the image pairs.
+            hnet_type hnet;
+            load_head(hnet, tnet, fcache.get(&views[0]));
+            for (size_t p = 0; p < views.size(); ++p) {
+                std::vector<const feature_map*> feats = {&fcache.get(&views[p])};
+                for (const rgb_image_view& view : views)
+                    feats.push_back(&fcache.get(&view));
+                const dlib::matrix<float> scores = dlib::mat(hnet(feats.begin(), feats.end()));
+                DLIB_TEST(scores.nr() == static_cast<long>(views.size()) && scores.nc() == 2);
+
+                for (size_t g = 0; g < views.size(); ++g) {
+                    std::vector<input_rgb_image_pair::input_type> pair = {{&views[p], &views[g]}};
+                    const float expected = dlib::mat(tnet(pair.begin(), pair.end()))(0, 1);
+                    DLIB_TEST_MSG(std::abs(scores(g, 1) - expected) < 1e-4, "probe " << p << ", gallery " << g);
+                }
+            }
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_feature_cache a;
+}
@@ -0,0 +1,77 @@
+#include <gallery_scorer.h>
+
+#include <cmath>
+#include <vector>
+
+#include <dlib/dnn.h>
+#include <dlib/rand.h>
+
+#include <input.h>
+#include <patch_summary.h>
+#include <reinterpret.h>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.gallery_scorer");
+
+    using head_type = dlib::softmax<dlib::fc<2,
+                      reinterpret<2,
+                      cross_neighborhood_patch_summary<4,3,3,
+                      input_feature_maps
+                      >>>>;
+
+    class test_gallery_scorer : public tester {
+    public:
+        test_gallery_scorer() : tester("test_gallery_scorer",
+                                       "Runs test on the batched gallery scorer")
+        { }
+
+        void perform_test()
+        {
+            dlib::rand rnd;
+            std::vector<feature_map> maps(7);
+            for (feature_map& fmap : maps) {
+                fmap.k = 2;
+                fmap.nr = 5;
+                fmap.nc = 6;
+                fmap.values.resize(fmap.k*fmap.nr*fmap.nc);
+                for (float& v : fmap.values) v = rnd.get_random_gaussian();
+            }
+            const std::vector<const feature_map*> probes = {&maps[0], &maps[1]};
+            const std::vector<const feature_map*> gallery = {&maps[2], &maps[3], &maps[4], &maps[5], &maps[6]};
+
+            head_type head;
+            dlib::layer<3>(head).layer_details().set_broadcast(true);
+
+            // Batches of 2 split each probe's gallery unevenly, and every
+            // score must match that of the pair on its own.
+            for (unsigned long batch_size : {1, 2, 5, 64}) {
+                gallery_scorer<head_type> scorer(head, batch_size);
+                std::vector<float> scores;
+                scorer.score(probes, gallery, scores);
+                DLIB_TEST(scores.size() == probes.size()*gallery.size());
+
+                for (size_t p = 0; p < probes.size(); ++p) {
+                    for (size_t g = 0; g < gallery.size(); ++g) {
+                        std::vector<const feature_map*> pair = {probes[p], gallery[g]};
+                        const float expected = dlib::mat(head(pair.begin(), pair.end()))(0, 1);
+                        DLIB_TEST(std::abs(scores[p*gallery.size()+g] - expected) < 1e-5);
+                    }
+                }
+            }
+
+            gallery_scorer<head_type> scorer(head);
+            std::vector<float> scores(3);
+            scorer.score(probes, std::vector<const feature_map*>(), scores);
+            DLIB_TEST(scores.empty());
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_gallery_scorer a;
+}
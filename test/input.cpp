@@ -0,0 +1,162 @@
+#include <input.h>
+
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <dlib/dnn.h>
+#include <dlib/rand.h>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.input");
+
+    // Hands out the pixels of a set of images as if they were loaded on demand
+    class matrix_source : public image_source {
+    public:
+        matrix_source(const std::vector<dlib::matrix<dlib::rgb_pixel>>& imgs_) : imgs(imgs_) { }
+
+        std::shared_ptr<const dlib::rgb_pixel> load(size_t index) const override
+        {
+            ++num_loads;
+            auto copy = std::make_shared<dlib::matrix<dlib::rgb_pixel>>(imgs[index]);
+            return std::shared_ptr<const dlib::rgb_pixel>(copy, &(*copy)(0,0));
+        }
+
+        mutable std::atomic<unsigned long> num_loads{0};
+    private:
+        const std::vector<dlib::matrix<dlib::rgb_pixel>>& imgs;
+    };
+
+    // Checks that values holds the red, green and blue planes of img, each
+    // value v mapped to (v - mean)/(stddev + 1e-7) with the statistics of
+    // all of img's values.
+    void check_normalized(const float* values, const rgb_image_view& img)
+    {
+        const long n = 3*img.size();
+        const std::shared_ptr<const dlib::rgb_pixel> pixels = img.pixels();
+        const unsigned char* src = &pixels->red;
+        double mean = 0;
+        for (long i = 0; i < n; ++i)
+            mean += src[i];
+        mean /= n;
+        double variance = 0;
+        for (long i = 0; i < n; ++i)
+            variance += (src[i]-mean)*(src[i]-mean);
+        variance = (n > 1) ? variance/(n-1) : 0;
+        const double stddev = std::sqrt(variance);
+
+        for (long c = 0; c < 3; ++c) {
+            for (long j = 0; j < img.size(); ++j) {
+                const double expected = (src[3*j+c] - mean)/(stddev + 1e-7);
+                DLIB_TEST_MSG(std::abs(values[c*img.size()+j] - expected) < 1e-4,
+                              img.nr() << "x" << img.nc() << " image, channel " << c << ", pixel " << j);
+            }
+        }
+    }
+
+    class test_input : public tester {
+    public:
+        test_input() : tester("test_input",
+                              "Runs test on image pair input layer")
+        { }
+
+        void perform_test()
+        {
+            test_normalize_image();
+            test_pair_input();
+        }
+
+        void test_normalize_image()
+        {
+            // The SIMD loop handles 32 pixels at a time, so these sizes run
+            // only the scalar tail, only the loop, or both.
+            dlib::rand rnd;
+            for (auto size : {std::make_pair(1, 1), std::make_pair(3, 5), std::make_pair(4, 8),
+                              std::make_pair(7, 5), std::make_pair(16, 6), std::make_pair(9, 11)}) {
+                dlib::matrix<dlib::rgb_pixel> img(size.first, size.second);
+                for (auto& p : img) {
+                    p.red = rnd.get_random_8bit_number();
+                    p.green = rnd.get_random_8bit_number();
+                    p.blue = rnd.get_random_8bit_number();
+                }
+                const rgb_image_view view(img);
+                std::vector<float> values(3*view.size());
+                normalize_image(view, values.data());
+                check_normalized(values.data(), view);
+            }
+        }
+
+        void test_pair_input()
+        {
+            dlib::rand rnd;
+            std::vector<dlib::matrix<dlib::rgb_pixel>> imgs(4);
+            for (auto& img : imgs) {
+                img.set_size(7, 5);
+                for (auto& p : img) {
+                    p.red = rnd.get_random_8bit_number();
+                    p.green = rnd.get_random_8bit_number();
+                    p.blue = rnd.get_random_8bit_number();
+                }
+            }
+
+            std::vector<rgb_image_view> views(imgs.begin(), imgs.end());
+            std::vector<input_rgb_image_pair::input_type> pairs = {
+                {&views[0], &views[1]}, {&views[2], &views[3]}, {&views[3], &views[0]}
+            };
+
+            input_rgb_image_pair input;
+            dlib::resizable_tensor expected;
+            input.to_tensor(pairs.begin(), pairs.end(), expected);
+            DLIB_TEST(expected.num_samples() == 6 && expected.k() == 3 &&
+                      expected.nr() == 7 && expected.nc() == 5);
+
+            // Each sample holds the planes of its image, normalized over all
+            // of its channels.
+            for (size_t i = 0; i < pairs.size(); ++i) {
+                check_normalized(expected.host() + (2*i)*3*7*5, *pairs[i].first);
+                check_normalized(expected.host() + (2*i+1)*3*7*5, *pairs[i].second);
+            }
+
+            // Cached images are copied and uncached ones are still normalized,
+            // both giving the same tensor.
+            auto cache = std::make_shared<normalized_image_cache>();
+            cache->add(views[0]);
+            cache->add(views[2]);
+            cache->add(views[2]);
+            DLIB_TEST(cache->size() == 2);
+            DLIB_TEST(cache->get(&views[1]) == nullptr);
+
+            input.set_image_cache(cache);
+            dlib::resizable_tensor cached;
+            input.to_tensor(pairs.begin(), pairs.end(), cached);
+            DLIB_TEST(dlib::max(dlib::abs(dlib::mat(cached)-dlib::mat(expected))) == 0);
+
+            // Images that are not resident are loaded from their source.
+            matrix_source source(imgs);
+            std::vector<rgb_image_view> lazy_views;
+            for (unsigned long i = 0; i < imgs.size(); ++i)
+                lazy_views.emplace_back(&source, i, 7, 5);
+            DLIB_TEST(!lazy_views[0].is_resident() && views[0].is_resident());
+
+            std::vector<input_rgb_image_pair::input_type> lazy_pairs = {
+                {&lazy_views[0], &lazy_views[1]}, {&lazy_views[2], &lazy_views[3]}, {&lazy_views[3], &lazy_views[0]}
+            };
+            input.set_image_cache(nullptr);
+            dlib::resizable_tensor loaded;
+            input.to_tensor(lazy_pairs.begin(), lazy_pairs.end(), loaded);
+            DLIB_TEST(source.num_loads == 6);
+            DLIB_TEST(dlib::max(dlib::abs(dlib::mat(loaded)-dlib::mat(expected))) == 0);
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_input a;
+}
@@ -0,0 +1,92 @@
+#include <layer_timing.h>
+
+#include <sstream>
+#include <vector>
+
+#include <dlib/dnn.h>
+#include <dlib/rand.h>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.layer_timing");
+
+    using plain_net_type = dlib::loss_multiclass_log<
+                               dlib::fc<2,
+                               dlib::relu<dlib::fc<5,
+                               dlib::input<dlib::matrix<float>>
+                               >>>>;
+
+    // Used directly, since timed_net only adds timing if IDLA_LAYER_TIMING
+    // is defined.
+    using timed_net_type = layer_timing_impl::time_all_layers<plain_net_type>::type;
+
+    class test_layer_timing : public tester {
+    public:
+        test_layer_timing() : tester("test_layer_timing",
+                                     "Runs test on the layer timing wrapper")
+        { }
+
+        void perform_test()
+        {
+            dlib::rand rnd(0);
+            std::vector<dlib::matrix<float>> samples;
+            std::vector<unsigned long> labels;
+            for (int i = 0; i < 16; ++i) {
+                dlib::matrix<float> x(3,1);
+                for (long j = 0; j < x.size(); ++j)
+                    x(j) = rnd.get_random_gaussian();
+                samples.push_back(x);
+                labels.push_back(i % 2);
+            }
+
+            // Timed networks read the files of untimed ones and compute the
+            // same outputs. relu runs in place in both.
+            plain_net_type plain;
+            plain(samples.front());
+            std::ostringstream sout;
+            dlib::serialize(plain, sout);
+
+            timed_net_type timed;
+            std::istringstream sin(sout.str());
+            dlib::deserialize(timed, sin);
+
+            const std::vector<unsigned long> expected = plain(samples);
+            DLIB_TEST(timed(samples) == expected);
+
+            // One forward call per layer so far, and one of each per step.
+            reset_layer_timings();
+            dlib::sgd solver;
+            dlib::dnn_trainer<timed_net_type> trainer(timed, solver);
+            for (int step = 0; step < 3; ++step)
+                trainer.train_one_step(samples, labels);
+            trainer.get_net();
+
+            const std::vector<layer_timing_summary> timings = get_layer_timings();
+            DLIB_TEST(timings.size() == 3);
+            long num_outputs = 0;
+            for (const layer_timing_summary& t : timings) {
+                DLIB_TEST(t.forward_calls == 3);
+                DLIB_TEST(t.backward_calls == 3);
+                DLIB_TEST(t.average_samples == samples.size());
+                DLIB_TEST(t.nr == 1 && t.nc == 1);
+                num_outputs += t.k;
+            }
+            DLIB_TEST(num_outputs == 2+5+5);
+
+            std::ostringstream report;
+            print_layer_timings(report);
+            DLIB_TEST(report.str().find("relu") != std::string::npos);
+
+            reset_layer_timings();
+            DLIB_TEST(get_layer_timings().empty());
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_layer_timing a;
+}
@@ -0,0 +1,50 @@
+#include <patch_summary.h>
+#include <difference.h>
+
+#include <dlib/dnn.h>
+#include <dlib/rand.h>
+
+#include "input_test.h"
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.patch_summary");
+
+    class test_patch_summary : public tester {
+    public:
+        test_patch_summary() : tester("test_patch_summary",
+                                      "Runs test on fused cross neighborhood differences and patch summary layer")
+        { }
+
+        void perform_test()
+        {
+            using fused_net_type = cross_neighborhood_patch_summary<4,3,3,input_test>;
+            using net_type = dlib::add_layer<dlib::con_<4,3,3,3,3,0,0>,
+                                             cross_neighborhood_differences_relu<3,3,input_test>>;
+            fused_net_type fused_net;
+            net_type net;
+
+            dlib::rand rnd;
+            dlib::resizable_tensor input_tensor;
+            input_tensor.set_size(4, 2, 5, 6);
+            for (float& v : input_tensor) v = rnd.get_random_gaussian();
+
+            // Set up both networks and give them the same filters
+            dlib::matrix<float> output = dlib::mat(net.forward(input_tensor));
+            fused_net.forward(input_tensor);
+            fused_net.layer_details().set_filters(net.layer_details().get_layer_params());
+
+            dlib::resizable_tensor fused_output = fused_net.forward(input_tensor);
+            DLIB_TEST(fused_output.num_samples() == 4 && fused_output.k() == 4 &&
+                      fused_output.nr() == 5 && fused_output.nc() == 6);
+            DLIB_TEST(dlib::max(dlib::abs(dlib::mat(fused_output)-output)) <= 1e-4);
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_patch_summary a;
+}
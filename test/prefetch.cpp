@@ -0,0 +1,84 @@
+#include <prefetch.h>
+
+#include <stdexcept>
+#include <vector>
+
+#include <dlib/rand.h>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.prefetch");
+
+    class test_prefetch : public tester {
+    public:
+        test_prefetch() : tester("test_prefetch",
+                                 "Runs test on the background prefetcher")
+        { }
+
+        void perform_test()
+        {
+            // Items come out in the order of their index, with item i made by
+            // worker i % num_workers.
+            for (size_t num_workers = 1; num_workers <= 3; ++num_workers) {
+                prefetcher<std::pair<size_t,unsigned long>> items(num_workers, 2, [](size_t w) {
+                    auto count = std::make_shared<unsigned long>(0);
+                    return [w, count]() { return std::make_pair(w, (*count)++); };
+                });
+                DLIB_TEST(items.num_workers() == num_workers);
+
+                for (unsigned long i = 0; i < 20; ++i) {
+                    std::pair<size_t,unsigned long> item = items.get();
+                    DLIB_TEST(item.first == i % num_workers);
+                    DLIB_TEST(item.second == i / num_workers);
+                }
+            }
+
+            // Workers with the same seeds produce the same sequence.
+            auto make_sequence = []() {
+                prefetcher<unsigned long> numbers(2, 3, [](size_t w) {
+                    auto rnd = std::make_shared<dlib::rand>(w);
+                    return [rnd]() { return rnd->get_random_32bit_number(); };
+                });
+                std::vector<unsigned long> sequence;
+                for (int i = 0; i < 10; ++i)
+                    sequence.push_back(numbers.get());
+                return sequence;
+            };
+            DLIB_TEST(make_sequence() == make_sequence());
+
+            // Items made before a producer fails are still handed out, after
+            // which the failure is rethrown.
+            prefetcher<int> failing(1, 4, [](size_t) {
+                auto count = std::make_shared<int>(0);
+                return [count]() {
+                    if (*count == 3)
+                        throw std::runtime_error("producer failed");
+                    return (*count)++;
+                };
+            });
+            for (int i = 0; i < 3; ++i)
+                DLIB_TEST(failing.get() == i);
+            DLIB_TEST_MSG(throws_runtime_error([&]() { failing.get(); }), "");
+        }
+
+        template <typename F>
+        static bool throws_runtime_error(F f)
+        {
+            try {
+                f();
+            }
+            catch (std::runtime_error&) {
+                return true;
+            }
+            return false;
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_prefetch a;
+}
@@ -1,6 +1,9 @@
 #include <reinterpret.h>
 
+#include <algorithm>
+
 #include <dlib/dnn.h>
+#include <dlib/rand.h>
 
 #include "input_test.h"
 #include "dlib_testing_suite/tester.h"
@@ -31,6 +34,36 @@ namespace
             std::pair<dlib::matrix<float>*,dlib::matrix<float>*> img_pair = {&img1, &img2};
             dlib::resizable_tensor output = net(img_pair);
             DLIB_TEST(output.num_samples() == 1 && output.k() == 2);
+
+            dlib::rand rnd;
+            dlib::resizable_tensor input_tensor;
+            input_tensor.set_size(4, 3, 2, 5);
+            for (float& v : input_tensor) v = rnd.get_random_gaussian();
+            dlib::resizable_tensor gradient_input;
+            gradient_input.set_size(2, 6, 2, 5);
+            for (float& v : gradient_input) v = rnd.get_random_gaussian();
+
+            // The values and gradients are copied unchanged.
+            check_values(net, input_tensor, gradient_input);
+        }
+
+        template <typename net_type>
+        void check_values(
+            net_type& net,
+            const dlib::resizable_tensor& input_tensor,
+            const dlib::resizable_tensor& gradient_input
+        )
+        {
+            const dlib::tensor& output = net.forward(input_tensor);
+            DLIB_TEST(output.num_samples() == 2 && output.k() == 6 &&
+                      output.nr() == 2 && output.nc() == 5);
+            DLIB_TEST(std::equal(input_tensor.begin(), input_tensor.end(), output.begin()));
+
+            net.back_propagate_error(input_tensor, gradient_input);
+            const dlib::tensor& grad = net.get_final_data_gradient();
+            DLIB_TEST(grad.num_samples() == 4 && grad.k() == 3 &&
+                      grad.nr() == 2 && grad.nc() == 5);
+            DLIB_TEST(std::equal(gradient_input.begin(), gradient_input.end(), grad.begin()));
         }
     };
 
@@ -0,0 +1,82 @@
+#include <replica_pool.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.replica_pool");
+
+    // Stands in for a network; counts how many threads are using it.
+    struct fake_net {
+        fake_net() = default;
+        fake_net(const fake_net& item) : value(item.value) { }
+
+        int value = 0;
+        std::atomic<int> users{0};
+    };
+
+    class test_replica_pool : public tester {
+    public:
+        test_replica_pool() : tester("test_replica_pool",
+                                     "Runs test on the pool of network replicas")
+        { }
+
+        void perform_test()
+        {
+            fake_net net;
+            net.value = 7;
+
+            for (size_t num_replicas = 1; num_replicas <= 4; ++num_replicas) {
+                replica_pool<fake_net> pool(net, num_replicas);
+                DLIB_TEST(pool.size() == num_replicas);
+                for (size_t w = 0; w < pool.size(); ++w)
+                    DLIB_TEST(pool[w].value == 7 && &pool[w] != &net);
+
+                // Every index is visited exactly once, and a replica is never
+                // used by two threads at the same time.
+                std::vector<std::atomic<int>> visits(1000);
+                std::atomic<bool> shared(false);
+                pool.parallel_for(0, visits.size(), [&](size_t w, long i) {
+                    DLIB_TEST(w < num_replicas);
+                    if (pool[w].users++ != 0)
+                        shared = true;
+                    ++visits[i];
+                    std::this_thread::yield();
+                    --pool[w].users;
+                });
+                DLIB_TEST(!shared);
+                for (const std::atomic<int>& v : visits)
+                    DLIB_TEST(v == 1);
+
+                // Empty ranges do nothing.
+                int calls = 0;
+                pool.parallel_for(5, 5, [&](size_t, long) { ++calls; });
+                DLIB_TEST(calls == 0);
+
+                // The first failure is rethrown after all threads stopped.
+                bool thrown = false;
+                try {
+                    pool.parallel_for(0, 100, [&](size_t, long i) {
+                        if (i == 42)
+                            throw std::runtime_error("index failed");
+                    });
+                }
+                catch (std::runtime_error&) {
+                    thrown = true;
+                }
+                DLIB_TEST(thrown);
+            }
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_replica_pool a;
+}
@@ -0,0 +1,100 @@
+#include <score_matrix.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.score_matrix");
+
+    class test_score_matrix : public tester {
+    public:
+        test_score_matrix() : tester("test_score_matrix",
+                                     "Runs test on score matrix files and metrics")
+        { }
+
+        void perform_test()
+        {
+            // Three probes against identities 1 (two images), 2 and 3. The
+            // gallery images are deliberately not grouped by identity.
+            score_matrix m;
+            m.probe_ids = {1, 2, 4};
+            m.gallery_ids = {1, 2, 1, 3};
+            m.scores = {
+                0.9f, 0.5f, 0.1f, 0.3f,     // correct images ranked 1st and 4th
+                0.2f, 0.4f, 0.8f, 0.6f,     // correct image ranked 3rd
+                0.1f, 0.2f, 0.3f, 0.4f      // not in the gallery
+            };
+
+            const std::string filename = "test_score_matrix.bin";
+            save_score_matrix(filename, m);
+            const score_matrix loaded = load_score_matrix(filename);
+            DLIB_TEST(loaded.probe_ids == m.probe_ids);
+            DLIB_TEST(loaded.gallery_ids == m.gallery_ids);
+            DLIB_TEST(loaded.scores == m.scores);
+            DLIB_TEST(loaded.row(1)[2] == 0.8f);
+
+            // A corrupt gallery size, whose score matrix would not fit in
+            // memory, is rejected before anything is allocated. It follows
+            // the 8 byte magic, two 4 byte fields and the 8 byte probe count.
+            {
+                std::fstream f(filename, std::ios::in | std::ios::out | std::ios::binary);
+                const uint64_t num_gallery = uint64_t(1) << 62;
+                f.seekp(8+4+4+8);
+                f.write(reinterpret_cast<const char*>(&num_gallery), sizeof(num_gallery));
+            }
+            DLIB_TEST(throws_runtime_error([&]() { load_score_matrix(filename); }));
+
+            // Truncated files are rejected.
+            {
+                std::ofstream fout(filename, std::ios::binary);
+                fout << "IDLASCOR";
+            }
+            DLIB_TEST(throws_runtime_error([&]() { load_score_matrix(filename); }));
+            std::remove(filename.c_str());
+
+            // Top-k: probe 1 matches at k = 1, probe 2 at k = 3.
+            const std::vector<double> top_k = top_k_accuracy(m);
+            DLIB_TEST(top_k.size() == 4);
+            DLIB_TEST(top_k[0] == 0.5 && top_k[1] == 0.5 && top_k[2] == 1 && top_k[3] == 1);
+
+            // mAP: probe 1 has hits at 1 and 4, probe 2 at 3.
+            const double ap1 = (1.0 + 2.0/4)/2;
+            const double ap2 = 1.0/3;
+            DLIB_TEST(std::abs(mean_average_precision(m) - (ap1+ap2)/2) < 1e-12);
+
+            // Single-shot: probe 1 is ranked 1st if 0.9 is chosen and 3rd
+            // otherwise, probe 2 is ranked 2nd if 0.2 is chosen and 3rd
+            // otherwise.
+            const std::vector<double> cmc = single_shot_cmc(m);
+            DLIB_TEST(cmc.size() == 3);
+            DLIB_TEST(std::abs(cmc[0] - 0.25) < 1e-12);
+            DLIB_TEST(std::abs(cmc[1] - 0.5) < 1e-12);
+            DLIB_TEST(std::abs(cmc[2] - 1) < 1e-12);
+        }
+
+        template <typename F>
+        static bool throws_runtime_error(F f)
+        {
+            try {
+                f();
+            }
+            catch (std::runtime_error&) {
+                return true;
+            }
+            return false;
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_score_matrix a;
+}
@@ -0,0 +1,81 @@
+#include <trace.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "dlib_testing_suite/tester.h"
+
+namespace
+{
+    using namespace test;
+
+    dlib::logger dlog("test.trace");
+
+    size_t count(const std::string& str, const std::string& pattern)
+    {
+        size_t num = 0;
+        for (size_t pos = str.find(pattern); pos != std::string::npos; pos = str.find(pattern, pos+1))
+            ++num;
+        return num;
+    }
+
+    class test_trace : public tester {
+    public:
+        test_trace() : tester("test_trace",
+                              "Runs test on the trace event recorder")
+        { }
+
+        void perform_test()
+        {
+            const std::string filename = "test_trace.json";
+
+            // Nothing is recorded while tracing is off.
+            DLIB_TEST(!is_tracing());
+            {
+                trace_scope scope("test untraced");
+            }
+
+            // Each thread keeps its last 4 events.
+            start_tracing(4);
+            DLIB_TEST(is_tracing());
+            std::thread worker([]() {
+                set_trace_thread_name("test \"worker\"");
+                for (int i = 0; i < 10; ++i) {
+                    trace_scope scope("test ring");
+                }
+            });
+            worker.join();
+            {
+                trace_scope outer("test outer");
+                trace_scope inner("test inner");
+            }
+            stop_tracing();
+            {
+                trace_scope scope("test untraced");
+            }
+
+            write_trace(filename);
+            std::ifstream fin(filename);
+            std::stringstream sin;
+            sin << fin.rdbuf();
+            const std::string trace = sin.str();
+
+            DLIB_TEST(trace.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[") == 0);
+            DLIB_TEST(count(trace, "\"test ring\"") == 4);
+            DLIB_TEST(count(trace, "\"test outer\"") == 1);
+            DLIB_TEST(count(trace, "\"test inner\"") == 1);
+            DLIB_TEST(count(trace, "test untraced") == 0);
+            DLIB_TEST(count(trace, "\"test \\\"worker\\\"\"") == 1);
+            DLIB_TEST(trace.substr(trace.size()-4) == "\n]}\n");
+
+            std::remove(filename.c_str());
+        }
+    };
+
+// ---------------------------------------------------------------------------
+
+    test_trace a;
+}